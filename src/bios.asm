@@ -1,110 +1,135 @@
-
 ; lux - a lightweight unix-like operating system
 ; Omar Elghoul, 2024
 ; 
 ; Boot loader for x86_64
-; bios.asm: BIOS API Calls from Protected Mode
-
-[bits 32]
+; bios.asm: BIOS API Calls from Long Mode
 
-; Generic API wrapper that self-modifies
-
-bios_api:
-    pop eax
-    mov [return_backup], eax
-    call rmode
+; offsets into BIOSCall, see lxboot.h
+CALL_EBP                    equ 28
+CALL_ES                     equ 32
+CALL_VECTOR                 equ 34
+CALL_CYCLES                 equ 40
+CALL_SIZE                   equ 48
 
 [bits 16]
 
-    mov esi, registers
-    mov eax, [esi]
-    mov ebx, [esi+4]
-    mov ecx, [esi+8]
-    mov edx, [esi+12]
-    mov edi, [esi+20]
-    mov esi, [esi+16]
-
+; bios_run: makes every call in the queue given to bios_batch, called in real
+; mode by bios_thunk; interrupts go through the IVT rather than an int
+; instruction, so every call can have its own vector
+; params: none
+; returns: nothing, the results are written back to the queue
+
+bios_run:
+    mov ebp, [bios_batch.queue]
+
+.next:
+    cmp word [bios_batch.count], 0
+    je .done
+
+    movzx bx, byte [ds:ebp+CALL_VECTOR]
+    shl bx, 2
+    mov eax, [bx]               ; IVT entry, offset and segment
+    mov [.handler], eax
+    mov [.current], ebp
+
+    ; time the handler alone, so the mode switches can be told apart from it
+    rdtsc
+    mov [.start], eax
+    mov [.start+4], edx
+
+    mov es, [ds:ebp+CALL_ES]    ; ss is not zero here
+    mov eax, [ds:ebp]
+    mov ebx, [ds:ebp+4]
+    mov ecx, [ds:ebp+8]
+    mov edx, [ds:ebp+12]
+    mov esi, [ds:ebp+16]
+    mov edi, [ds:ebp+20]
+
+    ; the same as an int instruction: flags, then a far call with interrupts
+    ; off, and the handler's iret or retf 2 takes us back
     clc
+    pushf
+    cli
+    call far [.handler]
 
-.m:   db 0xCD, 0x00   ; int instruction for self-modifying code that saves space
-
-    mov ebp, registers
-    mov [ebp], eax
-    mov [ebp+4], ebx
-    mov [ebp+8], ecx
-    mov [ebp+12], edx
-    mov [ebp+16], esi
-    mov [ebp+20], edi
+    push ebp                    ; some functions return a pointer in es:bp
     pushfd
+    push eax
+    push edx
+    rdtsc
+    mov ebp, [.current]
+    sub eax, [.start]
+    sbb edx, [.start+4]
+    mov [ds:ebp+CALL_CYCLES], eax
+    mov [ds:ebp+CALL_CYCLES+4], edx
+    pop edx
     pop eax
-    mov [ebp+24], eax
 
-    call pmode
+    mov [ds:ebp], eax
+    mov [ds:ebp+4], ebx
+    mov [ds:ebp+8], ecx
+    mov [ds:ebp+12], edx
+    mov [ds:ebp+16], esi
+    mov [ds:ebp+20], edi
+    pop eax
+    mov [ds:ebp+24], eax
+    pop eax
+    mov [ds:ebp+CALL_EBP], eax
+    mov [ds:ebp+CALL_ES], es
 
-[bits 32]
+    add ebp, CALL_SIZE
+    dec word [bios_batch.count]
+    jmp .next
 
-    mov eax, [return_backup]
-    jmp eax
+.done:
+    ret
 
-.stack:             dd 0
-.frame:             dd 0
+align 4
+.handler:               dd 0
+.current:               dd 0
+.start:                 dq 0
 
-; void video_api()
+[bits 64]
 
-video_api:
-    pusha
-    mov [stack_backup], esp
-    mov [frame_backup], ebp
+; void bios_batch(BIOSCall *queue, uint32_t count)
+; makes all the calls in a single visit to real mode
+; the queue must be in the lowest 64 KiB
 
-    mov di, bios_api.m
-    mov byte [di+1], 0x10        ; int 0x10
+bios_batch:
+    mov [.queue], edi
+    mov [.count], si
+    mov eax, bios_run
+    jmp bios_thunk
 
-    call bios_api
+align 4
+.queue:                 dd 0
+.count:                 dw 0
 
-    mov esp, [stack_backup]
-    mov ebp, [frame_backup]
-    popa
-    ret
+; void video_api()
+
+video_api:
+    mov byte [registers.vector], 0x10   ; int 0x10
+    mov edi, registers
+    mov esi, 1
+    jmp bios_batch
 
 ; void disk_api()
 
 disk_api:
-    pusha
-    mov [stack_backup], esp
-    mov [frame_backup], ebp
-
-    mov di, bios_api.m
-    mov byte [di+1], 0x13        ; int 0x13
-
-    call bios_api
-
-    mov esp, [stack_backup]
-    mov ebp, [frame_backup]
-    popa
-    ret
+    mov byte [registers.vector], 0x13   ; int 0x13
+    mov edi, registers
+    mov esi, 1
+    jmp bios_batch
 
-; void disk_api()
+; void misc_api()
 
 misc_api:
-    pusha
-    mov [stack_backup], esp
-    mov [frame_backup], ebp
-
-    mov di, bios_api.m
-    mov byte [di+1], 0x15        ; int 0x15
-
-    call bios_api
-
-    mov esp, [stack_backup]
-    mov ebp, [frame_backup]
-    popa
-    ret
-
-align 4
-stack_backup:           dd 0
-frame_backup:           dd 0
-return_backup:          dd 0
+    mov byte [registers.vector], 0x15   ; int 0x15
+    mov edi, registers
+    mov esi, 1
+    jmp bios_batch
 
+; a queue of one for the calls above
 align 4
 registers:
     .eax            dd 0
@@ -113,4 +138,10 @@ registers:
     .edx            dd 0
     .esi            dd 0
     .edi            dd 0
-    .eflags         dd 0
\ No newline at end of file
+    .eflags         dd 0
+    .ebp            dd 0
+    .es             dw 0
+    .vector         db 0
+    .function       db 0
+    .reserved       times 4 db 0
+    .cycles         dq 0
@@ -53,6 +53,10 @@ main:
     mov ds, ax      ; ds = ax = 0x4000
     mov [boot_disk], dl
 
+    rdtsc
+    mov [timestamps.start], eax
+    mov [timestamps.start+4], edx
+
     sti
 
     ; reset the drive
@@ -97,10 +101,28 @@ main:
     mov ds, ax
     xor si, si
     mov eax, [si]
+    mov bx, [si+44]         ; size in sectors, zero if it isn't given
     pop ds
     cmp eax, 0x5346584C     ; magic number
     jnz .boot_error
 
+    ; and that all of it fit in the boot blocks
+    cmp bx, [dap.count]
+    ja .size_error
+
+    ; the boot program picks up both timestamps from the reserved part of its
+    ; identification block
+    rdtsc
+    mov [timestamps.handoff], eax
+    mov [timestamps.handoff+4], edx
+
+    xor di, di
+    mov es, di
+    mov di, 0x1030
+    mov si, timestamps
+    mov cx, 8
+    rep movsw
+
     ; now run the boot program
     mov si, partition
     mov dl, [boot_disk]
@@ -110,6 +132,10 @@ main:
         mov si, drive_error
         jmp print
 
+    .size_error:
+        mov si, size_error
+        jmp print
+
     .boot_error:
         mov si, boot_error
 
@@ -141,6 +167,12 @@ partition:
 
 boot_disk:          db 0
 
+; TSC at the start of this stage and when the boot program is started
+align 4
+timestamps:
+    .start          dq 0
+    .handoff        dq 0
+
 ; disk address packet
 align 4
 dap:
@@ -153,6 +185,7 @@ dap:
 
 drive_error:        db "disk i/o error", 0
 boot_error:         db "boot program invalid", 0
+size_error:         db "boot blocks too small", 0
 
 times 510 - ($-$$)  db 0
 boot_signature:     dw 0xAA55
@@ -9,6 +9,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdbool.h>
+#include <lxboot.h>
+
+#define EBDA_POINTER            0x40E   // segment of the EBDA in the BDA
+
+static ACPITableEntry *directory;
+static int directoryCount;
 
 static ACPIRSDP *findRSDPRange(uint8_t *start, size_t count) {
     // 16-byte-aligned boundaries
@@ -53,16 +60,203 @@ static ACPIRSDP *verifyChecksum(ACPIRSDP *rsdp) {
 }
 
 ACPIRSDP *findACPIRoot() {
-    // search for 'RSD PTR ' on 16-byte-aligned boundaries in the EBDA from
-    // 0x80000-0x9FFFF, and if not found search again from 0xE0000-0xFFFFF
-    ACPIRSDP *rsdp = findRSDPRange((uint8_t *)0x80000, 0x1FFFF);
+    // search for 'RSD PTR ' on 16-byte-aligned boundaries in the first KiB of
+    // the EBDA, whose segment is in the BDA, and if not found search again
+    // from 0xE0000-0xFFFFF
+    ACPIRSDP *rsdp = NULL;
+    uintptr_t ebda = (uintptr_t)*(uint16_t *)EBDA_POINTER << 4;
+    if(ebda >= 0x80000 && ebda < 0xA0000) rsdp = findRSDPRange((uint8_t *)ebda, 1024);
     if(!rsdp) rsdp = findRSDPRange((uint8_t *)0xE0000, 0x1FFFF);
     if(rsdp) {
-        printf("acpi: found RSDP revision %d at 0x%05X\n", rsdp->revision, (uint32_t)rsdp);
+        printf("acpi: found RSDP revision %d at 0x%05X\n", rsdp->revision, (uint32_t)(uintptr_t)rsdp);
         rsdp = verifyChecksum(rsdp);
     } else {
         printf("acpi: RSDP was not found\n");
     }
 
     return rsdp;
-}
\ No newline at end of file
+}
+
+static bool tableValid(ACPIStandardHeader *header) {
+    uint8_t *bytes = (uint8_t *)header;
+    uint8_t v = 0;
+    for(uint32_t i = 0; i < header->length; i++) {
+        v += bytes[i];
+    }
+
+    return !v;
+}
+
+static void addTable(uint64_t addr) {
+    ACPIStandardHeader *table = (ACPIStandardHeader *)(uintptr_t)addr;
+    if(!table || table->length < sizeof(ACPIStandardHeader)) return;
+
+    if(!tableValid(table)) {
+        printf("acpi: checksum failed for %c%c%c%c, ignoring it\n", table->signature[0], table->signature[1], table->signature[2], table->signature[3]);
+        return;
+    }
+
+    memcpy(directory[directoryCount].signature, table->signature, 4);
+    directory[directoryCount].length = table->length;
+    directory[directoryCount].address = addr;
+    directoryCount++;
+}
+
+static int rootEntries(ACPIStandardHeader *root, int entrySize) {
+    return (root->length - sizeof(ACPIStandardHeader)) / entrySize;
+}
+
+static void walkRoot(ACPIStandardHeader *root, int entrySize) {
+    int count = rootEntries(root, entrySize);
+    uint8_t *entries = (uint8_t *)root + sizeof(ACPIStandardHeader);
+
+    for(int i = 0; i < count; i++) {
+        uint64_t addr;
+        if(entrySize == 8) memcpy(&addr, entries + (i * 8), 8);
+        else addr = *(uint32_t *)(entries + (i * 4));
+
+        addTable(addr);
+    }
+
+    // the DSDT is only reachable through the FADT
+    ACPIFADT *fadt = findACPITable("FACP");
+    if(fadt) {
+        uint64_t dsdt = fadt->dsdt;
+        if(fadt->header.length >= (offsetof(ACPIFADT, xDSDT) + 8) && fadt->xDSDT) dsdt = fadt->xDSDT;
+        addTable(dsdt);
+    }
+}
+
+// firmware may list a CPU both as a local APIC and as an x2APIC
+static uint32_t madtAPICID(MADTEntryHeader *entry) {
+    if(entry->type == MADT_LOCAL_APIC) {
+        MADTLocalAPIC *cpu = (MADTLocalAPIC *)entry;
+        if((cpu->flags & MADT_CPU_ENABLED) && cpu->apicID != 0xFF) return cpu->apicID;
+    } else if(entry->type == MADT_LOCAL_X2APIC) {
+        MADTLocalX2APIC *cpu = (MADTLocalX2APIC *)entry;
+        if(cpu->flags & MADT_CPU_ENABLED) return cpu->x2apicID;
+    }
+
+    return 0xFFFFFFFF;
+}
+
+static bool listedBefore(ACPIMADT *madt, uint8_t *current, uint32_t apicID) {
+    uint8_t *ptr = (uint8_t *)madt + sizeof(ACPIMADT);
+    while(ptr < current) {
+        MADTEntryHeader *entry = (MADTEntryHeader *)ptr;
+        if(madtAPICID(entry) == apicID) return true;
+        ptr += entry->length;
+    }
+
+    return false;
+}
+
+static void summarizeMADT(ACPISummary *summary) {
+    ACPIMADT *madt = findACPITable("APIC");
+    if(!madt) return;
+
+    uint8_t *ptr = (uint8_t *)madt + sizeof(ACPIMADT);
+    uint8_t *end = (uint8_t *)madt + madt->header.length;
+
+    while((ptr + sizeof(MADTEntryHeader)) <= end) {
+        MADTEntryHeader *entry = (MADTEntryHeader *)ptr;
+        if(entry->length < sizeof(MADTEntryHeader)) break;
+
+        uint32_t apicID = madtAPICID(entry);
+        if(apicID != 0xFFFFFFFF) {
+            if(!listedBefore(madt, ptr, apicID)) summary->cpuCount++;
+        } else if(entry->type == MADT_IO_APIC) {
+            summary->ioapicCount++;
+        }
+
+        ptr += entry->length;
+    }
+}
+
+static void summarizeFADT(ACPISummary *summary) {
+    ACPIFADT *fadt = findACPITable("FACP");
+    if(!fadt) return;
+
+    // the extended address wins only if it is a usable I/O port, otherwise
+    // the legacy block still is
+    uint64_t port = 0;
+    if(fadt->header.length >= sizeof(ACPIFADT) && fadt->xPMTimer.space == ACPI_SPACE_IO &&
+    fadt->xPMTimer.address && fadt->xPMTimer.address <= 0xFFFF) {
+        port = fadt->xPMTimer.address;
+    } else if(fadt->header.length >= offsetof(ACPIFADT, flags) + 4 && fadt->pmTimerLength == 4) {
+        port = fadt->pmTimer;
+    }
+
+    if(port && port <= 0xFFFF) {
+        summary->pmTimerPort = port;
+        summary->pmTimerBits = (fadt->flags & FADT_TIMER_32) ? 32 : 24;
+    }
+}
+
+/*
+ * acpiInit(): validates every ACPI table once and builds a directory of them
+ * this must be called after the kernel is loaded, as the directory is passed
+ * on to the kernel
+ * params: rsdp - root system description pointer
+ * params: summary - pointer to where to store the directory and the counts
+ * parsed out of the MADT and FADT
+ * returns: number of tables in the directory
+ */
+
+int acpiInit(ACPIRSDP *rsdp, ACPISummary *summary) {
+    memset(summary, 0, sizeof(ACPISummary));
+    if(!rsdp) return 0;
+
+    bool extended = rsdp->revision >= 2 && rsdp->xsdt;
+    ACPIStandardHeader *root = (ACPIStandardHeader *)(uintptr_t)(extended ? rsdp->xsdt : rsdp->rsdt);
+    if(!root || !tableValid(root)) {
+        printf("acpi: %s is corrupt, ignoring ACPI tables\n", extended ? "XSDT" : "RSDT");
+        return 0;
+    }
+
+    // every table is checked once, on the way into the directory, which has
+    // room for all of the root's entries plus the DSDT behind the FADT
+    directory = NULL;
+    directoryCount = 0;
+    ACPITableEntry *table = (ACPITableEntry *)(uintptr_t)allocAligned((rootEntries(root, extended ? 8 : 4) + 1) * sizeof(ACPITableEntry), PAGE_SIZE, BOOT_MEMORY_BOOT_INFO);
+    if(!table) {
+        printf("acpi: not enough memory for the table directory\n");
+        return 0;
+    }
+
+    directory = table;
+    walkRoot(root, extended ? 8 : 4);
+    if(!directoryCount) {
+        directory = NULL;
+        return 0;
+    }
+
+    summary->tables = (uintptr_t)directory;
+    summary->tableCount = directoryCount;
+    summarizeMADT(summary);
+    summarizeFADT(summary);
+
+    printf("acpi: %d tables, %d CPUs, %d I/O APICs", directoryCount, summary->cpuCount, summary->ioapicCount);
+    if(summary->pmTimerPort) printf(", %d-bit PM timer at port 0x%04X\n", summary->pmTimerBits, summary->pmTimerPort);
+    else printf("\n");
+
+    return directoryCount;
+}
+
+/*
+ * findACPITable(): finds a table in the directory built by acpiInit()
+ * params: signature - four-character signature of the table
+ * returns: pointer to the table, NULL if not present or corrupt
+ */
+
+void *findACPITable(const char *signature) {
+    if(!directory) return NULL;
+
+    for(int i = 0; i < directoryCount; i++) {
+        if(!memcmp(directory[i].signature, signature, 4)) {
+            return (void *)(uintptr_t)directory[i].address;
+        }
+    }
+
+    return NULL;
+}
@@ -0,0 +1,301 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* Page-granular physical memory allocator */
+/* Memory is carved out of the usable entries of the E820 memory map, and every
+ * allocation is recorded in a table that is passed on to the kernel */
+
+#include <lxboot.h>
+#include <stdio.h>
+
+#define ALLOC_MAX_RANGES        64
+#define LOW_MEMORY_LIMIT        0x60000     // early page tables and the stacks
+#define STACK_TOP               0x80000
+#define HIGH_MEMORY_START       0x100000
+#define HIGH_MEMORY_LIMIT       0x100000000 // covered by the early page tables
+
+extern char end[];      // end of the loader image, see lxboot.ld
+
+static BootMemoryRange ranges[ALLOC_MAX_RANGES];
+static int rangeCount = 0;
+
+// persistent allocations are packed right after the kernel, and this is where
+// the next one may start
+static uint64_t persistentTop = HIGH_MEMORY_START;
+
+// end of the memory that is mapped and may be allocated
+static uint64_t highLimit = HIGH_MEMORY_LIMIT;
+
+typedef struct {
+    uint64_t min;
+    uint64_t max;
+    uint64_t size;
+    uint64_t alignment;
+    bool topDown;
+
+    bool found;
+    uint64_t best;
+} AllocSearch;
+
+static uint64_t alignUp(uint64_t addr, uint64_t alignment) {
+    return (addr + alignment - 1) & ~(alignment - 1);
+}
+
+static uint64_t alignDown(uint64_t addr, uint64_t alignment) {
+    return addr & ~(alignment - 1);
+}
+
+static bool isFree(uint64_t base, uint64_t size) {
+    if(!memoryRangeUsable(base, size)) return false;
+
+    for(int i = 0; i < rangeCount; i++) {
+        if(base < (ranges[i].base + ranges[i].size) && (base + size) > ranges[i].base) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool addRange(uint64_t base, uint64_t size, uint32_t type) {
+    if(type != BOOT_MEMORY_LOADER && (base + size) > persistentTop) {
+        persistentTop = base + size;
+    }
+
+    // merge with a neighbor of the same type to keep the table short
+    for(int i = 0; i < rangeCount; i++) {
+        if(ranges[i].type != type) continue;
+
+        if((ranges[i].base + ranges[i].size) == base) {
+            ranges[i].size += size;
+            return true;
+        } else if(ranges[i].base == (base + size)) {
+            ranges[i].base = base;
+            ranges[i].size += size;
+            return true;
+        }
+    }
+
+    if(rangeCount >= ALLOC_MAX_RANGES) {
+        printf("alloc: allocation table is full\n");
+        return false;
+    }
+
+    ranges[rangeCount].base = base;
+    ranges[rangeCount].size = size;
+    ranges[rangeCount].type = type;
+    ranges[rangeCount].reserved = 0;
+    rangeCount++;
+    return true;
+}
+
+static void tryBoundary(AllocSearch *s, uint64_t boundary) {
+    uint64_t addr;
+
+    if(s->topDown) {
+        if(boundary < s->size) return;
+        addr = alignDown(boundary - s->size, s->alignment);
+    } else {
+        addr = alignUp(boundary, s->alignment);
+    }
+
+    if(addr < s->min || (addr + s->size) > s->max) return;
+    if(!isFree(addr, s->size)) return;
+
+    if(!s->found || (s->topDown && addr > s->best) || (!s->topDown && addr < s->best)) {
+        s->best = addr;
+        s->found = true;
+    }
+}
+
+static uint64_t findFree(uint64_t min, uint64_t max, uint64_t size, uint64_t alignment, bool topDown) {
+    AllocSearch s;
+    s.min = min;
+    s.max = max;
+    s.size = size;
+    s.alignment = alignment;
+    s.topDown = topDown;
+    s.found = false;
+    s.best = 0;
+
+    // the lowest or highest fit always starts or ends next to the edge of the
+    // search window, a memory map entry, or an existing allocation
+    tryBoundary(&s, min);
+    tryBoundary(&s, max);
+
+    for(int i = 0; i < memoryMapCount; i++) {
+        tryBoundary(&s, memoryMap[i].base);
+        tryBoundary(&s, memoryMap[i].base + memoryMap[i].len);
+    }
+
+    for(int i = 0; i < rangeCount; i++) {
+        tryBoundary(&s, ranges[i].base);
+        tryBoundary(&s, ranges[i].base + ranges[i].size);
+    }
+
+    return s.found ? s.best : 0;
+}
+
+/*
+ * allocInit(): initializes the allocator from the memory map
+ * this must be called after detectMemory() and before any other allocation
+ */
+
+void allocInit() {
+    rangeCount = 0;
+    persistentTop = HIGH_MEMORY_START;
+    highLimit = HIGH_MEMORY_LIMIT;
+
+    // the IVT, BDA, and loader image are already in use, and so are the early
+    // page tables, the real mode stack, and the long mode stack
+    addRange(0, alignUp((uintptr_t)end, PAGE_SIZE), BOOT_MEMORY_LOADER);
+    addRange(LOW_MEMORY_LIMIT, STACK_TOP - LOW_MEMORY_LIMIT, BOOT_MEMORY_LOADER);
+}
+
+/*
+ * allocSetLimit(): allows allocations up to a higher physical address
+ * this must only be called once the memory up to the limit is mapped
+ * params: limit - end of the memory that may be allocated
+ * returns: nothing
+ */
+
+void allocSetLimit(uint64_t limit) {
+    if(limit > highLimit) highLimit = limit;
+}
+
+/*
+ * allocReserve(): marks a fixed physical range as allocated
+ * params: base - start of the range
+ * params: size - size of the range in bytes
+ * params: type - BOOT_MEMORY_* type reported to the kernel
+ * returns: true on success, false if the range is not free
+ */
+
+bool allocReserve(uint64_t base, uint64_t size, uint32_t type) {
+    if(!isFree(base, size)) return false;
+    return addRange(base, size, type);
+}
+
+/*
+ * allocAligned(): allocates persistent memory after the kernel and payloads
+ * params: size - size in bytes, rounded up to the alignment
+ * params: alignment - power of two, at least PAGE_SIZE
+ * params: type - BOOT_MEMORY_* type reported to the kernel
+ * returns: physical address, zero if there is no room
+ */
+
+uint64_t allocAligned(uint64_t size, uint64_t alignment, uint32_t type) {
+    size = alignUp(size, alignment);
+    uint64_t addr = findFree(persistentTop, highLimit, size, alignment, false);
+    if(!addr || !addRange(addr, size, type)) return 0;
+    return addr;
+}
+
+/*
+ * allocFree(): returns memory that turned out not to be needed
+ * params: base - start of the memory, as returned by one of the functions here
+ * params: size - size in bytes, rounded up to whole pages
+ * returns: nothing
+ */
+
+void allocFree(uint64_t base, uint64_t size) {
+    size = alignUp(size, PAGE_SIZE);
+
+    for(int i = 0; i < rangeCount; i++) {
+        uint64_t end = ranges[i].base + ranges[i].size;
+        if(base < ranges[i].base || (base + size) > end) continue;
+
+        if(base == ranges[i].base && size == ranges[i].size) {
+            ranges[i] = ranges[--rangeCount];
+        } else if(base == ranges[i].base) {
+            ranges[i].base += size;
+            ranges[i].size -= size;
+        } else if((base + size) == end) {
+            ranges[i].size -= size;
+        } else {
+            // the rest of the range stays allocated on both sides
+            ranges[i].size = base - ranges[i].base;
+            addRange(base + size, end - (base + size), ranges[i].type);
+        }
+
+        break;
+    }
+
+    // the next persistent allocation may start lower again
+    persistentTop = HIGH_MEMORY_START;
+    for(int i = 0; i < rangeCount; i++) {
+        if(ranges[i].type != BOOT_MEMORY_LOADER && (ranges[i].base + ranges[i].size) > persistentTop) {
+            persistentTop = ranges[i].base + ranges[i].size;
+        }
+    }
+}
+
+/*
+ * allocPages(): allocates page-aligned memory
+ * params: count - number of pages
+ * params: type - BOOT_MEMORY_LOADER for scratch memory that is taken from the
+ * top of memory and may be reclaimed by the kernel, or any other type for
+ * memory that stays in use after the kernel is started
+ * returns: pointer to the memory, does not return on failure
+ */
+
+void *allocPages(size_t count, uint32_t type) {
+    uint64_t size = (uint64_t)count * PAGE_SIZE;
+    uint64_t addr;
+
+    if(type == BOOT_MEMORY_LOADER) {
+        addr = findFree(HIGH_MEMORY_START, highLimit, size, PAGE_SIZE, true);
+        if(addr && !addRange(addr, size, type)) addr = 0;
+    } else {
+        addr = allocAligned(size, PAGE_SIZE, type);
+    }
+
+    if(!addr) {
+        printf("alloc: unable to allocate %d pages\n", count);
+        halt();
+    }
+
+    return (void *)(uintptr_t)addr;
+}
+
+/*
+ * allocLowPages(): allocates scratch memory below 1 MiB for use by the BIOS
+ * params: count - number of pages
+ * params: alignment - power of two, at least PAGE_SIZE
+ * returns: pointer to the memory, does not return on failure
+ */
+
+void *allocLowPages(size_t count, size_t alignment) {
+    uint64_t size = (uint64_t)count * PAGE_SIZE;
+    uint64_t addr = findFree(PAGE_SIZE, LOW_MEMORY_LIMIT, size, alignment, true);
+
+    if(!addr || !addRange(addr, size, BOOT_MEMORY_LOADER)) {
+        printf("alloc: unable to allocate %d pages of low memory\n", count);
+        halt();
+    }
+
+    return (void *)(uintptr_t)addr;
+}
+
+/*
+ * allocLowestFree(): returns the end of the highest persistent allocation
+ * everything above this is either free or loader scratch memory
+ */
+
+uint64_t allocLowestFree() {
+    return alignUp(persistentTop, PAGE_SIZE);
+}
+
+/*
+ * allocTable(): returns the table of allocations
+ * params: count - pointer to where to store the number of entries
+ */
+
+BootMemoryRange *allocTable(int *count) {
+    *count = rangeCount;
+    return ranges;
+}
@@ -9,26 +9,28 @@
 #include <lxfs.h>
 #include <stdio.h>
 #include <string.h>
-
-#define CONFIG_BUFFER           (char *)0x100000
+#include <stdlib.h>
 
 static BootConfig config;
+static char *configBuffer;
 
 int loadConfig(const char *path) {
     memset(&config, 0, sizeof(BootConfig));
-    if(!lxfsRead(bootInfo.bootDevice, partitionIndex, path, CONFIG_BUFFER)) {
+    config.size = lxfsSize(bootInfo.bootDevice, partitionIndex, path);
+    configBuffer = allocPages(lxfsBufferSize(config.size) / PAGE_SIZE, BOOT_MEMORY_LOADER);
+
+    if(!lxfsRead(bootInfo.bootDevice, partitionIndex, path, configBuffer)) {
         printf("failed to load /lxboot.conf");
-        while(1);
+        halt();
     }
 
-    config.size = lxfsSize(bootInfo.bootDevice, partitionIndex, path);
     if(!config.size) {
         printf("boot configuration file is empty, no boot option available");
-        while(1);
+        halt();
     }
 
     for(size_t i = 0; i < (config.size - 7); i++) {
-        if(!memcmp(CONFIG_BUFFER+i, "[entry]", 7)) {
+        if(!memcmp(configBuffer+i, "[entry]", 7)) {
             config.count++;
         }
     }
@@ -37,7 +39,7 @@ int loadConfig(const char *path) {
 
     if(!config.count) {
         printf("no boot option available");
-        while(1);
+        halt();
     }
 
     return config.count;
@@ -77,6 +79,87 @@ static char *appendLine(char *dest, char *line) {
     return copyLine(dest + strlen(dest), line);
 }
 
+static char *parseNumber(char *str, int *value) {
+    // returns the character after the number, or NULL if there is none
+    if(*str < '0' || *str > '9') return NULL;
+
+    *value = 0;
+    while(*str >= '0' && *str <= '9') {
+        *value = (*value * 10) + (*str - '0');
+        str++;
+    }
+
+    return str;
+}
+
+static uint64_t parseKiB(char *str) {
+    // 64-bit so that sizes of 2 GiB and up don't overflow
+    uint64_t value = 0;
+    while(*str >= '0' && *str <= '9') {
+        value = (value * 10) + (*str - '0');
+        str++;
+    }
+
+    return value * 1024;
+}
+
+static bool parseVideo(char *str) {
+    // 'video none' and 'video text' keep the loader away from VESA entirely
+    if(!memcmp(str, "none", 4) && (str[4] == '\n' || !str[4])) {
+        config.videoOutput = VIDEO_OUTPUT_NONE;
+        return true;
+    } else if(!memcmp(str, "text", 4) && (str[4] == '\n' || !str[4])) {
+        config.videoOutput = VIDEO_OUTPUT_TEXT;
+        return true;
+    }
+
+    // 'video WxH' or 'video WxHxBPP'
+    int width, height, bpp = 0;
+    str = parseNumber(str, &width);
+    if(!str || *str != 'x') return false;
+    str = parseNumber(str + 1, &height);
+    if(!str) return false;
+    if(*str == 'x') {
+        str = parseNumber(str + 1, &bpp);
+        if(!str) return false;
+    }
+
+    if(*str && *str != '\n') return false;
+    if(!width || !height || width > 0xFFFF || height > 0xFFFF || (bpp && (bpp < 15 || bpp > 32))) return false;
+
+    config.videoWidth = width;
+    config.videoHeight = height;
+    config.videoBpp = bpp;
+    config.videoOutput = VIDEO_OUTPUT_GRAPHICS;
+    return true;
+}
+
+static bool parseConsole(char *str) {
+    // any number of space-separated outputs
+    char word[16];
+    config.console = 0;
+    while(*str && *str != '\n') {
+        if(*str == ' ') {
+            str++;
+            continue;
+        }
+
+        size_t len = 0;
+        while(str[len] && str[len] != '\n' && str[len] != ' ') len++;
+        if(len >= sizeof(word)) return false;
+
+        copyWord(word, str);
+        str += len;
+
+        if(!strcmp(word, "vga")) config.console |= CONSOLE_OUTPUT_VGA;
+        else if(!strcmp(word, "serial")) config.console |= CONSOLE_OUTPUT_SERIAL;
+        else if(!strcmp(word, "bios")) config.console |= CONSOLE_OUTPUT_BIOS;
+        else return false;
+    }
+
+    return config.console != 0;
+}
+
 char *copyModule(char *dest, char *modules, int index) {
     int count = 0;
     int i;
@@ -99,7 +182,7 @@ BootConfig *selectBootOption(int option) {
     int count = 0;
     size_t i;
     for(i = 0; i < (config.size - 7); i++) {
-        if(!memcmp(CONFIG_BUFFER+i, "[entry]", 7)) {
+        if(!memcmp(configBuffer+i, "[entry]", 7)) {
             count++;
             if(count > option) break;
         }
@@ -113,10 +196,21 @@ BootConfig *selectBootOption(int option) {
     memset(config.ramdisk, 0, CONFIG_MAX_KERNEL);
     memset(config.arguments, 0, CONFIG_MAX_ARGUMENTS);
     memset(config.modules, 0, CONFIG_MAX_MODULES);
+    memset(config.preload, 0, CONFIG_MAX_PRELOAD);
     config.moduleCount = 0;
+    config.preloadCount = 0;
+    config.ramdiskLazy = false;
+    config.ramdiskPrefix = 0;
+    config.videoWidth = 0;
+    config.videoHeight = 0;
+    config.videoBpp = 0;
+    config.videoOutput = VIDEO_OUTPUT_GRAPHICS;
+    config.console = 0;
+    config.quiet = false;
+    config.timeline = false;
 
     // now parse the boot option
-    char *entry = CONFIG_BUFFER+i;
+    char *entry = configBuffer+i;
     entry = skipLine(entry);
 
     while(memcmp(entry, "boot", 4)) {
@@ -135,16 +229,51 @@ BootConfig *selectBootOption(int option) {
                 //printf("config: kernel arguments '%s'\n", config.arguments);
             }
         } else if(!memcmp(entry, "ramdisk ", 8)) {
-            copyLine(config.ramdisk, entry + 8);
+            copyWord(config.ramdisk, entry + 8);
             //printf("config: using ramdisk '%s'\n", config.ramdisk);
+
+            char *options = entry + 8 + strlen(config.ramdisk);
+            if(!memcmp(options, " lazy", 5) && (options[5] == ' ' || options[5] == '\n' || !options[5])) {
+                config.ramdiskLazy = true;
+                if(options[5] == ' ') config.ramdiskPrefix = parseKiB(options + 6);
+            }
         } else if(!memcmp(entry, "module ", 7)) {
             appendLine(config.modules, entry + 7);
             appendLine(config.modules, " ");
             //printf("config: kernel boot module '%s'\n", copyLine(line, entry + 7));
             config.moduleCount++;
+        } else if(!memcmp(entry, "preload ", 8)) {
+            // any number of space-separated files or directories
+            if((strlen(config.preload) + lineLength(entry + 8) + 2) > CONFIG_MAX_PRELOAD) {
+                printf("config: preload list is longer than %d characters\n", CONFIG_MAX_PRELOAD);
+                halt();
+            }
+
+            appendLine(config.preload, entry + 8);
+            appendLine(config.preload, " ");
+
+            // paths are separated by single spaces, same as modules
+            config.preloadCount = 0;
+            for(size_t j = 0; j < strlen(config.preload); j++) {
+                if(config.preload[j] == ' ') config.preloadCount++;
+            }
+        } else if(!memcmp(entry, "video ", 6)) {
+            if(!parseVideo(entry + 6)) {
+                printf("config: invalid video mode '%s', expected none, text, WxH or WxHxBPP\n", copyLine(line, entry + 6));
+                halt();
+            }
+        } else if(!memcmp(entry, "console ", 8)) {
+            if(!parseConsole(entry + 8)) {
+                printf("config: invalid console '%s', expected any of vga, serial, bios\n", copyLine(line, entry + 8));
+                halt();
+            }
+        } else if(!memcmp(entry, "quiet", 5) && (entry[5] == '\n' || !entry[5])) {
+            config.quiet = true;
+        } else if(!memcmp(entry, "timeline", 8) && (entry[8] == '\n' || !entry[8])) {
+            config.timeline = true;
         } else {
             printf("config: undefined command '%s', aborting\n", copyLine(line, entry));
-            while(1);
+            halt();
         }
 
         entry = skipLine(entry);
@@ -153,12 +282,12 @@ BootConfig *selectBootOption(int option) {
     // verify boot option
     if(!strlen(config.kernel) || !strlen(config.disk)) {
         printf("boot option does not specify kernel or boot device\n");
-        while(1);
+        halt();
     }
 
     if(config.moduleCount > 16) {
         printf("module count of %d is larger than the limit of 16\n", config.moduleCount);
-        while(1);
+        halt();
     }
 
     return &config;
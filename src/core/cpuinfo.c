@@ -0,0 +1,140 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* CPUID snapshot */
+/* the leaves the kernel needs before it has its own CPUID layer, taken once on
+ * the BSP */
+
+#include <lxboot.h>
+#include <stdio.h>
+#include <string.h>
+#include <cpu.h>
+
+static void readCaches(CPUInfo *info, uint32_t leaf) {
+    uint32_t eax, ebx, ecx, edx;
+
+    for(int i = 0; info->cacheCount < CPU_MAX_CACHES; i++) {
+        cpuid(leaf, i, &eax, &ebx, &ecx, &edx);
+        if(!(eax & 0x1F)) break;        // no more caches
+
+        CPUCache *cache = &info->caches[info->cacheCount++];
+        cache->type = eax & 0x1F;
+        cache->level = (eax >> 5) & 7;
+        cache->sharing = ((eax >> 14) & 0xFFF) + 1;
+        cache->lineSize = (ebx & 0xFFF) + 1;
+        cache->ways = ((ebx >> 22) & 0x3FF) + 1;
+        cache->sets = ecx + 1;
+
+        uint32_t partitions = ((ebx >> 12) & 0x3FF) + 1;
+        cache->size = cache->ways * partitions * cache->lineSize * cache->sets;
+    }
+}
+
+static void readTopology(CPUInfo *info, uint32_t leaf) {
+    uint32_t eax, ebx, ecx, edx;
+
+    for(int i = 0; info->topologyCount < CPU_MAX_TOPOLOGY; i++) {
+        cpuid(leaf, i, &eax, &ebx, &ecx, &edx);
+        if(!((ecx >> 8) & 0xFF)) break;     // invalid level ends the list
+
+        CPUTopology *level = &info->topology[info->topologyCount++];
+        level->type = (ecx >> 8) & 0xFF;
+        level->shift = eax & 0x1F;
+        level->count = ebx & 0xFFFF;
+    }
+}
+
+/*
+ * cpuSnapshot(): captures the CPUID leaves passed on to the kernel
+ * this must be called after the kernel is loaded, as the snapshot is passed
+ * on to the kernel
+ * returns: pointer to the snapshot, does not return on failure
+ */
+
+CPUInfo *cpuSnapshot() {
+    CPUInfo *info = (CPUInfo *)allocPages((sizeof(CPUInfo) + PAGE_SIZE - 1) / PAGE_SIZE, BOOT_MEMORY_BOOT_INFO);
+    memset(info, 0, sizeof(CPUInfo));
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_VENDOR, 0, &eax, &ebx, &ecx, &edx);
+    info->maxLeaf = eax;
+    memcpy(info->vendor, &ebx, 4);
+    memcpy(info->vendor + 4, &edx, 4);
+    memcpy(info->vendor + 8, &ecx, 4);
+
+    cpuid(CPUID_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+    info->signature = eax;
+    info->features[0] = ecx;
+    info->features[1] = edx;
+    bool xsave = ecx & CPUID_FEATURES_ECX_XSAVE;
+
+    if(info->maxLeaf >= CPUID_TLB) {
+        cpuid(CPUID_TLB, 0, &eax, &ebx, &ecx, &edx);
+        info->tlbDescriptors[0] = eax;
+        info->tlbDescriptors[1] = ebx;
+        info->tlbDescriptors[2] = ecx;
+        info->tlbDescriptors[3] = edx;
+    }
+
+    if(info->maxLeaf >= CPUID_STRUCTURED_FEATURES) {
+        cpuid(CPUID_STRUCTURED_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+        info->structuredFeatures[0] = ebx;
+        info->structuredFeatures[1] = ecx;
+        info->structuredFeatures[2] = edx;
+    }
+
+    if(xsave && info->maxLeaf >= CPUID_XSAVE) {
+        cpuid(CPUID_XSAVE, 0, &eax, &ebx, &ecx, &edx);
+        info->xsaveFeatures = ((uint64_t)edx << 32) | eax;
+        info->xsaveSize = ecx;
+    }
+
+    cpuid(CPUID_EXTENDED_MAX, 0, &eax, &ebx, &ecx, &edx);
+    info->maxExtendedLeaf = eax;
+
+    if(info->maxExtendedLeaf >= CPUID_EXTENDED_FEATURES) {
+        cpuid(CPUID_EXTENDED_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+        info->extendedFeatures[0] = ecx;
+        info->extendedFeatures[1] = edx;
+    }
+
+    if(info->maxExtendedLeaf >= CPUID_L2_CACHE_TLB) {
+        for(int i = 0; i < 2; i++) {
+            cpuid(CPUID_L1_CACHE_TLB + i, 0, &eax, &ebx, &ecx, &edx);
+            info->tlbExtended[(i * 4)] = eax;
+            info->tlbExtended[(i * 4) + 1] = ebx;
+            info->tlbExtended[(i * 4) + 2] = ecx;
+            info->tlbExtended[(i * 4) + 3] = edx;
+        }
+    }
+
+    if(info->maxExtendedLeaf >= CPUID_ADDRESS_SIZE) {
+        cpuid(CPUID_ADDRESS_SIZE, 0, &eax, &ebx, &ecx, &edx);
+        info->physicalAddressBits = eax & 0xFF;
+        info->linearAddressBits = (eax >> 8) & 0xFF;
+    } else {
+        info->physicalAddressBits = 36;
+        info->linearAddressBits = 48;
+    }
+
+    // Intel describes caches in leaf 4 and AMD in 0x8000001D, which has the
+    // same layout
+    if(info->maxLeaf >= CPUID_CACHE) readCaches(info, CPUID_CACHE);
+    if(!info->cacheCount && info->maxExtendedLeaf >= CPUID_EXTENDED_CACHE &&
+    (info->extendedFeatures[0] & CPUID_EXTENDED_ECX_TOPOLOGY)) {
+        readCaches(info, CPUID_EXTENDED_CACHE);
+    }
+
+    if(info->maxLeaf >= CPUID_TOPOLOGY_V2) readTopology(info, CPUID_TOPOLOGY_V2);
+    if(!info->topologyCount && info->maxLeaf >= CPUID_TOPOLOGY) readTopology(info, CPUID_TOPOLOGY);
+
+    char vendor[13];
+    memcpy(vendor, info->vendor, 12);
+    vendor[12] = 0;
+    printf("cpu: %s signature 0x%X, %d-bit physical addresses, %d caches\n", vendor, info->signature, info->physicalAddressBits, info->cacheCount);
+    return info;
+}
@@ -0,0 +1,150 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* BIOS calls */
+/* every call goes through biosBatch(), so a build with BIOS_PROFILE can count
+ * each BIOS function and tell the time spent in the BIOS apart from the time
+ * spent switching modes */
+
+#include <lxboot.h>
+#include <stdio.h>
+#include <string.h>
+#include <cpu.h>
+
+REAL_MODE_BUFFER BIOSCall biosQueue[BIOS_BATCH_MAX];
+
+#ifdef BIOS_PROFILE
+static BIOSProfileEntry profile[BIOS_PROFILE_MAX];
+static int profileCount = 1;            // the round trips are always first
+static uint32_t profileDropped = 0;
+
+static void profileAdd(BIOSProfileEntry *entry, uint64_t cycles) {
+    int bucket = cycles ? 63 - __builtin_clzll(cycles) : 0;
+    if(bucket >= BIOS_PROFILE_BUCKETS) bucket = BIOS_PROFILE_BUCKETS - 1;
+
+    entry->count++;
+    entry->cycles += cycles;
+    if(entry->histogram[bucket] != 0xFFFF) entry->histogram[bucket]++;
+}
+
+static BIOSProfileEntry *profileFind(uint8_t vector, uint8_t function) {
+    for(int i = 1; i < profileCount; i++) {
+        if(profile[i].vector == vector && profile[i].function == function) return &profile[i];
+    }
+
+    if(profileCount >= BIOS_PROFILE_MAX) return NULL;
+
+    profile[profileCount].vector = vector;
+    profile[profileCount].function = function;
+    return &profile[profileCount++];
+}
+
+static void profileBatch(BIOSCall *calls, int count, uint64_t total) {
+    // whatever the round trip took beyond the handlers went to the mode
+    // switches and the thunk
+    uint64_t handlers = 0;
+    for(int i = 0; i < count; i++) {
+        handlers += calls[i].cycles;
+
+        BIOSProfileEntry *entry = profileFind(calls[i].vector, calls[i].function);
+        if(entry) profileAdd(entry, calls[i].cycles);
+        else profileDropped++;
+    }
+
+    profileAdd(&profile[0], total > handlers ? total - handlers : 0);
+}
+#endif
+
+/*
+ * biosBatch(): makes several BIOS calls in one round trip to real mode
+ * params: calls - queue of calls, which must be in the lowest 64 KiB
+ * params: count - number of calls
+ * returns: nothing, the results are in each call's registers
+ */
+
+void biosBatch(BIOSCall *calls, int count) {
+    void (*b)(BIOSCall *, uint32_t) = (void (*)(BIOSCall *, uint32_t))(uintptr_t)bootInfo.batchAPI;
+    if(count <= 0) return;
+
+    for(int i = 0; i < count; i++) calls[i].function = (calls[i].regs.eax >> 8) & 0xFF;
+
+#ifdef BIOS_PROFILE
+    uint64_t start = rdtsc();
+    b(calls, count);
+    profileBatch(calls, count, rdtsc() - start);
+#else
+    b(calls, count);
+#endif
+}
+
+/*
+ * biosCall(): makes a single BIOS call
+ * params: vector - interrupt number
+ * params: regs - registers to pass, es is always zero
+ * returns: nothing, the results are in biosRegs
+ */
+
+void biosCall(uint8_t vector, CPURegisters *regs) {
+    // biosRegs is the one-entry queue in bios.asm
+    BIOSCall *call = (BIOSCall *)biosRegs;
+    memcpy(&call->regs, regs, sizeof(CPURegisters));
+    call->regs.es = 0;
+    call->vector = vector;
+    biosBatch(call, 1);
+}
+
+/*
+ * biosProfileHandoff(): copies the BIOS profile for the kernel
+ * params: address - pointer to where to store the address of the copy
+ * returns: number of entries in the copy, zero without BIOS_PROFILE
+ */
+
+uint16_t biosProfileHandoff(uint64_t *address) {
+    *address = 0;
+
+#ifdef BIOS_PROFILE
+    *address = allocAligned(profileCount * sizeof(BIOSProfileEntry), PAGE_SIZE, BOOT_MEMORY_BOOT_INFO);
+    if(!*address) return 0;
+
+    memcpy((void *)(uintptr_t)*address, profile, profileCount * sizeof(BIOSProfileEntry));
+    return profileCount;
+#else
+    return 0;
+#endif
+}
+
+/*
+ * biosProfilePrint(): prints the BIOS profile
+ * params: frequency - TSC frequency in Hz
+ * returns: nothing
+ */
+
+void biosProfilePrint(uint64_t frequency) {
+#ifdef BIOS_PROFILE
+    if(!frequency) return;
+
+    // take a snapshot first, the printing itself may call the BIOS
+    BIOSProfileEntry snapshot[BIOS_PROFILE_MAX];
+    int count = profileCount;
+    memcpy(snapshot, profile, count * sizeof(BIOSProfileEntry));
+
+    printf("bios:  int   ah  calls       us  log2 ticks:calls\n");
+    for(int i = 0; i < count; i++) {
+        uint64_t us = (snapshot[i].cycles * 1000000) / frequency;
+        if(!i) printf("bios: switch   %6d %8d ", snapshot[i].count, (uint32_t)us);
+        else printf("bios: 0x%02X 0x%02X %6d %8d ", snapshot[i].vector, snapshot[i].function, snapshot[i].count, (uint32_t)us);
+
+        for(int j = 0; j < BIOS_PROFILE_BUCKETS; j++) {
+            if(snapshot[i].histogram[j]) printf(" %d:%d", j, snapshot[i].histogram[j]);
+        }
+
+        printf("\n");
+    }
+
+    if(profileDropped) printf("bios: %d calls to other functions were not profiled\n", profileDropped);
+#endif
+}
@@ -0,0 +1,354 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* Console output */
+/* characters go straight to VGA text memory and/or a polled 16550 UART on
+ * COM1, so printing never leaves long mode; BIOS teletype output is only
+ * used when neither of them is available, and after a VBE mode switch text
+ * is drawn into the linear framebuffer with the VGA BIOS font */
+
+#include <lxboot.h>
+#include <string.h>
+#include <cpu.h>
+
+#define SERIAL_DATA             0
+#define SERIAL_INTERRUPTS       1
+#define SERIAL_DIVISOR_LOW      0
+#define SERIAL_DIVISOR_HIGH     1
+#define SERIAL_FIFO             2
+#define SERIAL_LINE_CONTROL     3
+#define SERIAL_MODEM_CONTROL    4
+#define SERIAL_LINE_STATUS      5
+#define SERIAL_SCRATCH          7
+
+#define SERIAL_TX_EMPTY         0x20
+#define SERIAL_TIMEOUT          100000      // give up on a stuck UART
+
+#define VGA_ATTRIBUTE           0x0700      // light grey on black
+
+#define FONT_WIDTH              8
+#define FONT_HEIGHT             16
+#define FONT_INTENSITY          0xAA        // same light grey as VGA_ATTRIBUTE
+
+static uint8_t outputs = CONSOLE_OUTPUT_BIOS;   // until consoleInit()
+static volatile uint16_t *vga;
+static uint16_t crtc;
+static int columns, rows, x, y;
+static uint16_t serial;
+
+// the framebuffer console keeps the text it wants on screen and the text that
+// is on screen, and only redraws the cells that differ in dirty rows; lines
+// scrolled since the last flush are one block move of the pixels
+static uint8_t *font;
+static uint8_t *framebuffer;
+static uint32_t pitch, bytesPerPixel, foreground;
+static char *cells, *drawn;
+static uint8_t *dirty;
+static int scrolled;
+
+static bool vgaInit() {
+    // only the BIOS text modes can be written to directly
+    uint8_t mode = *(uint8_t *)(uintptr_t)0x449;
+    if(mode > 3 && mode != 7) return false;
+
+    vga = (volatile uint16_t *)(uintptr_t)(mode == 7 ? 0xB0000 : 0xB8000);
+    crtc = *(uint16_t *)(uintptr_t)0x463;
+    columns = *(uint16_t *)(uintptr_t)0x44A;
+    rows = *(uint8_t *)(uintptr_t)0x484 + 1;
+    if(!crtc) crtc = 0x3D4;
+    if(!columns) columns = 80;
+    if(rows == 1) rows = 25;
+
+    // pick up where the BIOS left the cursor on page zero
+    x = *(uint8_t *)(uintptr_t)0x450;
+    y = *(uint8_t *)(uintptr_t)0x451;
+    if(x >= columns) x = 0;
+    if(y >= rows) y = rows - 1;
+    return true;
+}
+
+static bool serialInit() {
+    serial = *(uint16_t *)(uintptr_t)0x400;     // COM1 as detected by the BIOS
+    if(!serial) return false;
+
+    // make sure there is a UART behind the port at all
+    outb(serial + SERIAL_SCRATCH, 0xA5);
+    if(inb(serial + SERIAL_SCRATCH) != 0xA5) return false;
+
+    outb(serial + SERIAL_INTERRUPTS, 0x00);     // polled
+    outb(serial + SERIAL_LINE_CONTROL, 0x80);   // divisor latch
+    outb(serial + SERIAL_DIVISOR_LOW, 1);       // 115200 baud
+    outb(serial + SERIAL_DIVISOR_HIGH, 0);
+    outb(serial + SERIAL_LINE_CONTROL, 0x03);   // 8N1
+    outb(serial + SERIAL_FIFO, 0xC7);           // enable and clear FIFOs
+    outb(serial + SERIAL_MODEM_CONTROL, 0x03);  // DTR, RTS
+    return true;
+}
+
+/*
+ * consoleInit(): selects the console outputs
+ * params: requested - CONSOLE_OUTPUT_* flags; outputs that aren't present are
+ * dropped, and BIOS teletype output is used if nothing else is left
+ * returns: the outputs actually in use
+ */
+
+uint8_t consoleInit(uint8_t requested) {
+    consoleFlush();
+
+    outputs = 0;
+    if((requested & CONSOLE_OUTPUT_VGA) && vgaInit()) outputs |= CONSOLE_OUTPUT_VGA;
+    if((requested & CONSOLE_OUTPUT_SERIAL) && serialInit()) outputs |= CONSOLE_OUTPUT_SERIAL;
+
+    // BIOS teletype would print everything a second time over VGA memory
+    if(!(outputs & CONSOLE_OUTPUT_VGA) && ((requested & CONSOLE_OUTPUT_BIOS) || !outputs)) outputs |= CONSOLE_OUTPUT_BIOS;
+
+    return outputs;
+}
+
+static uint32_t channel(uint8_t mask, uint8_t position) {
+    uint32_t max = (1 << mask) - 1;
+    return ((max * FONT_INTENSITY) / 0xFF) << position;
+}
+
+static bool framebufferInit(VideoMode *mode) {
+    bytesPerPixel = (mode->bpp + 7) / 8;
+    if(bytesPerPixel < 2 || bytesPerPixel > 4) return false;
+
+    // the 8x16 font of the VGA BIOS, so none has to be built in
+    CPURegisters regs;
+    regs.eax = 0x1130;
+    regs.ebx = 0x0600;
+    regs.ecx = 0;
+    regs.edx = 0;
+    videoAPI(&regs);
+
+    uintptr_t rom = ((uintptr_t)biosRegs->es << 4) + (biosRegs->ebp & 0xFFFF);
+    if(!rom) return false;
+
+    // this stays out of the loader image, whose data has to fit below 64 KiB
+    columns = mode->width / FONT_WIDTH;
+    rows = mode->height / FONT_HEIGHT;
+    size_t size = (256 * FONT_HEIGHT) + (columns * rows * 2) + rows;
+    font = allocPages((size + PAGE_SIZE - 1) / PAGE_SIZE, BOOT_MEMORY_LOADER);
+    if(!font) return false;
+
+    memcpy(font, (void *)rom, 256 * FONT_HEIGHT);
+    cells = (char *)font + (256 * FONT_HEIGHT);
+
+    // setting the mode cleared the screen
+    drawn = cells + (columns * rows);
+    dirty = (uint8_t *)(drawn + (columns * rows));
+    memset(cells, ' ', columns * rows * 2);
+    memset(dirty, 0, rows);
+    scrolled = 0;
+
+    framebuffer = (uint8_t *)(uintptr_t)mode->framebuffer;
+    pitch = mode->pitch;
+    foreground = channel(mode->redMask, mode->redPosition) |
+        channel(mode->greenMask, mode->greenPosition) |
+        channel(mode->blueMask, mode->bluePosition);
+    x = 0;
+    y = 0;
+    return true;
+}
+
+/*
+ * consoleFramebuffer(): moves screen output to the framebuffer after a mode
+ * switch, since neither VGA text memory nor BIOS teletype output is visible
+ * any more; serial output is left alone
+ * params: mode - video mode that was set
+ * returns: nothing
+ */
+
+void consoleFramebuffer(VideoMode *mode) {
+    bool screen = outputs & (CONSOLE_OUTPUT_VGA | CONSOLE_OUTPUT_BIOS);
+    outputs &= ~CONSOLE_OUTPUT_VGA;
+
+    if(screen && framebufferInit(mode)) {
+        outputs &= ~CONSOLE_OUTPUT_BIOS;
+        outputs |= CONSOLE_OUTPUT_FRAMEBUFFER;
+    }
+
+    if(!outputs) outputs = CONSOLE_OUTPUT_BIOS;
+}
+
+static void vgaPutchar(char c) {
+    if(c == '\n') {
+        x = 0;
+        y++;
+    } else if(c == '\r') {
+        x = 0;
+    } else if(c == '\b') {
+        if(x) x--;
+    } else {
+        vga[(y * columns) + x] = VGA_ATTRIBUTE | (uint8_t)c;
+        x++;
+        if(x >= columns) {
+            x = 0;
+            y++;
+        }
+    }
+
+    if(y >= rows) {
+        int count = (rows - 1) * columns;
+        for(int i = 0; i < count; i++) vga[i] = vga[i + columns];
+        for(int i = 0; i < columns; i++) vga[count + i] = VGA_ATTRIBUTE | ' ';
+        y = rows - 1;
+    }
+}
+
+static void framebufferPutchar(char c) {
+    if(c == '\n') {
+        x = 0;
+        y++;
+    } else if(c == '\r') {
+        x = 0;
+    } else if(c == '\b') {
+        if(x) x--;
+    } else {
+        cells[(y * columns) + x] = c;
+        dirty[y] = 1;
+        x++;
+        if(x >= columns) {
+            x = 0;
+            y++;
+        }
+    }
+
+    if(y >= rows) {
+        // the pixels and what was drawn follow on the next flush, so rows
+        // that only moved don't have to be drawn again
+        memmove(cells, cells + columns, (rows - 1) * columns);
+        memset(cells + ((rows - 1) * columns), ' ', columns);
+        memmove(dirty, dirty + 1, rows - 1);
+        dirty[rows - 1] = 0;
+        scrolled++;
+        y = rows - 1;
+    }
+}
+
+static void drawGlyph(int column, int row, uint8_t c) {
+    uint8_t *glyph = &font[c * FONT_HEIGHT];
+    uint8_t *line = framebuffer + (row * FONT_HEIGHT * pitch) + (column * FONT_WIDTH * bytesPerPixel);
+
+    for(int i = 0; i < FONT_HEIGHT; i++, line += pitch) {
+        uint8_t bits = glyph[i];
+
+        if(bytesPerPixel == 4) {
+            // the whole row is built first and goes out in 32-bit stores
+            uint32_t pixels[FONT_WIDTH];
+            for(int j = 0; j < FONT_WIDTH; j++) pixels[j] = (bits & (0x80 >> j)) ? foreground : 0;
+            uint32_t *dst = (uint32_t *)line;
+            for(int j = 0; j < FONT_WIDTH; j++) dst[j] = pixels[j];
+        } else if(bytesPerPixel == 2) {
+            uint32_t *dst = (uint32_t *)line;
+            for(int j = 0; j < FONT_WIDTH; j += 2) {
+                dst[j / 2] = ((bits & (0x80 >> j)) ? foreground : 0) |
+                    ((bits & (0x40 >> j)) ? foreground << 16 : 0);
+            }
+        } else {
+            for(int j = 0; j < FONT_WIDTH; j++) {
+                uint32_t pixel = (bits & (0x80 >> j)) ? foreground : 0;
+                line[(j * 3)] = pixel;
+                line[(j * 3) + 1] = pixel >> 8;
+                line[(j * 3) + 2] = pixel >> 16;
+            }
+        }
+    }
+}
+
+static void framebufferScroll() {
+    size_t line = pitch * FONT_HEIGHT;
+
+    // rows that are still on screen move up in one go, the new ones are blank
+    if(scrolled < rows) {
+        memmove(framebuffer, framebuffer + (scrolled * line), (rows - scrolled) * line);
+        memmove(drawn, drawn + (scrolled * columns), (rows - scrolled) * columns);
+    } else {
+        scrolled = rows;
+    }
+
+    memset(framebuffer + ((rows - scrolled) * line), 0, scrolled * line);
+    memset(drawn + ((rows - scrolled) * columns), ' ', scrolled * columns);
+    scrolled = 0;
+}
+
+static void framebufferFlush() {
+    if(scrolled) framebufferScroll();
+
+    for(int row = 0; row < rows; row++) {
+        if(!dirty[row]) continue;
+        dirty[row] = 0;
+
+        char *want = cells + (row * columns);
+        char *have = drawn + (row * columns);
+        for(int column = 0; column < columns; column++) {
+            if(want[column] != have[column]) {
+                drawGlyph(column, row, want[column]);
+                have[column] = want[column];
+            }
+        }
+    }
+}
+
+static void serialPutchar(char c) {
+    for(int i = 0; i < SERIAL_TIMEOUT; i++) {
+        if(inb(serial + SERIAL_LINE_STATUS) & SERIAL_TX_EMPTY) break;
+    }
+
+    outb(serial + SERIAL_DATA, c);
+}
+
+static void biosPutchar(char c) {
+    CPURegisters regs;
+    regs.eax = 0x0E00 | (uint8_t)c;
+    regs.ebx = 0;
+    videoAPI(&regs);
+}
+
+/*
+ * consolePutchar(): writes a character to every console output
+ * params: c - character, newlines are expanded to CR LF where needed
+ * returns: nothing
+ */
+
+void consolePutchar(char c) {
+    if(outputs & CONSOLE_OUTPUT_VGA) vgaPutchar(c);
+    if(outputs & CONSOLE_OUTPUT_FRAMEBUFFER) framebufferPutchar(c);
+
+    if(outputs & CONSOLE_OUTPUT_SERIAL) {
+        if(c == '\n') serialPutchar('\r');
+        serialPutchar(c);
+    }
+
+    if(outputs & CONSOLE_OUTPUT_BIOS) {
+        if(c == '\n') biosPutchar('\r');
+        biosPutchar(c);
+    }
+}
+
+/*
+ * consoleFlush(): draws pending framebuffer text and moves the VGA cursor to
+ * the end of the output, which also updates the BIOS data area so that BIOS
+ * output continues from the same place
+ * params: none
+ * returns: nothing
+ */
+
+void consoleFlush() {
+    if(outputs & CONSOLE_OUTPUT_FRAMEBUFFER) framebufferFlush();
+    if(!(outputs & CONSOLE_OUTPUT_VGA)) return;
+
+    uint16_t position = (y * columns) + x;
+    outb(crtc, 0x0F);
+    outb(crtc + 1, position & 0xFF);
+    outb(crtc, 0x0E);
+    outb(crtc + 1, position >> 8);
+
+    *(uint8_t *)(uintptr_t)0x450 = x;
+    *(uint8_t *)(uintptr_t)0x451 = y;
+}
@@ -8,50 +8,151 @@
 #include <lxboot.h>
 #include <stdio.h>
 #include <string.h>
+#include <cpu.h>
 
-#define DISK_BUFFER         0x100   // temporary buffer in low memory
+#define DISK_BUFFER_SECTORS     64      // sectors transferred per BIOS call
+#define DISK_BUFFER_SIZE        (DISK_BUFFER_SECTORS * 512)
+#define DISK_BATCH              4       // BIOS calls per trip to real mode
+#define DISK_TRACE_SIZE         4096    // records, 128 KiB
 
-DiskAddressPacket dap;
-static CPURegisters regs;
+REAL_MODE_BUFFER static DiskAddressPacket daps[DISK_BATCH];
+static uint8_t *diskBuffer = NULL;     // bounce buffers in low memory
 int partitionIndex;
+uint64_t diskBytesRead = 0;     // for the boot timeline
+static uint8_t traceSource = DISK_TRACE_OTHER;
+
+#ifdef DISK_TRACE
+static DiskTraceRecord *trace = NULL;
+static uint32_t traceCount = 0;
+static uint32_t traceDropped = 0;
+
+static void traceRead(uint32_t lba, int count, uint8_t disk, uint64_t start) {
+    uint64_t end = rdtsc();
+    if(!trace) trace = allocPages((DISK_TRACE_SIZE * sizeof(DiskTraceRecord)) / PAGE_SIZE, BOOT_MEMORY_LOADER);
+    if(traceCount >= DISK_TRACE_SIZE) {
+        traceDropped++;
+        return;
+    }
+
+    DiskTraceRecord *record = &trace[traceCount++];
+    record->lba = lba;
+    record->count = count;
+    record->disk = disk;
+    record->source = traceSource;
+    record->reserved = 0;
+    record->start = start;
+    record->end = end;
+}
+#endif
+
+/*
+ * diskTraceSource(): sets what the following reads are for, for the trace
+ * params: source - DISK_TRACE_*
+ * returns: the previous source, to be restored after the reads
+ */
+
+uint8_t diskTraceSource(uint8_t source) {
+    uint8_t previous = traceSource;
+    traceSource = source;
+    return previous;
+}
+
+/*
+ * diskTraceHandoff(): copies the disk trace for the kernel
+ * params: address - pointer to where to store the address of the copy
+ * params: dropped - pointer to where to store how many reads didn't fit
+ * returns: number of records in the copy, zero without DISK_TRACE
+ */
+
+uint32_t diskTraceHandoff(uint64_t *address, uint32_t *dropped) {
+    *address = 0;
+    *dropped = 0;
+
+#ifdef DISK_TRACE
+    if(!traceCount) return 0;
+
+    *address = allocAligned(traceCount * sizeof(DiskTraceRecord), PAGE_SIZE, BOOT_MEMORY_BOOT_INFO);
+    if(!*address) return 0;
+
+    memcpy((void *)(uintptr_t)*address, trace, traceCount * sizeof(DiskTraceRecord));
+    *dropped = traceDropped;
+    return traceCount;
+#else
+    return 0;
+#endif
+}
 
 void diskAPI(CPURegisters *r) {
-    void (*d)(CPURegisters *) = (void (*))bootInfo.diskAPI;
-    memcpy(biosRegs, r, sizeof(CPURegisters));
-    d(biosRegs);
+    biosCall(0x13, r);
 }
 
 int readSectors(void *dst, uint32_t lba, int count, uint8_t disk) {
-    dap.size = sizeof(DiskAddressPacket);
-    dap.reserved = 0;
+    if(!diskBuffer) {
+        // each buffer is aligned to its own size so DMA never crosses a 64 KiB
+        // boundary
+        diskBuffer = allocLowPages((DISK_BATCH * DISK_BUFFER_SIZE) / PAGE_SIZE, DISK_BUFFER_SIZE);
+    }
 
-    for(int i = 0; i < count; i++) {
-        dap.count = 1;
-        dap.segment = 0;
-        dap.offset = DISK_BUFFER;
-        dap.lba = lba + i;
+#ifdef DISK_TRACE
+    uint64_t start = rdtsc();
+#endif
 
-        regs.eax = 0x4200;
-        regs.edx = disk & 0xFF;
-        regs.esi = (uint32_t)&dap;
+    // up to DISK_BATCH chunks are read in a single visit to real mode
+    int done = 0;
+    while(done < count) {
+        int calls = 0;
+        int queued = done;
+        while(calls < DISK_BATCH && queued < count) {
+            int chunk = count - queued;
+            if(chunk > DISK_BUFFER_SECTORS) chunk = DISK_BUFFER_SECTORS;
 
-        diskAPI(&regs);
+            uint8_t *buffer = diskBuffer + (calls * DISK_BUFFER_SIZE);
+            daps[calls].size = sizeof(DiskAddressPacket);
+            daps[calls].reserved = 0;
+            daps[calls].count = chunk;
+            daps[calls].segment = (uintptr_t)buffer >> 4;
+            daps[calls].offset = (uintptr_t)buffer & 0x0F;
+            daps[calls].lba = lba + queued;
 
-        if(biosRegs->eflags & 1) {   /* CF indicates error */
-            printf("disk i/o error on sector %d drive 0x%02X\n", lba+i, bootInfo.bootDevice);
-            while(1);   // hang
+            memset(&biosQueue[calls], 0, sizeof(BIOSCall));
+            biosQueue[calls].vector = 0x13;
+            biosQueue[calls].regs.eax = 0x4200;
+            biosQueue[calls].regs.edx = disk & 0xFF;
+            biosQueue[calls].regs.esi = (uint32_t)(uintptr_t)&daps[calls];
+
+            queued += chunk;
+            calls++;
         }
 
-        memcpy(dst + (i * 512), (const void *)DISK_BUFFER, 512);
+        biosBatch(biosQueue, calls);
+
+        for(int i = 0; i < calls; i++) {
+            if(biosQueue[i].regs.eflags & 1) {     /* CF indicates error */
+                printf("disk i/o error on sector %d drive 0x%02X\n", (uint32_t)daps[i].lba, disk);
+                halt();
+            }
+
+            memcpy(dst + (done * 512), diskBuffer + (i * DISK_BUFFER_SIZE), daps[i].count * 512);
+            done += daps[i].count;
+        }
     }
 
+    diskBytesRead += (uint64_t)count * 512;
+
+#ifdef DISK_TRACE
+    traceRead(lba, count, disk, start);
+#endif
+
     return count;
 }
 
 int findBootPartition() {
     // returns the zero-based index of the boot partition within the boot drive
-    readSectors((void *)DISK_BUFFER, 0, 1, bootInfo.bootDevice);
-    MBRPartition *partitions = (MBRPartition *)((uint8_t *)DISK_BUFFER + MBR_PARTITION_OFFSET);
+    uint8_t mbr[512];
+    uint8_t source = diskTraceSource(DISK_TRACE_PARTITION);
+    readSectors(mbr, 0, 1, bootInfo.bootDevice);
+    diskTraceSource(source);
+    MBRPartition *partitions = (MBRPartition *)(mbr + MBR_PARTITION_OFFSET);
 
     for(int i = 0; i < 4; i++) {
         if(partitions[i].start == bootInfo.partition.start) {
@@ -62,11 +163,14 @@ int findBootPartition() {
     }
 
     printf("cannot find boot partition\n");
-    while(1);
+    halt();
 }
 
 uint32_t getPartitionStart(uint8_t disk, int partition) {
-    readSectors((void *)DISK_BUFFER, 0, 1, disk);
-    MBRPartition *partitions = (MBRPartition *)((uint8_t *)DISK_BUFFER + MBR_PARTITION_OFFSET);
+    uint8_t mbr[512];
+    uint8_t source = diskTraceSource(DISK_TRACE_PARTITION);
+    readSectors(mbr, 0, 1, disk);
+    diskTraceSource(source);
+    MBRPartition *partitions = (MBRPartition *)(mbr + MBR_PARTITION_OFFSET);
     return partitions[partition%4].start;
 }
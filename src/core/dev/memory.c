@@ -9,13 +9,12 @@
 #include <stdio.h>
 #include <string.h>
 
-MemoryMap memoryMap[32];
+REAL_MODE_BUFFER MemoryMap memoryMap[32];
+int memoryMapCount = 0;
 static CPURegisters regs;
 
 void miscAPI(CPURegisters *r) {
-    void (*m)(CPURegisters *) = (void (*))bootInfo.miscAPI;
-    memcpy(biosRegs, r, sizeof(CPURegisters));
-    m(biosRegs);
+    biosCall(0x15, r);
 }
 
 int detectMemory(uint64_t *highest) {
@@ -28,7 +27,7 @@ int detectMemory(uint64_t *highest) {
         regs.eax = 0xE820;
         regs.edx = 0x534D4150;
         regs.ecx = 24;
-        regs.edi = (uint32_t)(&memoryMap[c]);
+        regs.edi = (uint32_t)(uintptr_t)(&memoryMap[c]);
         miscAPI(&regs);
 
         if(biosRegs->eax != 0x534D4150 || biosRegs->eflags & 1) {
@@ -36,7 +35,7 @@ int detectMemory(uint64_t *highest) {
                 break;
             } else {
                 printf("unable to detect memory\n");
-                while(1);
+                halt();
             }
         }
 
@@ -44,8 +43,12 @@ int detectMemory(uint64_t *highest) {
             memoryMap[c].acpiAttributes = MEMORY_ATTRIBUTES_VALID;
         }
 
+        // the last entry comes back with EBX cleared, and it still counts
         regs.ebx = biosRegs->ebx;
-        if(!regs.ebx) break;
+        if(!regs.ebx) {
+            c++;
+            break;
+        }
     }
 
     printf("memory map contains %d entries\n", c);
@@ -57,6 +60,32 @@ int detectMemory(uint64_t *highest) {
     }
 
     *highest = addr;
+    memoryMapCount = c;
     return c;
 }
 
+/*
+ * memoryRangeUsable(): checks if a physical range lies entirely within one
+ * usable entry of the memory map and doesn't overlap any other entry
+ * params: base - start of the range
+ * params: len - size of the range in bytes
+ * returns: true if the range is usable
+ */
+
+bool memoryRangeUsable(uint64_t base, uint64_t len) {
+    bool usable = false;
+
+    for(int i = 0; i < memoryMapCount; i++) {
+        if(memoryMap[i].type != MEMORY_TYPE_USABLE) {
+            // some firmware reports overlapping entries, reserved ones win
+            if(base < (memoryMap[i].base + memoryMap[i].len) && (base + len) > memoryMap[i].base) {
+                return false;
+            }
+        } else if(base >= memoryMap[i].base && (base + len) <= (memoryMap[i].base + memoryMap[i].len)) {
+            usable = true;
+        }
+    }
+
+    return usable;
+}
+
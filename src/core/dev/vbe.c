@@ -5,110 +5,237 @@
  * Boot loader for the x86_64 architecture
  */
 
+/* VESA BIOS Extensions */
+/* every mode is queried exactly once, in batches, into a table that is
+ * handed to the kernel, and the mode to use is picked from that table */
+
 #include <lxboot.h>
 #include <vbe.h>
 #include <stdio.h>
 #include <string.h>
 
-VBEController controller;
-VBEMode mode;
-VBEMonitor monitor;
+#define VBE_DEFAULT_WIDTH       1024
+#define VBE_DEFAULT_HEIGHT      768
+#define VBE_DEFAULT_BPP         32
+
+REAL_MODE_BUFFER VBEController controller;
+REAL_MODE_BUFFER VBEMonitor monitor;
 static uint16_t *modes;
 static CPURegisters regs;
 
-VBEMode *vbeSetup() {
+static bool edidValid() {
+    static const uint8_t header[8] = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+    if(memcmp(monitor.padding, header, 8)) return false;
+
+    uint8_t sum = 0;
+    uint8_t *bytes = (uint8_t *)&monitor;
+    for(int i = 0; i < VBE_EDID_SIZE; i++) sum += bytes[i];
+    return !sum;
+}
+
+static void fillMode(VideoMode *entry, uint16_t number, VBEMode *info, bool valid) {
+    memset(entry, 0, sizeof(VideoMode));
+    entry->mode = number;
+
+    // a mode that can't be queried stays in the table as unsupported
+    if(!valid) return;
+
+    entry->attributes = info->attributes;
+    entry->width = info->width;
+    entry->height = info->height;
+    entry->bpp = info->bpp;
+    entry->memoryModel = info->memoryModel;
+    entry->framebuffer = info->framebuffer;
+
+    // VBE 3.0 describes the linear framebuffer separately from the banked one
+    if(controller.version >= 0x300 && info->linearPitch) {
+        entry->pitch = info->linearPitch;
+        entry->redPosition = info->linearRedPosition;
+        entry->redMask = info->linearRedMask;
+        entry->greenPosition = info->linearGreenPosition;
+        entry->greenMask = info->linearGreenMask;
+        entry->bluePosition = info->linearBluePosition;
+        entry->blueMask = info->linearBlueMask;
+    } else {
+        entry->pitch = info->pitch;
+        entry->redPosition = info->redPosition;
+        entry->redMask = info->redMask;
+        entry->greenPosition = info->greenPosition;
+        entry->greenMask = info->greenMask;
+        entry->bluePosition = info->bluePosition;
+        entry->blueMask = info->blueMask;
+    }
+}
+
+static void queryModes(VideoMode *table, int count) {
+    // up to BIOS_BATCH_MAX modes per visit to real mode, each into its own
+    // buffer addressed through es:di
+    VBEMode *buffers = allocLowPages(((BIOS_BATCH_MAX * sizeof(VBEMode)) + PAGE_SIZE - 1) / PAGE_SIZE, PAGE_SIZE);
+
+    for(int i = 0; i < count; i += BIOS_BATCH_MAX) {
+        int calls = count - i;
+        if(calls > BIOS_BATCH_MAX) calls = BIOS_BATCH_MAX;
+
+        memset(buffers, 0, calls * sizeof(VBEMode));
+        memset(biosQueue, 0, calls * sizeof(BIOSCall));
+        for(int j = 0; j < calls; j++) {
+            biosQueue[j].vector = 0x10;
+            biosQueue[j].regs.eax = 0x4F01;
+            biosQueue[j].regs.ecx = modes[i + j] & 0x01FF;
+            biosQueue[j].regs.es = (uintptr_t)&buffers[j] >> 4;
+            biosQueue[j].regs.edi = (uintptr_t)&buffers[j] & 0x0F;
+        }
+
+        biosBatch(biosQueue, calls);
+
+        for(int j = 0; j < calls; j++) {
+            bool valid = (biosQueue[j].regs.eax & 0xFFFF) == 0x004F;
+            fillMode(&table[i + j], modes[i + j], &buffers[j], valid);
+        }
+    }
+}
+
+static uint32_t scoreMode(VideoMode *entry, uint16_t w, uint16_t h, uint8_t bpp) {
+    // lower is better; the kernel only gets a linear framebuffer, so modes
+    // without one are of no use at all
+    uint16_t required = VBE_MODE_SUPPORTED | VBE_MODE_GRAPHICS | VBE_MODE_LINEAR_FB;
+    if((entry->attributes & required) != required) return 0xFFFFFFFF;
+    if(entry->memoryModel != VBE_MEMORY_DIRECT || entry->bpp < 15 || !entry->framebuffer) return 0xFFFFFFFF;
+
+    // overshooting the panel may not display at all, undershooting only
+    // wastes some of it
+    int32_t dw = (int32_t)entry->width - w;
+    int32_t dh = (int32_t)entry->height - h;
+    uint32_t distance = (dw > 0 ? dw * 4 : -dw) + (dh > 0 ? dh * 4 : -dh);
+
+    int32_t db = (int32_t)entry->bpp - bpp;
+    uint32_t depth = db > 0 ? db : -db * 2;
+
+    // padded lines cost framebuffer bandwidth for nothing
+    uint32_t padding = entry->pitch != (uint32_t)entry->width * ((entry->bpp + 7) / 8);
+
+    return (distance * 128) + (depth * 2) + padding;
+}
+
+static int bestMode(VideoMode *table, int count, uint16_t w, uint16_t h, uint8_t bpp) {
+    int best = -1;
+    uint32_t bestScore = 0xFFFFFFFF;
+    for(int i = 0; i < count; i++) {
+        uint32_t score = scoreMode(&table[i], w, h, bpp);
+        if(score < bestScore) {
+            best = i;
+            bestScore = score;
+        }
+    }
+
+    return best;
+}
+
+/*
+ * vbeSetup(): queries the display controller and sets the closest video mode
+ * this must be called after the kernel is loaded
+ * params: width - preferred width, zero to follow the monitor
+ * params: height - preferred height
+ * params: bpp - preferred bits per pixel, zero for the default
+ * params: summary - pointer to where to store the mode table and EDID
+ * returns: pointer to the mode that was set
+ */
+
+VideoMode *vbeSetup(uint16_t width, uint16_t height, uint8_t bpp, VBESummary *summary) {
+    memset(summary, 0, sizeof(VBESummary));
+
     // check if VESA BIOS is supported at all
     memset(&controller, 0, sizeof(VBEController));
     memcpy(&controller.signature, "VBE2", 4);   // this is a magic number and doesn't mean version 2
     controller.version = 0x300; // indicate to the firmware we implement VESA 3.0
     regs.eax = 0x4F00;
-    regs.edi = (uint32_t)&controller;
+    regs.edi = (uint32_t)(uintptr_t)&controller;
     videoAPI(&regs);
 
     if((biosRegs->eax & 0xFFFF) != 0x004F || memcmp(&controller.signature, "VESA", 4)) {
         printf("vbe: failed to query display controller, status 0x%04X\n", biosRegs->eax & 0xFFFF);
-        while(1);
+        halt();
     }
 
     if(controller.version < 0x200) {
         printf("vbe: VESA BIOS version is less than 2.0: 0x%04X\n", controller.version);
-        while(1);
+        halt();
     }
 
-    modes = (uint16_t *)((uint32_t)(controller.modeSegment << 4) + controller.modeOffset);
+    modes = (uint16_t *)(uintptr_t)((uint32_t)(controller.modeSegment << 4) + controller.modeOffset);
+
+    int count = 0;
+    while(count < VBE_MAX_MODES && modes[count] != 0xFFFF) count++;
 
     // now attempt to get monitor info
-    uint16_t preferredWidth, preferredHeight;
     regs.eax = 0x4F15;
     regs.ebx = 1;
     regs.ecx = 0;
     regs.edx = 0;
-    regs.edi = (uint32_t)&monitor;
+    regs.edi = (uint32_t)(uintptr_t)&monitor;
     videoAPI(&regs);
 
-    if((biosRegs->eax & 0xFFFF) != 0x004F) {
-        printf("vbe: failed to get monitor info, status 0x%04X\n", biosRegs->eax & 0xFFFF);
-        preferredWidth = 1024;      // dirty default but what else can we do atp
-        preferredHeight = 768;
-    } else {
-        preferredWidth = monitor.timing[0].hActiveLow;
-        preferredWidth |= (monitor.timing[0].hActiveBlankHigh & 0xF0) << 4;
+    bool edid = ((biosRegs->eax & 0xFFFF) == 0x004F) && edidValid();
+    if(!edid) printf("vbe: failed to get monitor info, status 0x%04X\n", biosRegs->eax & 0xFFFF);
 
-        preferredHeight = monitor.timing[0].vActiveLow;
-        preferredHeight |= (monitor.timing[0].vActiveBlankHigh & 0xF0) << 4;
+    if(!width || !height) {
+        if(edid && (monitor.timing[0].hFrequency || monitor.timing[0].vFrequency)) {
+            width = monitor.timing[0].hActiveLow;
+            width |= (monitor.timing[0].hActiveBlankHigh & 0xF0) << 4;
 
-        printf("vbe: preferred resolution is %dx%d\n", preferredWidth, preferredHeight);
-    }
+            height = monitor.timing[0].vActiveLow;
+            height |= (monitor.timing[0].vActiveBlankHigh & 0xF0) << 4;
 
-    VBEMode *mode = vbeSetMode(preferredWidth, preferredHeight, 32);
-    if(mode) return mode;
+            printf("vbe: preferred resolution is %dx%d\n", width, height);
+        } else {
+            width = VBE_DEFAULT_WIDTH;      // dirty default but what else can we do atp
+            height = VBE_DEFAULT_HEIGHT;
+        }
+    }
 
-    // here we somehow failed to set preferred resolution, so try again
-    preferredWidth = 1024;
-    preferredHeight = 768;
-    mode = vbeSetMode(preferredWidth, preferredHeight, 32);
-    if(mode) return mode;
+    if(!bpp) bpp = VBE_DEFAULT_BPP;
 
-    printf("vbe: failed to set screen resolution\n");
-    while(1);
-}
+    // the table and the EDID block both go to the kernel
+    VideoMode *table = (VideoMode *)(uintptr_t)allocAligned((count * sizeof(VideoMode)) + VBE_EDID_SIZE, PAGE_SIZE, BOOT_MEMORY_BOOT_INFO);
+    if(!table) {
+        printf("vbe: not enough memory for the mode table\n");
+        halt();
+    }
 
-VBEMode *vbeSetMode(uint16_t w, uint16_t h, uint8_t bpp) {
-    printf("vbe: attempt to set screen resolution %dx%dx%d\n", w, h, bpp);
+    queryModes(table, count);
 
-    for(int i = 0; modes[i] != 0xFFFF; i++) {
-        // query the BIOS for each mode one by one
-        regs.eax = 0x4F01;
-        regs.ecx = modes[i] & 0x01FF;
-        regs.edi = (uint32_t)&mode;
-        videoAPI(&regs);
+    summary->modes = (uintptr_t)table;
+    summary->modeCount = count;
 
-        if((biosRegs->eax & 0xFFFF) != 0x004F) {
-            printf("vbe: failed to query mode 0x%04X, status 0x%04X\n", modes[i], regs.eax & 0xFFFF);
-            return NULL;
-        }
+    if(edid) {
+        uint8_t *copy = (uint8_t *)(table + count);
+        memcpy(copy, &monitor, VBE_EDID_SIZE);
+        summary->edid = (uintptr_t)copy;
+    }
 
-        //printf("vbe: mode 0x%04X: %dx%dx%d\n", modes[i], mode.width, mode.height, mode.bpp);
+    // a mode the controller refuses is marked unsupported and the next best
+    // one is tried
+    int best;
+    while((best = bestMode(table, count, width, height, bpp)) >= 0) {
+        regs.eax = 0x4F02;
+        regs.ebx = table[best].mode & 0x01FF;
+        regs.ebx |= VBE_ENABLE_LINEAR_FB;
+        regs.edi = 0;
+        videoAPI(&regs);
 
-        if(mode.width == w && mode.height == h && mode.bpp == bpp) {
-            // found the mode to use
-            printf("vbe: found mode 0x%04X\n", modes[i]);
-            
-            regs.eax = 0x4F02;
-            regs.ebx = modes[i] & 0x01FF;
-            regs.ebx |= VBE_ENABLE_LINEAR_FB;
-            regs.edi = 0;
-            videoAPI(&regs);
+        if((biosRegs->eax & 0xFFFF) == 0x004F) break;
 
-            if((biosRegs->eax & 0xFFFF) != 0x004F) {
-                printf("vbe: failed to set mode 0x%04X, status 0x%04X\n", modes[i], regs.eax & 0xFFFF);
-                return NULL;
-            }
+        printf("vbe: failed to set mode 0x%04X, status 0x%04X\n", table[best].mode, biosRegs->eax & 0xFFFF);
+        table[best].attributes &= ~VBE_MODE_SUPPORTED;
+    }
 
-            return &mode;
-        }
+    if(best < 0) {
+        printf("vbe: failed to set screen resolution\n");
+        halt();
     }
 
-    printf("vbe: mode not supported on the controller\n");
-    return NULL;
-}
\ No newline at end of file
+    printf("vbe: set mode 0x%04X %dx%dx%d out of %d modes\n", table[best].mode, table[best].width, table[best].height, table[best].bpp, count);
+
+    summary->current = best;
+    return &table[best];
+}
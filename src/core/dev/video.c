@@ -6,10 +6,7 @@
  */
 
 #include <lxboot.h>
-#include <string.h>
 
 void videoAPI(CPURegisters *regs) {
-    void (*v)(CPURegisters *) = (void (*))bootInfo.videoAPI;
-    memcpy(biosRegs, regs, sizeof(CPURegisters));
-    v(biosRegs);
+    biosCall(0x10, regs);
 }
\ No newline at end of file
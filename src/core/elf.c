@@ -8,6 +8,7 @@
 /* Minimal implementation of the Executable and Linkable Format */
 /* This is used to load the kernel's code and data into memory */
 
+#include <lxboot.h>
 #include <elf.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -53,8 +54,30 @@ uint64_t loadELF(const void *binary, uint64_t *highest) {
         return 0;
     }
 
-    printf("elf: total of %d %s present, loading...\n", header->headerEntryCount, header->headerEntryCount == 1 ? "segment" : "segments");
+    // make sure the kernel doesn't land on memory that's unusable or in use
     ELFProgramHeader *prhdr = (ELFProgramHeader *)(ptr + header->headerTable);
+    uint64_t lowest = 0xFFFFFFFFFFFFFFFF;
+    for(int i = 0; i < header->headerEntryCount; i++) {
+        if(prhdr->segmentType == ELF_SEGMENT_TYPE_LOAD) {
+            if(prhdr->virtualAddress < lowest) lowest = prhdr->virtualAddress;
+            if((prhdr->virtualAddress + prhdr->memorySize) > addr) addr = prhdr->virtualAddress + prhdr->memorySize;
+        }
+
+        prhdr = (ELFProgramHeader *)((uintptr_t)prhdr + header->headerEntrySize);
+    }
+
+    if(addr) {
+        lowest &= ~(PAGE_SIZE - 1);
+        if(!allocReserve(lowest, ((addr + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1)) - lowest, BOOT_MEMORY_KERNEL)) {
+            printf("elf: kernel overlaps memory that is unusable or in use\n");
+            return 0;
+        }
+    }
+
+    addr = 0;
+
+    printf("elf: total of %d %s present, loading...\n", header->headerEntryCount, header->headerEntryCount == 1 ? "segment" : "segments");
+    prhdr = (ELFProgramHeader *)(ptr + header->headerTable);
     for(int i = 0; i < header->headerEntryCount; i++) {
         printf(" %d: ", i);
         if(prhdr->segmentType == ELF_SEGMENT_TYPE_NULL) {
@@ -64,8 +87,8 @@ uint64_t loadELF(const void *binary, uint64_t *highest) {
 
             // for now virtual=physical because we haven't yet enabled paging
             // for the same reason we're also ignoring the exec/read/write perms
-            memset((void *)(uint32_t)prhdr->virtualAddress, 0, prhdr->memorySize);
-            memcpy((void *)(uint32_t)prhdr->virtualAddress, (const void *)(uint32_t)(binary + prhdr->fileOffset), prhdr->fileSize);
+            memset((void *)(uintptr_t)prhdr->virtualAddress, 0, prhdr->memorySize);
+            memcpy((void *)(uintptr_t)prhdr->virtualAddress, (const void *)(ptr + prhdr->fileOffset), prhdr->fileSize);
 
             // take note of the highest address
             if((prhdr->virtualAddress + prhdr->memorySize) > addr) {
@@ -83,6 +106,6 @@ uint64_t loadELF(const void *binary, uint64_t *highest) {
 
     //printf("elf: entry point is at 0x%08X\n", header->entryPoint);
     //printf("elf: highest address used by kernel is at 0x%08X\n", addr);
-    *highest = addr & 0xFFFFFFFF;
+    *highest = addr;
     return header->entryPoint;
 }
@@ -13,40 +13,122 @@
 #include <stdlib.h>
 
 /* partial implementation of C stdio */
+/* everything printed also goes into a ring buffer that is handed to the
+ * kernel, and is only echoed to the console above the quiet level */
 
-int putchar(int c) {
-    CPURegisters regs;
-
-    if(c == '\n') {
-        regs.eax = 0x0E0D;  // crlf
-        videoAPI(&regs);
-        regs.eax = 0x0E0A;
-        videoAPI(&regs);
-    } else {
-        regs.eax = 0x0E00 | (c & 0xFF);
-        videoAPI(&regs);
+#define LOG_EARLY_SIZE      2048        // until there is an allocator
+#define LOG_SIZE            65536
+#define LOG_REPLAY          1024        // shown on a fatal error in quiet mode
+
+static char earlyRing[LOG_EARLY_SIZE];
+static char *ring = earlyRing;
+static size_t ringSize = LOG_EARLY_SIZE;
+static uint64_t written;                // bytes logged into the current ring
+static uint64_t lost;                   // bytes lost with the early ring
+static int verbosity = LOG_NORMAL;
+
+static size_t logCopy(char *dst, size_t size) {
+    // copies the newest bytes that fit, oldest first
+    size_t length = written < ringSize ? written : ringSize;
+    if(length > size) length = size;
+
+    for(size_t i = 0; i < length; i++) {
+        dst[i] = ring[(written - length + i) % ringSize];
     }
 
-    return c;
+    return length;
 }
 
-void print(const char *s) {
-    CPURegisters regs;
-    for(; *s; s++) {
-        if(*s == '\n') {
-            regs.eax = 0x0E0D;  // crlf
-            videoAPI(&regs);
-            regs.eax = 0x0E0A;
-            videoAPI(&regs);
-        } else {
-            regs.eax = 0x0E00 | (*s & 0xFF);
-            videoAPI(&regs);
+/*
+ * logInit(): moves the log into a larger buffer
+ * this must be called after pagingInit()
+ * params: none
+ * returns: nothing
+ */
+
+void logInit() {
+    char *buffer = allocPages(LOG_SIZE / PAGE_SIZE, BOOT_MEMORY_LOADER);
+    if(!buffer) return;
+
+    size_t length = logCopy(buffer, LOG_SIZE);
+    lost = written - length;
+    written = length;
+    ring = buffer;
+    ringSize = LOG_SIZE;
+}
+
+/*
+ * logVerbosity(): sets how much of the log is echoed to the console
+ * params: level - LOG_QUIET or LOG_NORMAL
+ * returns: nothing
+ */
+
+void logVerbosity(int level) {
+    verbosity = level;
+}
+
+/*
+ * logHandoff(): copies the log for the kernel
+ * this must be called after the kernel is loaded, and anything printed after
+ * this is not part of the copy
+ * params: address - pointer to where to store the address of the copy
+ * params: dropped - pointer to where to store how many older bytes were lost
+ * returns: length of the copy in bytes
+ */
+
+uint32_t logHandoff(uint64_t *address, uint32_t *dropped) {
+    size_t length = written < ringSize ? written : ringSize;
+    *dropped = lost + written - length;
+    *address = allocAligned(length ? length : 1, PAGE_SIZE, BOOT_MEMORY_BOOT_INFO);
+    if(!*address) return 0;
+
+    return logCopy((char *)(uintptr_t)*address, length);
+}
+
+/*
+ * halt(): stops after a fatal error
+ * in quiet mode the end of the log is shown first, so the error isn't lost
+ * params: none
+ * returns: never
+ */
+
+void halt() {
+    if(verbosity == LOG_QUIET) {
+        char tail[LOG_REPLAY];
+        size_t length = logCopy(tail, LOG_REPLAY);
+        size_t start = 0;
+        if(written > length) {
+            while(start < length && tail[start] != '\n') start++;
+            start++;
         }
+
+        for(size_t i = start; i < length; i++) consolePutchar(tail[i]);
+        consoleFlush();
     }
+
+    while(1);
+}
+
+int putchar(int c) {
+    ring[written % ringSize] = c;
+    written++;
+
+    if(verbosity > LOG_QUIET) consolePutchar(c);
+    return c;
+}
+
+// the console is only flushed once per call to the public functions below
+static void emit(const char *s) {
+    for(; *s; s++) putchar(*s);
+}
+
+void print(const char *s) {
+    emit(s);
+    if(verbosity > LOG_QUIET) consoleFlush();
 }
 
 int puts(const char *s) {
-    print(s);
+    emit(s);
     print("\n");
     return strlen(s+1);
 }
@@ -106,7 +188,7 @@ int vprintf(const char *f, va_list args) {
                         break;
                     case 's':
                         str = va_arg(args, char *);
-                        print(str);
+                        emit(str);
                         l += strlen(str);
                         break;
                     case 'd':
@@ -123,7 +205,7 @@ int vprintf(const char *f, va_list args) {
                             }
                         }
                         
-                        print(buffer);
+                        emit(buffer);
                         l += numberLength;
                         break;
                     case 'x':
@@ -138,7 +220,7 @@ int vprintf(const char *f, va_list args) {
                             }
                         }
                         
-                        print(buffer);
+                        emit(buffer);
                         l += numberLength;
                         break;
                     case 'X':
@@ -163,7 +245,7 @@ int vprintf(const char *f, va_list args) {
                         l += numberLength;
                         break;
                     default:
-                        print(format);
+                        emit(format);
                     }
                 }
             }
@@ -174,5 +256,6 @@ int vprintf(const char *f, va_list args) {
         f++;
     }
 
+    if(verbosity > LOG_QUIET) consoleFlush();
     return l;
 }
\ No newline at end of file
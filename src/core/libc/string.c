@@ -5,25 +5,16 @@
  * Boot loader for the x86_64 architecture
  */
 
+#include <lxboot.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <cpu.h>
 
 /* partial implementation of the standard C library for convenience */
 /* really to help with debugging and to make this a little less obnoxious */
 
-void *memcpy(void *dst, const void *src, size_t n) {
-    uint8_t *dstc = (uint8_t *)dst;
-    uint8_t *srcc = (uint8_t *)src;
-
-    for(size_t i = 0; i < n; i++) {
-        dstc[i] = srcc[i];
-    }
-
-    return dst;
-}
-
 size_t strlen(const char *s) {
     size_t i = 0;
     for(; *s; i++) {
@@ -100,14 +91,6 @@ int atoi(const char *s) {
     return v;
 }
 
-void *memset(void *dst, int v, size_t n) {
-    uint8_t *dstc = (uint8_t *)dst;
-    for(size_t i = 0; i < n; i++) {
-        dstc[i] = v;
-    }
-    return dst;
-}
-
 int strcmp(const char *s1, const char *s2) {
     while(*s1 == *s2) {
         if(!*s1) return 0;
@@ -119,18 +102,234 @@ int strcmp(const char *s1, const char *s2) {
     return *s1 - *s2;
 }
 
+/* memcpy(), memset(), and memcmp() use whichever variant memInit() picked
+ * for the CPU, and rep movsq/stosq until then */
+
+#define MEM_SMALL               32      // below this the string instructions don't pay off
+#define MEM_SSE2_MINIMUM        256
+
+typedef uint64_t __attribute__((aligned(1), may_alias)) UnalignedQuad;
+
+static int copyVariant = MEM_VARIANT_QUAD;
+static int setVariant = MEM_VARIANT_QUAD;
+
+static void copyQuad(uint8_t *dst, const uint8_t *src, size_t n) {
+    size_t quads = n >> 3;
+    size_t rest = n & 7;
+    asm volatile ("rep movsq" : "+D"(dst), "+S"(src), "+c"(quads) :: "memory");
+    asm volatile ("rep movsb" : "+D"(dst), "+S"(src), "+c"(rest) :: "memory");
+}
+
+static void copyERMS(uint8_t *dst, const uint8_t *src, size_t n) {
+    asm volatile ("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) :: "memory");
+}
+
+static void copySSE2(uint8_t *dst, const uint8_t *src, size_t n) {
+    if(n < MEM_SSE2_MINIMUM) {
+        copyQuad(dst, src, n);
+        return;
+    }
+
+    // align the destination so the stores can be aligned too
+    size_t head = -(uintptr_t)dst & 15;
+    copyQuad(dst, src, head);
+    dst += head;
+    src += head;
+    n -= head;
+
+    // the loader is built without SSE, so the compiler never keeps anything
+    // in these registers and they don't have to be listed as clobbered
+    for(; n >= 64; n -= 64) {
+        asm volatile ("movdqu (%1), %%xmm0\n"
+                      "movdqu 16(%1), %%xmm1\n"
+                      "movdqu 32(%1), %%xmm2\n"
+                      "movdqu 48(%1), %%xmm3\n"
+                      "movdqa %%xmm0, (%0)\n"
+                      "movdqa %%xmm1, 16(%0)\n"
+                      "movdqa %%xmm2, 32(%0)\n"
+                      "movdqa %%xmm3, 48(%0)\n"
+                      :: "r"(dst), "r"(src) : "memory");
+        dst += 64;
+        src += 64;
+    }
+
+    copyQuad(dst, src, n);
+}
+
+static void copyVia(int variant, uint8_t *dst, const uint8_t *src, size_t n) {
+    if(variant == MEM_VARIANT_ERMS) copyERMS(dst, src, n);
+    else if(variant == MEM_VARIANT_SSE2) copySSE2(dst, src, n);
+    else copyQuad(dst, src, n);
+}
+
+static void setVia(int variant, uint8_t *dst, uint8_t v, size_t n) {
+    if(variant == MEM_VARIANT_ERMS) {
+        asm volatile ("rep stosb" : "+D"(dst), "+c"(n) : "a"(v) : "memory");
+    } else {
+        size_t quads = n >> 3;
+        size_t rest = n & 7;
+        uint64_t q = v * 0x0101010101010101;
+        asm volatile ("rep stosq" : "+D"(dst), "+c"(quads) : "a"(q) : "memory");
+        asm volatile ("rep stosb" : "+D"(dst), "+c"(rest) : "a"(q) : "memory");
+    }
+}
+
+void *memcpy(void *dst, const void *src, size_t n) {
+    uint8_t *dstc = (uint8_t *)dst;
+    uint8_t *srcc = (uint8_t *)src;
+
+    if(n < MEM_SMALL) {
+        for(size_t i = 0; i < n; i++) dstc[i] = srcc[i];
+    } else {
+        copyVia(copyVariant, dstc, srcc, n);
+    }
+
+    return dst;
+}
+
+void *memmove(void *dst, const void *src, size_t n) {
+    // memcpy() always copies forwards, which is safe when moving down
+    if((uintptr_t)dst <= (uintptr_t)src || (uintptr_t)dst >= ((uintptr_t)src + n)) return memcpy(dst, src, n);
+
+    uint8_t *dstc = (uint8_t *)dst + n - 1;
+    uint8_t *srcc = (uint8_t *)src + n - 1;
+    asm volatile ("std\n"
+                  "rep movsb\n"
+                  "cld" : "+D"(dstc), "+S"(srcc), "+c"(n) :: "memory");
+
+    return dst;
+}
+
+void *memset(void *dst, int v, size_t n) {
+    uint8_t *dstc = (uint8_t *)dst;
+
+    if(n < MEM_SMALL) {
+        for(size_t i = 0; i < n; i++) dstc[i] = v;
+    } else {
+        setVia(setVariant, dstc, v, n);
+    }
+
+    return dst;
+}
+
 int memcmp(const void *d1, const void *d2, size_t n) {
     uint8_t *d1c = (uint8_t *)d1;
     uint8_t *d2c = (uint8_t *)d2;
 
-    for(size_t i = 0; i < n; i++) {
-        if(*d1c != *d2c) {
-            return *d1c - *d2c;
+    // compare 64 bits at a time once the first pointer is aligned, and find
+    // the differing byte only when there is a difference
+    if(n >= MEM_SMALL) {
+        while((uintptr_t)d1c & 7) {
+            if(*d1c != *d2c) return *d1c - *d2c;
+            d1c++;
+            d2c++;
+            n--;
+        }
+
+        while(n >= 8 && *(uint64_t *)d1c == *(UnalignedQuad *)d2c) {
+            d1c += 8;
+            d2c += 8;
+            n -= 8;
         }
+    }
 
-        d1c++;
-        d2c++;
+    for(size_t i = 0; i < n; i++) {
+        if(d1c[i] != d2c[i]) return d1c[i] - d2c[i];
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+/*
+ * memInit(): selects the fastest memory primitives for the CPU
+ * params: none
+ * returns: nothing
+ */
+
+void memInit() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t max = eax;
+
+    cpuid(CPUID_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+    bool sse2 = (edx & CPUID_FEATURES_EDX_SSE2) && (readCR4() & CR4_OSFXSR) &&
+        !(readCR0() & (CR0_EMULATION | CR0_TASK_SWITCHED));
+
+    bool erms = false;
+    if(max >= CPUID_STRUCTURED_FEATURES) {
+        cpuid(CPUID_STRUCTURED_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+        erms = ebx & CPUID_STRUCTURED_EBX_ERMS;
+    }
+
+    if(erms) {
+        copyVariant = MEM_VARIANT_ERMS;
+        setVariant = MEM_VARIANT_ERMS;
+    } else if(sse2) {
+        copyVariant = MEM_VARIANT_SSE2;
+    }
+}
+
+/*
+ * memVariant(): forces one variant for both memcpy() and memset(), for the
+ * host build to check and time each of them; fills have no SSE2 variant and
+ * use rep stosq instead
+ * params: variant - one of MEM_VARIANT_*
+ * returns: nothing
+ */
+
+void memVariant(int variant) {
+    if(variant < 0 || variant >= MEM_VARIANTS) return;
+
+    copyVariant = variant;
+    setVariant = (variant == MEM_VARIANT_SSE2) ? MEM_VARIANT_QUAD : variant;
+}
+
+#ifdef MEM_BENCHMARK
+
+/*
+ * memBenchmark(): prints the throughput of every variant per size class
+ * built with 'make MEM_BENCHMARK=1'
+ * params: tsc - TSC frequency in Hz
+ * returns: nothing
+ */
+
+void memBenchmark(uint64_t tsc) {
+    static const char *names[MEM_VARIANTS] = { "movsq", "movsb", "sse2" };
+    static const size_t sizes[] = { 64, 512, 4096, 65536, 1048576 };
+    const size_t total = 16 * 1048576;      // bytes moved per measurement
+
+    uint8_t *a = allocPages((2 * 1048576) / PAGE_SIZE, BOOT_MEMORY_LOADER);
+    uint8_t *b = a + 1048576;
+    setVia(MEM_VARIANT_QUAD, a, 0x5A, 2 * 1048576);
+
+    printf("mem: variant, size, copy MB/s, fill MB/s\n");
+    for(int v = 0; v < MEM_VARIANTS; v++) {
+        for(int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            size_t rounds = total / sizes[i];
+
+            uint64_t start = rdtsc();
+            for(size_t r = 0; r < rounds; r++) copyVia(v, b, a, sizes[i]);
+            uint64_t copy = rdtsc() - start;
+
+            // there is no SSE2 fill, setVia() would only time rep stosq again
+            if(v == MEM_VARIANT_SSE2) {
+                printf("mem: %s, %d, %d, -\n", names[v], (uint32_t)sizes[i],
+                    (uint32_t)((total * tsc) / (copy ? copy : 1) / 1048576));
+                continue;
+            }
+
+            start = rdtsc();
+            for(size_t r = 0; r < rounds; r++) setVia(v, b, r, sizes[i]);
+            uint64_t set = rdtsc() - start;
+
+            printf("mem: %s, %d, %d, %d\n", names[v], (uint32_t)sizes[i],
+                (uint32_t)((total * tsc) / (copy ? copy : 1) / 1048576),
+                (uint32_t)((total * tsc) / (set ? set : 1) / 1048576));
+        }
+    }
+
+    // setVariant is never MEM_VARIANT_SSE2, fills fall back to movsq instead
+    printf("mem: using %s for copies and %s for fills\n", names[copyVariant], names[setVariant]);
+}
+
+#endif
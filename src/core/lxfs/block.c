@@ -10,36 +10,70 @@
 #include <lxboot.h>
 #include <lxfs.h>
 #include <stdio.h>
+#include <string.h>
+
+void *lxfsBlockBuffer;
+void *lxfsTextBuffer;
+void *lxfsDirectoryBuffer;
+
+// the identification block and the most recent table block are cached
+// because otherwise every block in a chain costs several extra sector reads
+static uint8_t cachedDisk;
+static int cachedPartition = -1;
+static uint32_t cachedPartitionStart;
+static LXFSIdentification cachedID;
+
+static void *tableBuffer;
+static uint32_t cachedTableBlock;
+
+void lxfsInit() {
+    lxfsBlockBuffer = allocPages(LXFS_MAX_BLOCK_SIZE / PAGE_SIZE, BOOT_MEMORY_LOADER);
+    lxfsTextBuffer = allocPages(1, BOOT_MEMORY_LOADER);
+    lxfsDirectoryBuffer = allocPages(LXFS_MAX_BLOCK_SIZE / PAGE_SIZE, BOOT_MEMORY_LOADER);
+    tableBuffer = allocPages(LXFS_MAX_BLOCK_SIZE / PAGE_SIZE, BOOT_MEMORY_LOADER);
+    cachedPartition = -1;
+}
+
+static LXFSIdentification *readIdentification(uint8_t disk, int partition) {
+    if(cachedPartition != partition || cachedDisk != disk) {
+        cachedPartitionStart = getPartitionStart(disk, partition);
+        uint8_t source = diskTraceSource(DISK_TRACE_ID);
+        readSectors(lxfsBlockBuffer, cachedPartitionStart, 1, disk);
+        diskTraceSource(source);
+        memcpy(&cachedID, lxfsBlockBuffer, sizeof(LXFSIdentification));
+
+        cachedDisk = disk;
+        cachedPartition = partition;
+        cachedTableBlock = 0;   // table blocks always come after block 33
+    }
+
+    return &cachedID;
+}
 
 // helper functions
 unsigned int getBlockSize(uint8_t disk, int partition) {
-    // TODO: cache this to improve performance and reduce i/o operations
-    uint32_t partitionStart = getPartitionStart(disk, partition);
-    readSectors((void *)LXFS_BLOCK_BUFFER, partitionStart, 1, disk);
-    LXFSIdentification *id = (LXFSIdentification *)LXFS_BLOCK_BUFFER;
-
+    LXFSIdentification *id = readIdentification(disk, partition);
     return ((id->parameters >> 3) & 0xF) + 1;
 }
 
 unsigned int getSectorSize(uint8_t disk, int partition) {
-    uint32_t partitionStart = getPartitionStart(disk, partition);
-    readSectors((void *)LXFS_BLOCK_BUFFER, partitionStart, 1, disk);
-    LXFSIdentification *id = (LXFSIdentification *)LXFS_BLOCK_BUFFER;
-
+    LXFSIdentification *id = readIdentification(disk, partition);
     uint8_t shift = (id->parameters >> 1) & 3;
     return (512 << shift);
 }
 
 uint64_t getRootDirectory(uint8_t disk, int partition) {
-    uint32_t partitionStart = getPartitionStart(disk, partition);
-    readSectors((void *)LXFS_BLOCK_BUFFER, partitionStart, 1, disk);
-    LXFSIdentification *id = (LXFSIdentification *)LXFS_BLOCK_BUFFER;
-
+    LXFSIdentification *id = readIdentification(disk, partition);
     return id->rootBlock;
 }
 
+uint32_t lxfsPartitionStart(uint8_t disk, int partition) {
+    readIdentification(disk, partition);
+    return cachedPartitionStart;
+}
+
 size_t readBlock(uint8_t disk, int partition, uint64_t start, size_t count, void *buffer) {
-    uint32_t partitionStart = getPartitionStart(disk, partition);
+    uint32_t partitionStart = lxfsPartitionStart(disk, partition);
     uint32_t blockSize = getBlockSize(disk, partition);
     readSectors(buffer, (start*blockSize)+partitionStart, count*blockSize, disk);
     return count;
@@ -51,13 +85,18 @@ uint64_t getNextBlock(uint8_t disk, int partition, uint32_t block) {
     tableBlock += 33;       // skip to the actual table blocks
     uint32_t tableIndex = block % (blockSizeBytes / 8);
 
-    readBlock(disk, partition, tableBlock, 1, (void *)LXFS_BLOCK_BUFFER);
+    if(tableBlock != cachedTableBlock) {
+        uint8_t source = diskTraceSource(DISK_TRACE_TABLE);
+        readBlock(disk, partition, tableBlock, 1, tableBuffer);
+        diskTraceSource(source);
+        cachedTableBlock = tableBlock;
+    }
 
-    uint64_t *data = (uint64_t *)LXFS_BLOCK_BUFFER;
+    uint64_t *data = (uint64_t *)tableBuffer;
     return data[tableIndex];
 }
 
 uint64_t readNextBlock(uint8_t disk, int partition, uint64_t block, void *buffer) {
     readBlock(disk, partition, block, 1, buffer);
     return getNextBlock(disk, partition, block);
-}
\ No newline at end of file
+}
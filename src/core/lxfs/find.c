@@ -69,8 +69,10 @@ bool lxfsFindPath(uint8_t disk, int partition, const char *path, LXFSDirectoryEn
         // root directory
         uint64_t rootBlock = getRootDirectory(disk, partition);
         //printf("lxfs: root directory is at block %d\n", rootBlock);
-        LXFSDirectoryHeader *rootHeader = (LXFSDirectoryHeader *)LXFS_DIRECTORY_BUFFER;
+        LXFSDirectoryHeader *rootHeader = (LXFSDirectoryHeader *)lxfsDirectoryBuffer;
+        uint8_t source = diskTraceSource(DISK_TRACE_DIRECTORY);
         readBlock(disk, partition, rootBlock, 1, rootHeader);
+        diskTraceSource(source);
 
         dst->createTime = rootHeader->createTime;
         dst->accessTime = rootHeader->accessTime;
@@ -91,7 +93,7 @@ bool lxfsFindPath(uint8_t disk, int partition, const char *path, LXFSDirectoryEn
 
     // this is for other non-root directory
     // we alwaysb have to start by finding the root anyway
-    LXFSDirectoryEntry *entry = (LXFSDirectoryEntry *)LXFS_DIRECTORY_BUFFER;
+    LXFSDirectoryEntry *entry = (LXFSDirectoryEntry *)lxfsDirectoryBuffer;
     lxfsFindPath(disk, partition, "/", entry);
 
     bool found = false;
@@ -106,19 +108,21 @@ bool lxfsFindPath(uint8_t disk, int partition, const char *path, LXFSDirectoryEn
         uint64_t block = entry->block;
         int directoryIndex;
 
-        splitPath((char *)LXFS_TEXT_BUFFER, path, pathIndex);
+        splitPath((char *)lxfsTextBuffer, path, pathIndex);
 
         while(block != LXFS_BLOCK_EOF) {
+            uint8_t source = diskTraceSource(DISK_TRACE_DIRECTORY);
             block = readNextBlock(disk, partition, block, entry);   // one block at a time
-            //printf("%s\n", (char *)LXFS_TEXT_BUFFER);
+            diskTraceSource(source);
+            //printf("%s\n", (char *)lxfsTextBuffer);
 
-            entry = (LXFSDirectoryEntry *)((uint8_t *)LXFS_DIRECTORY_BUFFER + sizeof(LXFSDirectoryHeader));
+            entry = (LXFSDirectoryEntry *)((uint8_t *)lxfsDirectoryBuffer + sizeof(LXFSDirectoryHeader));
             directoryIndex = sizeof(LXFSDirectoryHeader);
 
             while(entry->flags & LXFS_DIR_VALID) {
-                //printf("lxfs: searching for %s, found %s\n", (char *)LXFS_TEXT_BUFFER, entry->name);
+                //printf("lxfs: searching for %s, found %s\n", (char *)lxfsTextBuffer, entry->name);
 
-                if(!strcmp((const char *)LXFS_TEXT_BUFFER, (const char *)entry->name)) {
+                if(!strcmp((const char *)lxfsTextBuffer, (const char *)entry->name)) {
                     found = true;
                     break;
                 }
@@ -0,0 +1,82 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* Read-only Minimalist LXFS Implementation */
+
+#include <lxboot.h>
+#include <lxfs.h>
+#include <string.h>
+#include <stdio.h>
+
+// whole directories are read here, kept across calls and only replaced by a
+// larger one when a directory doesn't fit
+static uint8_t *listBuffer = NULL;
+static size_t listBufferSize = 0;
+
+/*
+ * lxfsList(): lists the names of the entries in a directory
+ * params: disk - BIOS disk number
+ * params: partition - partition index
+ * params: path - path of the directory
+ * params: names - buffer to store null-terminated names one after the other
+ * params: size - size of the buffer
+ * returns: number of names stored, -1 if the path isn't a directory
+ */
+
+int lxfsList(uint8_t disk, int partition, const char *path, char *names, size_t size) {
+    LXFSDirectoryEntry *entry = (LXFSDirectoryEntry *)lxfsDirectoryBuffer;
+    if(!lxfsFindPath(disk, partition, path, entry)) return -1;
+    if(((entry->flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK) != LXFS_DIR_TYPE_DIR) return -1;
+
+    // the entries may cross block boundaries, so read the whole directory
+    uint64_t first = entry->block;
+    int blockSizeBytes = getBlockSize(disk, partition) * getSectorSize(disk, partition);
+    size_t blocks = 0;
+    for(uint64_t block = first; block != LXFS_BLOCK_EOF; block = getNextBlock(disk, partition, block)) {
+        blocks++;
+    }
+
+    size_t total = blocks * blockSizeBytes;
+    if(lxfsBufferSize(total) > listBufferSize) {
+        listBufferSize = lxfsBufferSize(total);
+        listBuffer = allocPages(listBufferSize / PAGE_SIZE, BOOT_MEMORY_LOADER);
+    }
+
+    uint8_t *directory = listBuffer;
+    size_t count = 0;
+    uint8_t source = diskTraceSource(DISK_TRACE_DIRECTORY);
+    for(uint64_t block = first; block != LXFS_BLOCK_EOF; count++) {
+        block = readNextBlock(disk, partition, block, directory + (count * blockSizeBytes));
+    }
+
+    diskTraceSource(source);
+
+    int n = 0;
+    size_t offset = sizeof(LXFSDirectoryHeader);
+    size_t used = 0;
+
+    while((offset + sizeof(LXFSDirectoryEntry) - 512) <= total) {
+        entry = (LXFSDirectoryEntry *)(directory + offset);
+        if(!(entry->flags & LXFS_DIR_VALID) || !entry->entrySize) break;
+
+        if(!(entry->flags & LXFS_DIR_DELETED)) {
+            size_t len = strlen((const char *)entry->name);
+            if((used + len + 1) > size) {
+                printf("lxfs: too many entries in %s\n", path);
+                break;
+            }
+
+            strcpy(names + used, (const char *)entry->name);
+            used += len + 1;
+            n++;
+        }
+
+        offset += entry->entrySize;
+    }
+
+    return n;
+}
@@ -7,14 +7,27 @@
 
 /* Read-only Minimalist LXFS Implementation */
 
+#include <lxboot.h>
 #include <lxfs.h>
 #include <stdio.h>
 
 bool lxfsRead(uint8_t disk, int partition, const char *path, void *buffer) {
     //printf("lxfs: reading %s from disk 0x%02X partition %d...\n", path, disk, partition);
-    LXFSDirectoryEntry *entry = (LXFSDirectoryEntry *)LXFS_DIRECTORY_BUFFER;
+    LXFSDirectoryEntry *entry = (LXFSDirectoryEntry *)lxfsDirectoryBuffer;
     if(!lxfsFindPath(disk, partition, path, entry)) return false;
+    return lxfsReadEntry(disk, partition, entry, buffer);
+}
+
+/*
+ * lxfsReadEntry(): reads a file that was already looked up
+ * params: disk - BIOS disk number
+ * params: partition - partition index
+ * params: entry - directory entry of the file, from lxfsFindPath()
+ * params: buffer - at least lxfsBufferSize() bytes
+ * returns: true if anything was read
+ */
 
+bool lxfsReadEntry(uint8_t disk, int partition, LXFSDirectoryEntry *entry, void *buffer) {
     // cannot read directories the way we read files
     if(((entry->flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK) != LXFS_DIR_TYPE_FILE) return false;
 
@@ -22,18 +35,69 @@ bool lxfsRead(uint8_t disk, int partition, const char *path, void *buffer) {
     size_t count = 0;
     int blockSizeBytes = getBlockSize(disk, partition) * getSectorSize(disk, partition);
 
+    uint8_t source = diskTraceSource(DISK_TRACE_FILE);
     while(block != LXFS_BLOCK_EOF) {
         //printf("lxfs: reading block %d\n", block);
         block = readNextBlock(disk, partition, block, buffer + (blockSizeBytes * count));
         count++;
     }
 
+    diskTraceSource(source);
+
     return count;   // aka true if we read anything at all
 }
 
 size_t lxfsSize(uint8_t disk, int partition, const char *path) {
-    LXFSDirectoryEntry *entry = (LXFSDirectoryEntry *)LXFS_DIRECTORY_BUFFER;
+    LXFSDirectoryEntry *entry = (LXFSDirectoryEntry *)lxfsDirectoryBuffer;
     if(!lxfsFindPath(disk, partition, path, entry)) return 0;
     if(((entry->flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK) != LXFS_DIR_TYPE_FILE) return 0;
     return entry->size;
 }
+
+/*
+ * lxfsExtents(): resolves a file to the runs of sectors that hold its data
+ * params: disk - BIOS disk number
+ * params: partition - partition index
+ * params: path - path of the file
+ * params: extents - array to store the extents in file order
+ * params: max - size of the array
+ * returns: number of extents, -1 if the file wasn't found or is too fragmented
+ */
+
+int lxfsExtents(uint8_t disk, int partition, const char *path, DiskExtent *extents, int max) {
+    LXFSDirectoryEntry *entry = (LXFSDirectoryEntry *)lxfsDirectoryBuffer;
+    if(!lxfsFindPath(disk, partition, path, entry)) return -1;
+    if(((entry->flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK) != LXFS_DIR_TYPE_FILE) return -1;
+
+    uint32_t partitionStart = lxfsPartitionStart(disk, partition);
+    uint32_t blockSize = getBlockSize(disk, partition);
+    uint64_t block = getNextBlock(disk, partition, entry->block);
+    int count = 0;
+
+    while(block != LXFS_BLOCK_EOF) {
+        uint64_t lba = (block * blockSize) + partitionStart;
+
+        if(count && (extents[count-1].lba + extents[count-1].count) == lba) {
+            extents[count-1].count += blockSize;
+        } else {
+            if(count >= max) return -1;
+            extents[count].lba = lba;
+            extents[count].count = blockSize;
+            count++;
+        }
+
+        block = getNextBlock(disk, partition, block);
+    }
+
+    return count;
+}
+
+/*
+ * lxfsBufferSize(): returns how large a buffer passed to lxfsRead() must be
+ * because files are read in whole blocks
+ */
+
+size_t lxfsBufferSize(size_t size) {
+    if(!size) return LXFS_MAX_BLOCK_SIZE;
+    return (size + LXFS_MAX_BLOCK_SIZE - 1) & ~(LXFS_MAX_BLOCK_SIZE - 1);
+}
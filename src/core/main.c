@@ -13,31 +13,139 @@
 #include <elf.h>
 #include <vbe.h>
 #include <acpi.h>
+#include <smp.h>
 
-#define KERNEL_BUFFER       (void *)0x100000
+#define RAMDISK_MAX_EXTENTS     4096
 
 LXBootInfo bootInfo;
 CPURegisters *biosRegs;
 KernelBootInfo kernelBootInfo;
+static char moduleNames[CONFIG_MAX_MODULES];
 
-static uint64_t forcePageAlignment(uint64_t addr) {
-    while(addr & 0xFFF) {
-        addr++;
+/*
+ * placePayload(): allocates memory for a ramdisk or module
+ * params: size - size of the payload in bytes
+ * returns: 2 MiB-aligned address so the kernel can map the payload with large
+ * pages, or 4 KiB-aligned address if the large alignment doesn't fit in memory
+ */
+
+static uint64_t placePayload(uint64_t size) {
+    size = lxfsBufferSize(size);
+    uint64_t addr = allocAligned(size, HUGE_PAGE_SIZE, BOOT_MEMORY_PAYLOAD);
+    if(!addr) addr = allocAligned(size, PAGE_SIZE, BOOT_MEMORY_PAYLOAD);
+    if(!addr) {
+        printf("not enough memory to load payload\n");
+        halt();
     }
 
     return addr;
 }
 
+/*
+ * describeConsole(): fills in the console descriptor of the boot info
+ * params: output - VIDEO_OUTPUT_* of the boot option
+ * params: videoMode - mode that was set, NULL if there is no framebuffer
+ * returns: nothing
+ */
+
+static void describeConsole(uint8_t output, VideoMode *videoMode) {
+    // the BIOS data area has the COM ports and the text mode geometry
+    kernelBootInfo.consoleSerialPort = *(uint16_t *)(uintptr_t)0x400;
+
+    if(output == VIDEO_OUTPUT_GRAPHICS) {
+        kernelBootInfo.consoleType = CONSOLE_FRAMEBUFFER;
+        kernelBootInfo.consoleAddress = videoMode->framebuffer;
+    } else if(output == VIDEO_OUTPUT_TEXT) {
+        uint16_t columns = *(uint16_t *)(uintptr_t)0x44A;
+        uint8_t rows = *(uint8_t *)(uintptr_t)0x484;
+
+        kernelBootInfo.consoleType = CONSOLE_TEXT;
+        kernelBootInfo.consoleAddress = 0xB8000;
+        kernelBootInfo.consoleColumns = columns ? columns : 80;
+        kernelBootInfo.consoleRows = rows ? rows + 1 : 25;
+    } else {
+        kernelBootInfo.consoleType = CONSOLE_SERIAL;
+    }
+}
+
+/*
+ * loadLazyRamdisk(): resolves the ramdisk to its extents and loads only the
+ * prefix requested by the boot option
+ * params: option - selected boot option
+ * params: size - size of the ramdisk in bytes
+ * returns: address of the loaded prefix, zero if nothing was loaded, or -1 if
+ * the ramdisk is too fragmented and has to be loaded in full
+ */
+
+static uint64_t loadLazyRamdisk(BootConfig *option, uint64_t size) {
+    DiskExtent *extents = allocPages((RAMDISK_MAX_EXTENTS * sizeof(DiskExtent)) / PAGE_SIZE, BOOT_MEMORY_LOADER);
+    int count = lxfsExtents(bootInfo.bootDevice, partitionIndex, option->ramdisk, extents, RAMDISK_MAX_EXTENTS);
+    if(count < 0) {
+        printf("ramdisk is too fragmented for lazy loading\n");
+        allocFree((uintptr_t)extents, RAMDISK_MAX_EXTENTS * sizeof(DiskExtent));
+        return (uint64_t)-1;
+    }
+
+    // only keep as much of the table as is actually used
+    DiskExtent *table = allocPages(((count * sizeof(DiskExtent)) + PAGE_SIZE - 1) / PAGE_SIZE, BOOT_MEMORY_BOOT_INFO);
+    memcpy(table, extents, count * sizeof(DiskExtent));
+    allocFree((uintptr_t)extents, RAMDISK_MAX_EXTENTS * sizeof(DiskExtent));
+
+    uint64_t prefix = option->ramdiskPrefix;
+    if(prefix > size) prefix = size;
+
+    kernelBootInfo.ramdiskFlags = RAMDISK_FLAGS_LAZY;
+    kernelBootInfo.ramdiskDisk = bootInfo.bootDevice;
+    kernelBootInfo.ramdiskLoaded = prefix;
+    kernelBootInfo.ramdiskExtents = (uintptr_t)table;
+    kernelBootInfo.ramdiskExtentCount = count;
+
+    printf("ramdisk has %d extent%s, loading %d KiB up front\n", count, count == 1 ? "" : "s", (uint32_t)(prefix >> 10));
+    if(!prefix) return 0;
+
+    uint64_t addr = placePayload(prefix);
+    uint8_t *dst = (uint8_t *)(uintptr_t)addr;
+    uint32_t sectors = (prefix + 511) >> 9;
+
+    uint8_t source = diskTraceSource(DISK_TRACE_RAMDISK);
+    for(int i = 0; i < count && sectors; i++) {
+        uint32_t n = (table[i].count < sectors) ? table[i].count : sectors;
+        readSectors(dst, table[i].lba, n, bootInfo.bootDevice);
+        dst += n * 512;
+        sectors -= n;
+    }
+
+    diskTraceSource(source);
+
+    return addr;
+}
+
 int main(LXBootInfo *boot) {
+    memInit();
     memcpy(&bootInfo, boot, sizeof(LXBootInfo));
-    biosRegs = (CPURegisters *)boot->regs;
+    biosRegs = (CPURegisters *)(uintptr_t)boot->regs;
+    consoleInit(CONSOLE_OUTPUT_VGA);
 
-    findBootPartition();
+    // the earlier stages left their start times in the boot info
+    timelineRecord("stage 1", bootInfo.timestamps[0]);
+    timelineRecord("stage 2", bootInfo.timestamps[1]);
+    timelineRecord("core", bootInfo.timestamps[2]);
+
+    timelineMark("memory");
     uint64_t highestPhysicalAddress;
     int memoryMapSize = detectMemory(&highestPhysicalAddress);
+    allocInit();
+    pagingInit(highestPhysicalAddress);
+    logInit();
+
+    timelineMark("disk");
+    lxfsInit();
+
+    findBootPartition();
     ACPIRSDP *rsdp = findACPIRoot();
 
     /* load the config file */
+    timelineMark("config");
     loadConfig("/lxboot.conf");
 
     // TODO: display a menu letting the user choose a boot option
@@ -45,81 +153,132 @@ int main(LXBootInfo *boot) {
     BootConfig *option = selectBootOption(0);
     if(!option) {
         printf("unable to select boot option\n");
-        while(1);
+        halt();
     }
 
+    if(option->console) consoleInit(option->console);
+    if(option->quiet) logVerbosity(LOG_QUIET);
+
     printf("booting %s...\n", option->name);
 
     // load the kernel
+    timelineMark("kernel");
     printf("loading kernel %s...\n", option->kernel);
 
-    if(!lxfsRead(bootInfo.bootDevice, partitionIndex, option->kernel, KERNEL_BUFFER)) {
+    size_t kernelSize = lxfsSize(bootInfo.bootDevice, partitionIndex, option->kernel);
+    void *kernelBuffer = allocPages(lxfsBufferSize(kernelSize) / PAGE_SIZE, BOOT_MEMORY_LOADER);
+    if(!lxfsRead(bootInfo.bootDevice, partitionIndex, option->kernel, kernelBuffer)) {
         printf("could not load %s\n", option->kernel);
-        while(1);
+        halt();
     }
 
-    uint64_t lowestUsableAddress, kernelHighestAddress;
-    uint32_t kernelEntry = (uint32_t)loadELF(KERNEL_BUFFER, &kernelHighestAddress);
+    uint64_t kernelHighestAddress;
+    uint64_t kernelEntry = loadELF(kernelBuffer, &kernelHighestAddress);
     if(!kernelEntry) {
         printf("could not parse kernel executable\n");
-        while(1);
+        halt();
     }
 
-    lowestUsableAddress = kernelHighestAddress;
-
     // load the ramdisk if present
     uint64_t ramdisk = 0;
     size_t ramdiskSize = 0;
     if(strlen(option->ramdisk)) {
+        timelineMark("ramdisk");
         printf("loading ramdisk %s...\n", option->ramdisk);
 
-        ramdisk = forcePageAlignment(lowestUsableAddress);
-        if(!lxfsRead(bootInfo.bootDevice, partitionIndex, option->ramdisk, (void *)(uintptr_t)ramdisk)) {
-            printf("could not load %s\n", option->ramdisk);
-            while(1);
-        }
-
         ramdiskSize = lxfsSize(bootInfo.bootDevice, partitionIndex, option->ramdisk);
+        ramdisk = option->ramdiskLazy ? loadLazyRamdisk(option, ramdiskSize) : (uint64_t)-1;
+
+        if(ramdisk == (uint64_t)-1) {
+            ramdisk = placePayload(ramdiskSize);
+            if(!lxfsRead(bootInfo.bootDevice, partitionIndex, option->ramdisk, (void *)(uintptr_t)ramdisk)) {
+                printf("could not load %s\n", option->ramdisk);
+                halt();
+            }
+
+            kernelBootInfo.ramdiskFlags = 0;
+            kernelBootInfo.ramdiskLoaded = ramdiskSize;
 
-        lowestUsableAddress = ramdisk + ramdiskSize;
+            // the whole archive is in memory, so index it now
+            uint64_t index;
+            uint8_t format;
+            kernelBootInfo.ramdiskIndexCount = indexRamdisk((const void *)(uintptr_t)ramdisk, ramdiskSize, &index, &format);
+            kernelBootInfo.ramdiskIndex = index;
+            kernelBootInfo.ramdiskFormat = format;
+        }
     }
 
     // load modules if present
     char module[CONFIG_MAX_MODULES];
+    char *moduleName = moduleNames;
     uint64_t moduleAddress;
     uint64_t moduleSize;
     if(option->moduleCount) {
+        timelineMark("modules");
         for(int i = 0; i < option->moduleCount; i++) {
             if(!copyModule(module, option->modules, i)) {
                 printf("failed to load modules\n");
-                while(1);
+                halt();
             }
 
             printf("loading module %d of %d: %s...\n", i+1, option->moduleCount, module);
-            
-            moduleAddress = forcePageAlignment(lowestUsableAddress);
 
-            strcpy((char *)(uintptr_t)moduleAddress, module);
+            moduleSize = lxfsSize(bootInfo.bootDevice, partitionIndex, module);
+            moduleAddress = placePayload(moduleSize);
 
-            if(!lxfsRead(bootInfo.bootDevice, partitionIndex, module, (char *)(uintptr_t)moduleAddress + strlen((char *)(uintptr_t)moduleAddress) + 1)) {
+            if(!lxfsRead(bootInfo.bootDevice, partitionIndex, module, (void *)(uintptr_t)moduleAddress)) {
                 printf("could not load %s\n", module);
-                while(1);
+                halt();
             }
 
-            moduleSize = lxfsSize(bootInfo.bootDevice, partitionIndex, module);
-            lowestUsableAddress = moduleAddress + moduleSize + strlen(module) + 1;
+            // names go in a separate table so the module data stays aligned
+            strcpy(moduleName, module);
 
             kernelBootInfo.modules[i] = moduleAddress;
             kernelBootInfo.moduleSizes[i] = moduleSize;
+            kernelBootInfo.moduleNames[i] = (uintptr_t)moduleName;
+            moduleName += strlen(module) + 1;
         }
     }
 
-    // enable high resolution
-    VBEMode *videoMode = vbeSetup();
+    // read ahead the files the kernel will want first
+    timelineMark("preload");
+    uint64_t preloadFiles;
+    int preloadCount = preload(option, &preloadFiles);
+
+    timelineMark("acpi");
+    ACPISummary acpi;
+    acpiInit(rsdp, &acpi);
+
+    NUMASummary numa;
+    numaInit(&numa);
+
+    CPUInfo *cpuInfo = cpuSnapshot();
+
+    timelineMark("timer");
+    uint8_t tscSource;
+    bool tscInvariant;
+    uint64_t tsc = tscFrequency(acpi.pmTimerPort, acpi.pmTimerBits, &tscSource, &tscInvariant);
+
+#ifdef MEM_BENCHMARK
+    memBenchmark(tsc);
+#endif
+
+    // enable high resolution, unless the boot option is headless
+    timelineMark("video");
+    VBESummary video;
+    VideoMode *videoMode = NULL;
+    if(option->videoOutput == VIDEO_OUTPUT_GRAPHICS) {
+        videoMode = vbeSetup(option->videoWidth, option->videoHeight, option->videoBpp, &video);
+        consoleFramebuffer(videoMode);
+    } else {
+        memset(&video, 0, sizeof(VBESummary));
+        printf("video: headless boot, skipping VESA\n");
+    }
 
     // this will be passed to the kernel so it has some info to start with
     kernelBootInfo.magic = 0x5346584C;
-    kernelBootInfo.version = 1;
+    kernelBootInfo.version = 2;
     kernelBootInfo.flags = 0;           // BIOS
     kernelBootInfo.biosBootDisk = bootInfo.bootDevice;
     kernelBootInfo.biosBootPartitionIndex = partitionIndex;
@@ -131,23 +290,34 @@ int main(LXBootInfo *boot) {
     kernelBootInfo.memoryMap = (uintptr_t)memoryMap;
     kernelBootInfo.memoryMapSize = memoryMapSize;
 
-    kernelBootInfo.width = videoMode->width;
-    kernelBootInfo.height = videoMode->height;
-    kernelBootInfo.bpp = videoMode->bpp;
-    kernelBootInfo.framebuffer = videoMode->framebuffer;
-    kernelBootInfo.pitch = videoMode->pitch;
-    kernelBootInfo.redPosition = videoMode->redPosition;
-    kernelBootInfo.redMask = videoMode->redMask;
-    kernelBootInfo.greenPosition = videoMode->greenPosition;
-    kernelBootInfo.greenMask = videoMode->greenMask;
-    kernelBootInfo.bluePosition = videoMode->bluePosition;
-    kernelBootInfo.blueMask = videoMode->blueMask;
+    if(videoMode) {
+        kernelBootInfo.width = videoMode->width;
+        kernelBootInfo.height = videoMode->height;
+        kernelBootInfo.bpp = videoMode->bpp;
+        kernelBootInfo.framebuffer = videoMode->framebuffer;
+        kernelBootInfo.pitch = videoMode->pitch;
+        kernelBootInfo.redPosition = videoMode->redPosition;
+        kernelBootInfo.redMask = videoMode->redMask;
+        kernelBootInfo.greenPosition = videoMode->greenPosition;
+        kernelBootInfo.greenMask = videoMode->greenMask;
+        kernelBootInfo.bluePosition = videoMode->bluePosition;
+        kernelBootInfo.blueMask = videoMode->blueMask;
+    }
+
+    kernelBootInfo.videoModes = video.modes;
+    kernelBootInfo.videoModeCount = video.modeCount;
+    kernelBootInfo.videoModeCurrent = video.current;
+    kernelBootInfo.edid = video.edid;
+
+    describeConsole(option->videoOutput, videoMode);
 
     kernelBootInfo.ramdisk = ramdisk;
     kernelBootInfo.ramdiskSize = ramdiskSize;
 
     kernelBootInfo.moduleCount = option->moduleCount;
-    kernelBootInfo.lowestFreeMemory = forcePageAlignment(lowestUsableAddress);
+
+    kernelBootInfo.preloadFiles = preloadFiles;
+    kernelBootInfo.preloadCount = preloadCount;
 
     strcpy(kernelBootInfo.arguments, option->kernel);
 
@@ -156,11 +326,81 @@ int main(LXBootInfo *boot) {
         strcpy(kernelBootInfo.arguments + strlen(kernelBootInfo.arguments), option->arguments);
     }
 
-    // this has to be the LAST setup because of buffer overlaps and that we
-    // have very limited memory at this stage
-    pagingSetup();
-    void (*lmode)(uint32_t, uint32_t, KernelBootInfo *) = (void (*))bootInfo.lmode;
-    lmode(PAGING_BASE, kernelEntry, &kernelBootInfo);
+    // page tables are the last allocation so the table handed to the kernel
+    // is complete
+    timelineMark("paging");
+    uint64_t pml4 = pagingSetup(highestPhysicalAddress);
+
+    uint64_t pat = 0;
+    if(videoMode) {
+        // an MTRR would only be set on the BSP, so it's out if the MADT lists
+        // any APs to start
+        kernelBootInfo.framebufferCaching = pagingWriteCombine(videoMode->framebuffer,
+            (uint64_t)videoMode->pitch * videoMode->height, acpi.cpuCount <= 1, &pat);
+    }
+
+    kernelBootInfo.pat = pat;
+
+    // the APs start on the final page tables and PAT, so this comes after both
+    timelineMark("smp");
+    uint64_t cpus, localAPIC;
+    kernelBootInfo.cpuCount = smpSetup(pml4, pat, &cpus, &localAPIC);
+    kernelBootInfo.cpus = cpus;
+    kernelBootInfo.localAPIC = localAPIC;
+
+    kernelBootInfo.acpiTables = acpi.tables;
+    kernelBootInfo.acpiTableCount = acpi.tableCount;
+    kernelBootInfo.acpiCPUCount = acpi.cpuCount;
+    kernelBootInfo.acpiIOAPICCount = acpi.ioapicCount;
+    kernelBootInfo.acpiPMTimerPort = acpi.pmTimerPort;
+    kernelBootInfo.acpiPMTimerBits = acpi.pmTimerBits;
+
+    kernelBootInfo.numaMemory = numa.memory;
+    kernelBootInfo.numaMemoryCount = numa.memoryCount;
+    kernelBootInfo.numaCPUs = numa.cpus;
+    kernelBootInfo.numaCPUCount = numa.cpuCount;
+    kernelBootInfo.numaDistances = numa.distances;
+    kernelBootInfo.numaDomainCount = numa.domainCount;
+
+    kernelBootInfo.tscFrequency = tsc;
+    kernelBootInfo.tscSource = tscSource;
+    kernelBootInfo.tscInvariant = tscInvariant;
+    kernelBootInfo.cpuInfo = (uintptr_t)cpuInfo;
+
+    // the last entry stands for the jump to the kernel
+    timelineMark("handoff");
+    if(option->timeline) timelinePrint(tsc);
+
+    uint64_t timeline;
+    kernelBootInfo.timelineCount = timelineHandoff(&timeline);
+    kernelBootInfo.timeline = timeline;
+
+    // only in builds with BIOS_PROFILE
+    biosProfilePrint(tsc);
+
+    uint64_t biosProfile;
+    kernelBootInfo.biosProfileCount = biosProfileHandoff(&biosProfile);
+    kernelBootInfo.biosProfile = biosProfile;
+
+    uint64_t diskTrace;
+    uint32_t diskTraceDropped;
+    kernelBootInfo.diskTraceCount = diskTraceHandoff(&diskTrace, &diskTraceDropped);
+    kernelBootInfo.diskTrace = diskTrace;
+    kernelBootInfo.diskTraceDropped = diskTraceDropped;
+
+    uint64_t bootLog;
+    uint32_t bootLogDropped;
+    kernelBootInfo.bootLogSize = logHandoff(&bootLog, &bootLogDropped);
+    kernelBootInfo.bootLog = bootLog;
+    kernelBootInfo.bootLogDropped = bootLogDropped;
+
+    int bootMemoryCount;
+    kernelBootInfo.bootMemory = (uintptr_t)allocTable(&bootMemoryCount);
+    kernelBootInfo.bootMemoryCount = bootMemoryCount;
+    kernelBootInfo.lowestFreeMemory = allocLowestFree();
+
+    void (*lmode)(uint64_t, uint64_t, KernelBootInfo *) = (void (*)(uint64_t, uint64_t, KernelBootInfo *))(uintptr_t)bootInfo.lmode;
+    lmode(pml4, kernelEntry, &kernelBootInfo);
 
     // the above function will never return
     return -1;
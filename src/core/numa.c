@@ -0,0 +1,150 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* NUMA topology */
+/* the SRAT and SLIT are boiled down to flat tables so that the kernel can
+ * allocate node-locally from its very first allocation */
+
+#include <lxboot.h>
+#include <acpi.h>
+#include <stdio.h>
+#include <string.h>
+
+#define NUMA_DISTANCE_REMOTE    20      // ACPI's default for remote domains
+#define NUMA_MAX_DOMAINS        256     // above this there is no distance matrix
+
+static NUMAMemoryRange *memory;
+static NUMACPU *cpus;
+static int memoryCount, cpuCount;
+static uint32_t highestDomain;
+
+static void addMemory(SRATMemoryAffinity *entry) {
+    if(!(entry->flags & SRAT_ENABLED) || !entry->size) return;
+
+    if(memory) {
+        memory[memoryCount].base = entry->base;
+        memory[memoryCount].size = entry->size;
+        memory[memoryCount].domain = entry->domain;
+        memory[memoryCount].flags = entry->flags;
+    }
+
+    if(entry->domain > highestDomain) highestDomain = entry->domain;
+    memoryCount++;
+}
+
+static void addCPU(uint32_t apicID, uint32_t domain) {
+    if(cpus) {
+        cpus[cpuCount].apicID = apicID;
+        cpus[cpuCount].domain = domain;
+    }
+
+    if(domain > highestDomain) highestDomain = domain;
+    cpuCount++;
+}
+
+static void walkSRAT(ACPISRAT *srat) {
+    uint8_t *ptr = (uint8_t *)srat + sizeof(ACPISRAT);
+    uint8_t *end = (uint8_t *)srat + srat->header.length;
+
+    memoryCount = 0;
+    cpuCount = 0;
+    highestDomain = 0;
+
+    while((ptr + sizeof(MADTEntryHeader)) <= end) {
+        MADTEntryHeader *entry = (MADTEntryHeader *)ptr;
+        if(entry->length < sizeof(MADTEntryHeader) || (ptr + entry->length) > end) break;
+
+        if(entry->type == SRAT_MEMORY_AFFINITY && entry->length >= sizeof(SRATMemoryAffinity)) {
+            addMemory((SRATMemoryAffinity *)entry);
+        } else if(entry->type == SRAT_CPU_AFFINITY && entry->length >= sizeof(SRATCPUAffinity)) {
+            SRATCPUAffinity *cpu = (SRATCPUAffinity *)entry;
+            if(cpu->flags & SRAT_ENABLED) {
+                uint32_t domain = cpu->domainLow | (cpu->domainHigh[0] << 8) |
+                    (cpu->domainHigh[1] << 16) | (cpu->domainHigh[2] << 24);
+                addCPU(cpu->apicID, domain);
+            }
+        } else if(entry->type == SRAT_X2APIC_AFFINITY && entry->length >= sizeof(SRATX2APICAffinity)) {
+            SRATX2APICAffinity *cpu = (SRATX2APICAffinity *)entry;
+            if(cpu->flags & SRAT_ENABLED) addCPU(cpu->x2apicID, cpu->domain);
+        }
+
+        ptr += entry->length;
+    }
+}
+
+static void fillDistances(uint8_t *distances, int domains) {
+    ACPISLIT *slit = findACPITable("SLIT");
+    int slitCount = 0;
+    if(slit && slit->count <= NUMA_MAX_DOMAINS &&
+    slit->header.length >= (sizeof(ACPISLIT) + (slit->count * slit->count))) {
+        slitCount = slit->count;
+    }
+
+    for(int i = 0; i < domains; i++) {
+        for(int j = 0; j < domains; j++) {
+            if(i < slitCount && j < slitCount) distances[(i * domains) + j] = slit->distances[(i * slitCount) + j];
+            else distances[(i * domains) + j] = (i == j) ? NUMA_DISTANCE_LOCAL : NUMA_DISTANCE_REMOTE;
+        }
+    }
+
+    if(!slitCount) printf("numa: no usable SLIT, assuming default distances\n");
+}
+
+/*
+ * numaInit(): parses the SRAT and SLIT into tables for the kernel
+ * this must be called after acpiInit()
+ * params: summary - pointer to where to store the tables and their sizes
+ * returns: number of proximity domains, zero if there is no SRAT
+ */
+
+uint32_t numaInit(NUMASummary *summary) {
+    memset(summary, 0, sizeof(NUMASummary));
+
+    ACPISRAT *srat = findACPITable("SRAT");
+    if(!srat) return 0;
+
+    // count first, then fill everything into one allocation
+    memory = NULL;
+    cpus = NULL;
+    walkSRAT(srat);
+    if(!memoryCount && !cpuCount) return 0;
+
+    // domain numbers are 32 bits wide, one past the highest may not fit in them
+    uint64_t domains = (uint64_t)highestDomain + 1;
+    ACPISLIT *slit = findACPITable("SLIT");
+    if(highestDomain < NUMA_MAX_DOMAINS && slit && slit->count > domains && slit->count <= NUMA_MAX_DOMAINS) {
+        domains = slit->count;
+    }
+
+    size_t matrixSize = (highestDomain < NUMA_MAX_DOMAINS) ? (domains * domains) : 0;
+
+    size_t size = (memoryCount * sizeof(NUMAMemoryRange)) + (cpuCount * sizeof(NUMACPU)) + matrixSize;
+    uint8_t *table = (uint8_t *)(uintptr_t)allocAligned(size, PAGE_SIZE, BOOT_MEMORY_BOOT_INFO);
+    if(!table) {
+        printf("numa: not enough memory for the topology tables\n");
+        return 0;
+    }
+
+    memory = (NUMAMemoryRange *)table;
+    cpus = (NUMACPU *)(memory + memoryCount);
+    walkSRAT(srat);
+
+    summary->memory = (uintptr_t)memory;
+    summary->memoryCount = memoryCount;
+    summary->cpus = (uintptr_t)cpus;
+    summary->cpuCount = cpuCount;
+    summary->domainCount = (domains > 0xFFFFFFFF) ? 0xFFFFFFFF : domains;
+
+    if(matrixSize) {
+        uint8_t *distances = (uint8_t *)(cpus + cpuCount);
+        fillDistances(distances, (int)domains);
+        summary->distances = (uintptr_t)distances;
+    }
+
+    printf("numa: %d domains, %d memory ranges, %d CPUs\n", summary->domainCount, memoryCount, cpuCount);
+    return summary->domainCount;
+}
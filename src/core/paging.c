@@ -8,6 +8,8 @@
 #include <lxboot.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
+#include <cpu.h>
 
 #define PAGE_PRESENT            0x01
 #define PAGE_RW                 0x02
@@ -16,11 +18,28 @@
 #define PAGE_DISABLE_CACHE      0x10
 #define PAGE_SIZE_EXTENSION     0x80
 
-void pagingSetup() {
-    // creates page tables starting at PAGING_BASE
-    // identity-maps the first 4 GiB of memory to give the kernel a reasonable
-    // amount of space to start with
-    
+#define PAGE_ADDRESS_MASK       0x000FFFFFFFFFF000
+
+// PAT layout programmed by the loader: the power-on default, except that
+// PA1 (selected by PWT alone) is write-combining instead of write-through
+#define PAT_VALUE               ((uint64_t)CACHE_WB | ((uint64_t)CACHE_WC << 8) | \
+                                ((uint64_t)CACHE_UC_MINUS << 16) | ((uint64_t)CACHE_UC << 24) | \
+                                ((uint64_t)CACHE_WB << 32) | ((uint64_t)CACHE_WT << 40) | \
+                                ((uint64_t)CACHE_UC_MINUS << 48) | ((uint64_t)CACHE_UC << 56))
+
+#define GIB_SHIFT               30
+#define PDP_SHIFT               39      // 512 GiB covered by each PDP
+#define HIGHER_HALF_SLOT        256     // 0xFFFF800000000000
+
+static uint64_t *pml4;
+static uint64_t *pdp;
+
+static uint64_t *buildTables(uint64_t highest, uint32_t type) {
+    // creates page tables in memory taken from the allocator and returns the
+    // address of the PML4
+    // all of physical memory is mapped both at zero and in the higher half so
+    // the kernel doesn't need to remap anything before it can use it
+
     // x86_64 uses 4-levels of paging: PML4 -> PDP -> PD -> PT
     // each level contains 512 pointers to the next level
     // assuming standard 4 KiB pages:
@@ -31,37 +50,239 @@ void pagingSetup() {
     // this is only here to reduce my own confusion as i try to build this
     // 2 MiB pages would go in the PD, 1 GiB pages would go in the PDP, etc
 
-    // we will build 1 PML4, 1 PDP, and 4 PDs using 2 MiB pages to map 4 GiB
-    // we will omit the PT and leave it to the kernel to rebuild everything
-    // the same 4 GiB will also be identity mapped at the lowest 4 GiB
+    // we will use 1 GiB pages in the PDPs when the CPU supports them, and
+    // otherwise 2 MiB pages in the PDs, and omit the PTs either way and leave
+    // it to the kernel to rebuild everything
+    // at least the lowest 4 GiB are always mapped for MMIO
     // TODO: check if ALL x86_64 CPUs are obligated to implement 2 MiB pages
-    printf("paging: setup at 0x%08X\n", PAGING_BASE);
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_EXTENDED_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+    bool hugePages = edx & CPUID_EXTENDED_EDX_PDPE1GB;
 
-    uint64_t *pml4 = (uint64_t *)(PAGING_BASE);
-    uint64_t *pdp = (uint64_t *)(PAGING_BASE + PAGE_SIZE);
-    uint64_t *pd = (uint64_t *)(PAGING_BASE + (2*PAGE_SIZE));
+    if(highest < 0x100000000) highest = 0x100000000;
+    uint32_t gibs = (highest + (1 << GIB_SHIFT) - 1) >> GIB_SHIFT;
+    uint32_t pdps = (gibs + 511) / 512;
+    if(pdps > HIGHER_HALF_SLOT) {
+        pdps = HIGHER_HALF_SLOT;
+        gibs = pdps * 512;
+    }
+
+    uint32_t pds = hugePages ? 0 : gibs;
+    size_t pages = 1 + pdps + pds;
+
+    pml4 = (uint64_t *)allocPages(pages, type);
+    pdp = (uint64_t *)((uintptr_t)pml4 + PAGE_SIZE);
+    uint64_t *pd = (uint64_t *)((uintptr_t)pdp + (pdps * PAGE_SIZE));
+
+    if(type == BOOT_MEMORY_PAGING) {
+        printf("paging: mapping %d GiB with %s pages at 0x%08X\n", gibs, hugePages ? "1 GiB" : "2 MiB", (uint32_t)(uintptr_t)pml4);
+    }
 
     // start by clearing out everything
+    memset(pml4, 0, pages * PAGE_SIZE);
+
+    for(int i = 0; i < pdps; i++) {
+        pml4[i] = (uintptr_t)pdp + (i * PAGE_SIZE);
+        pml4[i] |= PAGE_PRESENT | PAGE_RW;
+        pml4[HIGHER_HALF_SLOT + i] = pml4[i];
+    }
+
+    if(hugePages) {
+        for(uint64_t i = 0; i < gibs; i++) {
+            pdp[i] = (i << GIB_SHIFT) | PAGE_PRESENT | PAGE_RW | PAGE_SIZE_EXTENSION;
+        }
+    } else {
+        for(int i = 0; i < gibs; i++) {
+            pdp[i] = (uintptr_t)pd + (i * PAGE_SIZE);
+            pdp[i] |= PAGE_PRESENT | PAGE_RW;
+        }
+
+        for(uint64_t i = 0; i < (gibs * 512); i++) {
+            pd[i] = (i * HUGE_PAGE_SIZE) | PAGE_PRESENT | PAGE_RW | PAGE_SIZE_EXTENSION;
+        }
+    }
+
+    return pml4;
+}
+
+/*
+ * pagingInit(): replaces the early identity map of the lowest 4 GiB with a map
+ * of all physical memory, and lets the allocator hand out memory above 4 GiB
+ * this must be called after allocInit()
+ * params: highest - highest physical address
+ * returns: nothing
+ */
+
+void pagingInit(uint64_t highest) {
+    // these tables are loader scratch memory below 4 GiB, because CR3 has to
+    // survive the trips through real mode for BIOS calls
+    uint64_t *tables = buildTables(highest, BOOT_MEMORY_LOADER);
+    writeCR3((uintptr_t)tables);
+
+    allocSetLimit(highest);
+}
+
+/*
+ * pagingSetup(): creates the page tables handed to the kernel
+ * params: highest - highest physical address
+ * returns: physical address of the PML4
+ */
+
+uint64_t pagingSetup(uint64_t highest) {
+    return (uintptr_t)buildTables(highest, BOOT_MEMORY_PAGING);
+}
+
+static uint64_t *splitPage(uint64_t *entry, uint64_t size) {
+    // replaces a large page with a table of 512 pages of the next smaller size
+    uint64_t *table = (uint64_t *)allocPages(1, BOOT_MEMORY_PAGING);
+    uint64_t addr = *entry & PAGE_ADDRESS_MASK & ~(size - 1);
+    uint64_t flags = *entry & (PAGE_PRESENT | PAGE_RW | PAGE_USER | PAGE_WRITE_THROUGH | PAGE_DISABLE_CACHE);
+    size >>= 9;
+    if(size > PAGE_SIZE) flags |= PAGE_SIZE_EXTENSION;
+
     for(int i = 0; i < 512; i++) {
-        pml4[i] = 0;
-        pdp[i] = 0;
-        pd[i] = 0;
+        table[i] = addr | flags;
+        addr += size;
     }
 
-    pml4[0] = (uintptr_t)pdp | PAGE_PRESENT | PAGE_RW;
-    pml4[256] = (uintptr_t)pdp | PAGE_PRESENT | PAGE_RW;
+    *entry = (uintptr_t)table | PAGE_PRESENT | PAGE_RW;
+    return table;
+}
+
+static bool patWriteCombine(uint64_t base, uint64_t size) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+    if(!(edx & CPUID_FEATURES_EDX_PAT)) return false;
+
+    wrmsr(MSR_PAT, PAT_VALUE);
 
-    for(int i = 0; i < 4; i++) {
-        pdp[i] = (uintptr_t)pd + (i * PAGE_SIZE);
-        pdp[i] |= PAGE_PRESENT | PAGE_RW;
+    // set PWT on the smallest set of pages that covers exactly the range,
+    // splitting large pages at the edges so neighboring MMIO stays uncached
+    uint64_t addr = base & ~(PAGE_SIZE - 1);
+    uint64_t end = (base + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    while(addr < end) {
+        uint64_t *entry = &pdp[addr >> GIB_SHIFT];
+        if(*entry & PAGE_SIZE_EXTENSION) {
+            if(!(addr & ((1 << GIB_SHIFT) - 1)) && (addr + (1 << GIB_SHIFT)) <= end) {
+                *entry |= PAGE_WRITE_THROUGH;
+                addr += (1 << GIB_SHIFT);
+                continue;
+            }
+
+            splitPage(entry, 1 << GIB_SHIFT);
+        }
+
+        uint64_t *pd = (uint64_t *)(uintptr_t)(*entry & PAGE_ADDRESS_MASK);
+        entry = &pd[(addr >> 21) & 511];
+        if(*entry & PAGE_SIZE_EXTENSION) {
+            if(!(addr & (HUGE_PAGE_SIZE - 1)) && (addr + HUGE_PAGE_SIZE) <= end) {
+                *entry |= PAGE_WRITE_THROUGH;
+                addr += HUGE_PAGE_SIZE;
+                continue;
+            }
+
+            splitPage(entry, HUGE_PAGE_SIZE);
+        }
+
+        uint64_t *pt = (uint64_t *)(uintptr_t)(*entry & PAGE_ADDRESS_MASK);
+        pt[(addr >> 12) & 511] |= PAGE_WRITE_THROUGH;
+        addr += PAGE_SIZE;
+    }
+
+    return true;
+}
+
+static uint64_t mtrrBlock(uint64_t addr, uint64_t end) {
+    // largest power of two that addr is aligned to and that fits before end
+    uint64_t block = PAGE_SIZE;
+    while(!(addr & block) && (block << 1) <= (end - addr)) block <<= 1;
+    return block;
+}
+
+static bool mtrrWriteCombine(uint64_t base, uint64_t size) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+    if(!(edx & CPUID_FEATURES_EDX_MTRR)) return false;
+
+    uint64_t cap = rdmsr(MSR_MTRR_CAP);
+    if(!(cap & MTRR_CAP_WC)) return false;
+
+    // variable ranges have to be a power of two in size and aligned to it, so
+    // cover the framebuffer exactly with as many as it takes rather than
+    // rounding it up and making neighbouring MMIO write-combining too
+    if(base & (PAGE_SIZE - 1)) return false;
+    uint64_t end = (base + size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    int needed = 0;
+    for(uint64_t addr = base; addr < end; addr += mtrrBlock(addr, end)) needed++;
+
+    int count = cap & MTRR_CAP_COUNT_MASK;
+    int free = 0;
+    for(int i = 0; i < count; i++) {
+        if(!(rdmsr(MSR_MTRR_PHYS_MASK + (i * 2)) & MTRR_VALID)) free++;
+    }
+
+    if(free < needed) return false;
+
+    int width = 36;
+    cpuid(CPUID_EXTENDED_MAX, 0, &eax, &ebx, &ecx, &edx);
+    if(eax >= CPUID_ADDRESS_SIZE) {
+        cpuid(CPUID_ADDRESS_SIZE, 0, &eax, &ebx, &ecx, &edx);
+        width = eax & 0xFF;
+    }
+
+    // follow the SDM: disable caching and the MTRRs while changing them
+    uint64_t cr0 = readCR0();
+    writeCR0(cr0 | CR0_CACHE_DISABLE);
+    wbinvd();
+
+    uint64_t defType = rdmsr(MSR_MTRR_DEF_TYPE);
+    wrmsr(MSR_MTRR_DEF_TYPE, defType & ~MTRR_DEF_TYPE_ENABLE);
+
+    uint64_t addr = base;
+    for(int i = 0; i < count && addr < end; i++) {
+        if(rdmsr(MSR_MTRR_PHYS_MASK + (i * 2)) & MTRR_VALID) continue;
+
+        uint64_t block = mtrrBlock(addr, end);
+        wrmsr(MSR_MTRR_PHYS_BASE + (i * 2), addr | CACHE_WC);
+        wrmsr(MSR_MTRR_PHYS_MASK + (i * 2), ((((uint64_t)1 << width) - 1) & ~(block - 1)) | MTRR_VALID);
+        addr += block;
+    }
+
+    wbinvd();
+    wrmsr(MSR_MTRR_DEF_TYPE, defType);
+    writeCR0(cr0);
+    return true;
+}
+
+/*
+ * pagingWriteCombine(): makes a range write-combining, for the framebuffer
+ * this must be called after pagingSetup()
+ * params: base - physical address of the range
+ * params: size - size of the range in bytes
+ * params: mtrr - whether a variable MTRR may be used instead of the PAT; only
+ * the BSP would get it, so not when application processors will be started
+ * params: pat - pointer to where to store the value of the PAT MSR, or zero if
+ * the PAT wasn't programmed
+ * returns: FRAMEBUFFER_CACHE_* describing how the range ended up being mapped
+ */
+
+uint8_t pagingWriteCombine(uint64_t base, uint64_t size, bool mtrr, uint64_t *pat) {
+    *pat = 0;
+    if(!size) return FRAMEBUFFER_CACHE_DEFAULT;
+
+    if(patWriteCombine(base, size)) {
+        *pat = PAT_VALUE;
+        printf("paging: framebuffer is write-combining via PAT\n");
+        return FRAMEBUFFER_CACHE_WC_PAT;
     }
 
-    uint64_t addr = 0;
-    for(int i = 0; i < 2048; i++) {
-        //pd[i] = (i * 0x200000);
-        // commented the above to avoid 64-bit mult while still in 32-bit mode
-        pd[i] = addr;
-        pd[i] |= PAGE_PRESENT | PAGE_RW | PAGE_SIZE_EXTENSION;
-        addr += 0x200000;
+    // every CPU must have the same MTRRs, and the parked APs keep theirs
+    if(mtrr && mtrrWriteCombine(base, size)) {
+        printf("paging: framebuffer is write-combining via MTRR\n");
+        return FRAMEBUFFER_CACHE_WC_MTRR;
     }
+
+    return FRAMEBUFFER_CACHE_DEFAULT;
 }
@@ -0,0 +1,131 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* Files listed by the preload directive are read here so the kernel can seed
+ * its page cache with them instead of reading them again */
+
+#include <lxboot.h>
+#include <lxfs.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PRELOAD_MAX_FILES       256
+#define PRELOAD_PATHS_SIZE      16384   // full paths of the preloaded files
+#define PRELOAD_QUEUE_SIZE      32768   // paths waiting to be visited
+
+static PreloadFile *files;
+static char *paths;
+static size_t pathsUsed;
+static int fileCount;
+
+static char *queue;
+static size_t queueHead, queueTail;
+
+static bool push(const char *directory, const char *name) {
+    size_t len = strlen(directory) + strlen(name) + 2;
+    if((queueTail + len) > PRELOAD_QUEUE_SIZE) {
+        printf("preload: too many paths, ignoring %s%s\n", directory, name);
+        return false;
+    }
+
+    strcpy(queue + queueTail, directory);
+    if(strlen(name)) {
+        // join with a separator unless the directory already ends with one
+        if(queue[queueTail + strlen(directory) - 1] != '/') strcpy(queue + queueTail + strlen(directory), "/");
+        strcpy(queue + queueTail + strlen(queue + queueTail), name);
+    }
+
+    queueTail += strlen(queue + queueTail) + 1;
+    return true;
+}
+
+static void preloadFile(const char *path, LXFSDirectoryEntry *entry) {
+    if(fileCount >= PRELOAD_MAX_FILES || (pathsUsed + strlen(path) + 1) > PRELOAD_PATHS_SIZE) {
+        printf("preload: too many files, ignoring %s\n", path);
+        return;
+    }
+
+    // page-aligned so the pages can be inserted into the page cache as-is
+    size_t size = entry->size;
+    uint64_t addr = allocAligned(lxfsBufferSize(size), PAGE_SIZE, BOOT_MEMORY_PAYLOAD);
+    if(!addr) {
+        printf("preload: not enough memory for %s\n", path);
+        return;
+    }
+
+    // the entry is the one preload() looked up, so the path isn't resolved again
+    if(size && !lxfsReadEntry(bootInfo.bootDevice, partitionIndex, entry, (void *)(uintptr_t)addr)) {
+        printf("preload: could not load %s\n", path);
+        allocFree(addr, lxfsBufferSize(size));
+        return;
+    }
+
+    strcpy(paths + pathsUsed, path);
+    files[fileCount].path = (uintptr_t)(paths + pathsUsed);
+    files[fileCount].address = addr;
+    files[fileCount].size = size;
+    pathsUsed += strlen(path) + 1;
+    fileCount++;
+}
+
+/*
+ * preload(): reads the files and directories listed by the boot option
+ * params: option - selected boot option
+ * params: table - pointer to where to store the address of the table
+ * returns: number of entries in the table
+ */
+
+int preload(BootConfig *option, uint64_t *table) {
+    *table = 0;
+    if(!option->preloadCount) return 0;
+
+    files = allocPages((PRELOAD_MAX_FILES * sizeof(PreloadFile) + PAGE_SIZE - 1) / PAGE_SIZE, BOOT_MEMORY_BOOT_INFO);
+    paths = allocPages(PRELOAD_PATHS_SIZE / PAGE_SIZE, BOOT_MEMORY_BOOT_INFO);
+    queue = allocPages(PRELOAD_QUEUE_SIZE / PAGE_SIZE, BOOT_MEMORY_LOADER);
+    char *names = allocPages(PRELOAD_QUEUE_SIZE / PAGE_SIZE, BOOT_MEMORY_LOADER);
+    char path[CONFIG_MAX_PRELOAD];
+
+    pathsUsed = 0;
+    fileCount = 0;
+    queueHead = 0;
+    queueTail = 0;
+
+    for(int i = 0; i < option->preloadCount; i++) {
+        if(copyModule(path, option->preload, i)) push(path, "");
+    }
+
+    // breadth-first so a directory is listed before its own buffers are reused
+    LXFSDirectoryEntry entry;
+    while(queueHead < queueTail) {
+        char *current = queue + queueHead;
+        queueHead += strlen(current) + 1;
+
+        if(!lxfsFindPath(bootInfo.bootDevice, partitionIndex, current, &entry)) {
+            printf("preload: %s was not found\n", current);
+            continue;
+        }
+
+        int type = (entry.flags >> LXFS_DIR_TYPE_SHIFT) & LXFS_DIR_TYPE_MASK;
+        if(type == LXFS_DIR_TYPE_FILE) {
+            preloadFile(current, &entry);
+        } else if(type == LXFS_DIR_TYPE_DIR) {
+            int count = lxfsList(bootInfo.bootDevice, partitionIndex, current, names, PRELOAD_QUEUE_SIZE);
+            char *name = names;
+            for(int j = 0; j < count; j++) {
+                if(strcmp(name, ".") && strcmp(name, "..")) push(current, name);
+                name += strlen(name) + 1;
+            }
+        }
+    }
+
+    size_t total = 0;
+    for(int i = 0; i < fileCount; i++) total += files[i].size;
+    printf("preload: loaded %d file%s, %d KiB\n", fileCount, fileCount == 1 ? "" : "s", total / 1024);
+
+    *table = (uintptr_t)files;
+    return fileCount;
+}
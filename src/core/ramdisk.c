@@ -0,0 +1,280 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* Ramdisk archive index */
+/* tar and cpio (newc) ramdisks are indexed here while they are still hot in
+ * memory, so the kernel can look files up without scanning the archive */
+
+#include <lxboot.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TAR_BLOCK_SIZE          512
+#define CPIO_HEADER_SIZE        110
+
+#define MODE_TYPE_FILE          0100000
+#define MODE_TYPE_DIR           0040000
+#define MODE_TYPE_LINK          0120000
+#define MODE_TYPE_CHAR          0020000
+#define MODE_TYPE_BLOCK         0060000
+#define MODE_TYPE_FIFO          0010000
+
+typedef struct {
+    char name[100];
+    char mode[8];
+    char owner[8];
+    char group[8];
+    char size[12];
+    char modTime[12];
+    char checksum[8];
+    char type;
+    char link[100];
+    char magic[6];          // "ustar"
+    char version[2];
+    char ownerName[32];
+    char groupName[32];
+    char deviceMajor[8];
+    char deviceMinor[8];
+    char prefix[155];
+} __attribute__((packed)) TarHeader;
+
+static RamdiskIndexEntry *entries;
+static char *names;
+static size_t namesUsed;
+static int entryCount;
+
+static uint64_t parseNumber(const char *s, int length, int shift) {
+    uint64_t v = 0;
+    for(int i = 0; i < length; i++) {
+        char c = s[i];
+        if(c >= '0' && c <= '9') v = (v << shift) | (c - '0');
+        else if(c >= 'a' && c <= 'f') v = (v << shift) | (c - 'a' + 10);
+        else if(c >= 'A' && c <= 'F') v = (v << shift) | (c - 'A' + 10);
+        else if(c == ' ' && !v) continue;   // tar pads with leading spaces
+        else break;
+    }
+
+    return v;
+}
+
+static uint64_t alignUp(uint64_t v, uint64_t alignment) {
+    return (v + alignment - 1) & ~(alignment - 1);
+}
+
+static void addEntry(const char *prefix, int prefixLength, const char *name, int nameLength, const char *link, int linkLength, uint64_t offset, uint64_t size, uint32_t mode) {
+    // paths are stored relative to the root of the archive
+    while(nameLength && (*name == '/' || (*name == '.' && (nameLength == 1 || name[1] == '/')))) {
+        name++;
+        nameLength--;
+    }
+
+    while(nameLength && name[nameLength-1] == '/') nameLength--;    // tar directories
+    if(!nameLength && !prefixLength) return;
+
+    // both passes have to agree on this, the table is sized by the first
+    int separator = (prefixLength && nameLength) ? 1 : 0;
+    size_t length = prefixLength + separator + nameLength + 1;
+    if(linkLength) length += linkLength + 1;
+
+    if(entries) {
+        char *dst = names + namesUsed;
+        memcpy(dst, prefix, prefixLength);
+        if(separator) dst[prefixLength] = '/';
+        memcpy(dst + prefixLength + separator, name, nameLength);
+        dst[prefixLength + separator + nameLength] = 0;
+
+        if(linkLength) {
+            char *target = dst + prefixLength + separator + nameLength + 1;
+            memcpy(target, link, linkLength);
+            target[linkLength] = 0;
+        }
+
+        entries[entryCount].name = (uintptr_t)dst;
+        entries[entryCount].offset = offset;
+        entries[entryCount].size = size;
+        entries[entryCount].mode = mode;
+        entries[entryCount].reserved = 0;
+    }
+
+    namesUsed += length;
+    entryCount++;
+}
+
+static int fieldLength(const char *s, int max) {
+    int i = 0;
+    while(i < max && s[i]) i++;
+    return i;
+}
+
+static void walkTar(const uint8_t *archive, uint64_t size) {
+    uint64_t offset = 0;
+    const char *longName = NULL;
+    const char *longLink = NULL;
+    int longNameLength = 0, longLinkLength = 0;
+
+    while((offset + TAR_BLOCK_SIZE) <= size) {
+        TarHeader *header = (TarHeader *)(archive + offset);
+        if(!header->name[0]) break;     // end of archive
+
+        uint64_t fileSize = parseNumber(header->size, 12, 3);
+        uint64_t data = offset + TAR_BLOCK_SIZE;
+        uint32_t mode = parseNumber(header->mode, 8, 3) & 07777;
+        if(fileSize > (size - data)) break;     // truncated archive
+
+        switch(header->type) {
+        case 'L':       // GNU long name for the next entry
+            longName = (const char *)(archive + data);
+            longNameLength = fieldLength(longName, fileSize);
+            break;
+        case 'K':       // GNU long link target for the next entry
+            longLink = (const char *)(archive + data);
+            longLinkLength = fieldLength(longLink, fileSize);
+            break;
+        case 'x':       // pax headers aren't indexed
+        case 'g':
+            break;
+        default:
+            if(header->type == '5') mode |= MODE_TYPE_DIR;
+            else if(header->type == '2') mode |= MODE_TYPE_LINK;
+            else if(header->type == '3') mode |= MODE_TYPE_CHAR;
+            else if(header->type == '4') mode |= MODE_TYPE_BLOCK;
+            else if(header->type == '6') mode |= MODE_TYPE_FIFO;
+            else mode |= MODE_TYPE_FILE;
+
+            // hard and symbolic links keep their target after the name
+            const char *link = NULL;
+            int linkLength = 0;
+            if(header->type == '1' || header->type == '2') {
+                link = longLink ? longLink : header->link;
+                linkLength = longLink ? longLinkLength : fieldLength(header->link, 100);
+            }
+
+            if(longName) {
+                addEntry("", 0, longName, longNameLength, link, linkLength, data, fileSize, mode);
+            } else {
+                addEntry(header->prefix, fieldLength(header->prefix, 155), header->name, fieldLength(header->name, 100), link, linkLength, data, fileSize, mode);
+            }
+
+            longName = NULL;
+            longLink = NULL;
+        }
+
+        offset = data + alignUp(fileSize, TAR_BLOCK_SIZE);
+    }
+}
+
+static void walkCPIO(const uint8_t *archive, uint64_t size) {
+    uint64_t offset = 0;
+
+    while((offset + CPIO_HEADER_SIZE) <= size) {
+        const char *header = (const char *)(archive + offset);
+        if(memcmp(header, "070701", 6) && memcmp(header, "070702", 6)) break;
+
+        uint32_t mode = parseNumber(header + 14, 8, 4);
+        uint64_t fileSize = parseNumber(header + 54, 8, 4);
+        uint32_t nameSize = parseNumber(header + 94, 8, 4);
+        const char *name = header + CPIO_HEADER_SIZE;
+
+        // a truncated or corrupt archive ends the walk before anything past
+        // the end of the ramdisk is read
+        if(nameSize > (size - offset - CPIO_HEADER_SIZE)) break;
+        if(nameSize == 11 && !memcmp(name, "TRAILER!!!", 11)) break;
+
+        uint64_t data = alignUp(offset + CPIO_HEADER_SIZE + nameSize, 4);
+        if(data > size || fileSize > (size - data)) break;
+
+        if(nameSize) addEntry("", 0, name, fieldLength(name, nameSize), NULL, 0, data, fileSize, mode);
+
+        offset = alignUp(data + fileSize, 4);
+    }
+}
+
+static void swapEntries(int a, int b) {
+    RamdiskIndexEntry tmp;
+    memcpy(&tmp, &entries[a], sizeof(RamdiskIndexEntry));
+    memcpy(&entries[a], &entries[b], sizeof(RamdiskIndexEntry));
+    memcpy(&entries[b], &tmp, sizeof(RamdiskIndexEntry));
+}
+
+static int compareEntries(int a, int b) {
+    return strcmp((const char *)(uintptr_t)entries[a].name, (const char *)(uintptr_t)entries[b].name);
+}
+
+static void siftDown(int root, int end) {
+    while((2 * root + 1) < end) {
+        int child = 2 * root + 1;
+        if((child + 1) < end && compareEntries(child, child + 1) < 0) child++;
+        if(compareEntries(root, child) >= 0) return;
+
+        swapEntries(root, child);
+        root = child;
+    }
+}
+
+static void sortEntries() {
+    // heap sort, because it's in place and doesn't degrade on sorted input
+    for(int i = (entryCount / 2) - 1; i >= 0; i--) {
+        siftDown(i, entryCount);
+    }
+
+    for(int end = entryCount - 1; end > 0; end--) {
+        swapEntries(0, end);
+        siftDown(0, end);
+    }
+}
+
+/*
+ * indexRamdisk(): builds a sorted index of the files in a tar or cpio ramdisk
+ * params: ramdisk - pointer to the ramdisk in memory
+ * params: size - size of the ramdisk in bytes
+ * params: table - pointer to where to store the address of the index
+ * params: format - pointer to where to store the RAMDISK_FORMAT_* of the archive
+ * returns: number of entries in the index
+ */
+
+int indexRamdisk(const void *ramdisk, uint64_t size, uint64_t *table, uint8_t *format) {
+    const uint8_t *archive = (const uint8_t *)ramdisk;
+    void (*walk)(const uint8_t *, uint64_t);
+
+    *table = 0;
+
+    if(size >= TAR_BLOCK_SIZE && !memcmp(((TarHeader *)archive)->magic, "ustar", 5)) {
+        *format = RAMDISK_FORMAT_TAR;
+        walk = walkTar;
+    } else if(size >= CPIO_HEADER_SIZE && (!memcmp(archive, "070701", 6) || !memcmp(archive, "070702", 6))) {
+        *format = RAMDISK_FORMAT_CPIO;
+        walk = walkCPIO;
+    } else {
+        *format = RAMDISK_FORMAT_UNKNOWN;
+        return 0;
+    }
+
+    // the first pass only measures, and both passes only touch the headers
+    entries = NULL;
+    namesUsed = 0;
+    entryCount = 0;
+    walk(archive, size);
+    if(!entryCount) return 0;
+
+    uint64_t tableSize = (entryCount * sizeof(RamdiskIndexEntry)) + namesUsed;
+    entries = (RamdiskIndexEntry *)(uintptr_t)allocAligned(tableSize, PAGE_SIZE, BOOT_MEMORY_BOOT_INFO);
+    if(!entries) {
+        printf("ramdisk: not enough memory for the archive index\n");
+        return 0;
+    }
+
+    names = (char *)(entries + entryCount);
+    namesUsed = 0;
+    entryCount = 0;
+    walk(archive, size);
+    sortEntries();
+
+    printf("ramdisk: indexed %d %s entries\n", entryCount, *format == RAMDISK_FORMAT_TAR ? "tar" : "cpio");
+
+    *table = (uintptr_t)entries;
+    return entryCount;
+}
@@ -0,0 +1,198 @@
+; lux - a lightweight unix-like operating system
+; Omar Elghoul, 2024
+; 
+; Boot loader for x86_64
+; smp.asm: Application Processor Trampoline
+
+; this is never executed in place: smpSetup() copies it below 1 MiB for the
+; start-up IPI and next to the mailboxes for the parking loop, so everything
+; here must be position-independent
+
+MAILBOX_APIC_ID             equ 0
+MAILBOX_STATE               equ 4
+MAILBOX_ENTRY               equ 8
+MAILBOX_STACK               equ 16
+MAILBOX_ARGUMENT            equ 24
+MAILBOX_SIZE                equ 64
+
+STATE_PARKED                equ 1
+STATE_RELEASED              equ 2
+
+section .rodata
+
+global smpTrampoline
+global smpTrampolineGDT
+global smpTrampolineLong
+global smpTrampolinePark
+global smpTrampolineEnd
+
+[bits 16]
+
+align 16
+smpTrampoline:
+    jmp short smpTrampolineReal
+
+align 8, db 0
+
+; SMPTrampolineData, filled in by smpSetup()
+.gdtr:                  dw 0
+                        dq 0
+                        dw 0
+.far:                   dd 0
+                        dw 0
+                        dw 0
+.cr3:                   dd 0
+.finalCR3:              dq 0
+.park:                  dq 0
+.mailboxes:             dq 0
+.count:                 dd 0
+.monitor:               dd 0
+.pat:                   dq 0
+
+align 8, db 0
+smpTrampolineGDT:
+    dq 0                        ; null descriptor
+    dq 0x00AF9A000000FFFF       ; 0x08: 64-bit code
+    dq 0x00CF92000000FFFF       ; 0x10: data
+
+smpTrampolineReal:
+    ; we start in real mode with cs:ip = vector:0000
+    cli
+    cld
+    mov ax, cs
+    mov ds, ax
+
+    o32 lgdt [smpTrampoline.gdtr - smpTrampoline]
+
+    mov eax, 0x620              ; SSE, PAE
+    mov cr4, eax
+
+    mov eax, [smpTrampoline.cr3 - smpTrampoline]
+    mov cr3, eax
+
+    mov ecx, 0xC0000080
+    rdmsr
+    or eax, 0x100               ; enable 64-bit mode
+    wrmsr
+
+    ; protected mode and paging at once take us straight to long mode
+    mov eax, 0x80010001
+    mov cr0, eax
+
+    o32 jmp far [smpTrampoline.far - smpTrampoline]
+
+[bits 64]
+
+smpTrampolineLong:
+    mov eax, 0x10
+    mov ss, ax
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    ; the kernel's page tables map all memory, including this page
+    mov rax, [rel smpTrampoline.finalCR3]
+    mov cr3, rax
+
+    mov rax, [rel smpTrampoline.pat]
+    test rax, rax
+    jz .apic_id
+
+    mov rdx, rax
+    shr rdx, 32
+    mov ecx, 0x277
+    wrmsr
+
+.apic_id:
+    ; x2APIC ID if the CPU has the topology leaf, otherwise the xAPIC ID
+    xor eax, eax
+    cpuid
+    cmp eax, 0x0B
+    jb .xapic
+
+    mov eax, 0x0B
+    xor ecx, ecx
+    cpuid
+    test ebx, ebx
+    jz .xapic
+
+    mov r8d, edx
+    jmp .search
+
+.xapic:
+    mov eax, 1
+    cpuid
+    shr ebx, 24
+    mov r8d, ebx
+
+.search:
+    mov rbx, [rel smpTrampoline.mailboxes]
+    mov ecx, [rel smpTrampoline.count]
+
+.next:
+    test ecx, ecx
+    jz .hang                    ; not ours to start
+
+    cmp [rbx + MAILBOX_APIC_ID], r8d
+    je .found
+
+    add rbx, MAILBOX_SIZE
+    dec ecx
+    jmp .next
+
+.found:
+    mov rax, [rel smpTrampoline.park]
+    jmp rax
+
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+; from here on we run in the copy next to the mailboxes, with rbx = mailbox
+
+smpTrampolinePark:
+    ; the low copy and the loader's GDT may be reclaimed by the kernel
+    lgdt [rel smpTrampoline.gdtr]
+
+    mov dword [rbx + MAILBOX_STATE], STATE_PARKED
+
+.wait:
+    mov rax, [rbx + MAILBOX_ENTRY]
+    test rax, rax
+    jnz .release
+
+    cmp dword [rel smpTrampoline.monitor], 0
+    jz .pause
+
+    lea rax, [rbx + MAILBOX_ENTRY]
+    xor ecx, ecx
+    xor edx, edx
+    monitor
+
+    mov rax, [rbx + MAILBOX_ENTRY]
+    test rax, rax
+    jnz .release
+
+    xor eax, eax
+    xor ecx, ecx
+    mwait
+    jmp .wait
+
+.pause:
+    pause
+    jmp .wait
+
+.release:
+    mov dword [rbx + MAILBOX_STATE], STATE_RELEASED
+    mov rsp, [rbx + MAILBOX_STACK]
+    mov rdi, [rbx + MAILBOX_ARGUMENT]
+    call rax
+
+.hang:
+    cli
+    hlt
+    jmp .hang
+
+smpTrampolineEnd:
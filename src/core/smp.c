@@ -0,0 +1,217 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* Application processor bring-up */
+/* every AP listed in the MADT is started at once and parked in long mode on
+ * the kernel's page tables, so the kernel doesn't have to go through the
+ * INIT-SIPI-SIPI sequence or the mode switches itself */
+
+#include <lxboot.h>
+#include <stdio.h>
+#include <string.h>
+#include <cpu.h>
+#include <smp.h>
+
+#define SMP_PARK_TIMEOUT        1000        // in units of 100 us
+
+static volatile uint32_t *lapic;
+static bool x2apic;
+
+static uint32_t readAPICID() {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if(eax >= CPUID_TOPOLOGY) {
+        cpuid(CPUID_TOPOLOGY, 0, &eax, &ebx, &ecx, &edx);
+        if(ebx) return edx;
+    }
+
+    cpuid(CPUID_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+    return ebx >> 24;
+}
+
+static void sendIPI(uint32_t apicID, uint32_t command) {
+    if(x2apic) {
+        wrmsr(MSR_X2APIC_ICR, ((uint64_t)apicID << 32) | command);
+    } else {
+        lapic[LAPIC_ICR_HIGH / 4] = apicID << 24;
+        lapic[LAPIC_ICR_LOW / 4] = command;
+        while(lapic[LAPIC_ICR_LOW / 4] & LAPIC_ICR_PENDING);
+    }
+}
+
+static int listCPUs(ACPIMADT *madt, SMPCPU *cpus) {
+    // with cpus == NULL this only counts
+    int count = 0;
+    uint8_t *ptr = (uint8_t *)madt + sizeof(ACPIMADT);
+    uint8_t *end = (uint8_t *)madt + madt->header.length;
+
+    while((ptr + sizeof(MADTEntryHeader)) <= end) {
+        MADTEntryHeader *entry = (MADTEntryHeader *)ptr;
+        if(entry->length < sizeof(MADTEntryHeader)) break;
+
+        uint32_t apicID = 0xFFFFFFFF;
+        if(entry->type == MADT_LOCAL_APIC) {
+            MADTLocalAPIC *cpu = (MADTLocalAPIC *)entry;
+            if((cpu->flags & MADT_CPU_ENABLED) && cpu->apicID != 0xFF) apicID = cpu->apicID;
+        } else if(entry->type == MADT_LOCAL_X2APIC) {
+            MADTLocalX2APIC *cpu = (MADTLocalX2APIC *)entry;
+            if(cpu->flags & MADT_CPU_ENABLED) apicID = cpu->x2apicID;
+        } else if(entry->type == MADT_LOCAL_APIC_OVERRIDE && !cpus) {
+            lapic = (volatile uint32_t *)(uintptr_t)((MADTLocalAPICOverride *)entry)->localAPIC;
+        }
+
+        if(apicID != 0xFFFFFFFF) {
+            // firmware may list a CPU both ways
+            bool duplicate = false;
+            for(int i = 0; cpus && i < count; i++) {
+                if(cpus[i].apicID == apicID) duplicate = true;
+            }
+
+            if(!duplicate) {
+                if(cpus) cpus[count].apicID = apicID;
+                count++;
+            }
+        }
+
+        ptr += entry->length;
+    }
+
+    return count;
+}
+
+/*
+ * smpSetup(): starts all application processors and parks them in long mode
+ * this must be called after acpiInit() and after the kernel's page tables
+ * are complete
+ * params: pml4 - page tables the APs switch to, handed to the kernel
+ * params: pat - value for IA32_PAT on the APs, zero to leave it alone
+ * params: table - pointer to where to store the address of the SMPCPU array
+ * params: localAPIC - pointer to where to store the address of the local APIC
+ * returns: number of CPUs in the table, including the BSP
+ */
+
+int smpSetup(uint64_t pml4, uint64_t pat, uint64_t *table, uint64_t *localAPIC) {
+    *table = 0;
+    *localAPIC = 0;
+
+    ACPIMADT *madt = findACPITable("APIC");
+    if(!madt) {
+        printf("smp: MADT was not found, only using the boot CPU\n");
+        return 0;
+    }
+
+    uint64_t apicBase = rdmsr(MSR_APIC_BASE);
+    x2apic = apicBase & APIC_BASE_X2APIC;
+    lapic = (volatile uint32_t *)(uintptr_t)madt->localAPIC;
+
+    int count = listCPUs(madt, NULL);
+    if(!count) return 0;
+
+    // the park code, the mailboxes, and the CPU table stay in use until the
+    // kernel releases the APs
+    size_t codeSize = (smpTrampolineEnd - smpTrampoline + 63) & ~63;
+    size_t size = codeSize + (count * sizeof(SMPMailbox)) + (count * sizeof(SMPCPU));
+    uint8_t *park = (uint8_t *)(uintptr_t)allocAligned(size, PAGE_SIZE, BOOT_MEMORY_SMP);
+    if(!park) {
+        printf("smp: not enough memory to park the application processors\n");
+        return 0;
+    }
+
+    memset(park, 0, size);
+    SMPMailbox *mailboxes = (SMPMailbox *)(park + codeSize);
+    SMPCPU *cpus = (SMPCPU *)(mailboxes + count);
+    count = listCPUs(madt, cpus);
+
+    // the BSP goes first
+    uint32_t bsp = readAPICID();
+    bool found = false;
+    for(int i = 0; i < count; i++) {
+        if(cpus[i].apicID == bsp) {
+            cpus[i] = cpus[0];
+            cpus[0].apicID = bsp;
+            found = true;
+            break;
+        }
+    }
+
+    if(!found) {
+        printf("smp: boot CPU is missing from the MADT, only using the boot CPU\n");
+        return 0;
+    }
+
+    cpus[0].flags = SMP_CPU_BSP;
+    for(int i = 0; i < count; i++) {
+        mailboxes[i].apicID = cpus[i].apicID;
+        if(i) cpus[i].mailbox = (uintptr_t)&mailboxes[i];
+    }
+
+    // build both copies of the trampoline
+    uint8_t *low = (uint8_t *)allocLowPages(1, PAGE_SIZE);
+    memcpy(low, smpTrampoline, smpTrampolineEnd - smpTrampoline);
+    memcpy(park, smpTrampoline, smpTrampolineEnd - smpTrampoline);
+
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+
+    SMPTrampolineData *data = (SMPTrampolineData *)(low + SMP_TRAMPOLINE_DATA);
+    data->gdtLimit = (3 * 8) - 1;
+    data->gdtBase = (uintptr_t)low + (smpTrampolineGDT - smpTrampoline);
+    data->longEntry = (uintptr_t)low + (smpTrampolineLong - smpTrampoline);
+    data->longSelector = 0x08;
+    data->cr3 = readCR3();          // the loader's own tables are below 4 GiB
+    data->finalCR3 = pml4;
+    data->park = (uintptr_t)park + (smpTrampolinePark - smpTrampoline);
+    data->mailboxes = (uintptr_t)&mailboxes[1];
+    data->count = count - 1;
+    data->monitor = (ecx & CPUID_FEATURES_ECX_MONITOR) ? 1 : 0;
+    data->pat = pat;
+
+    memcpy(park + SMP_TRAMPOLINE_DATA, data, sizeof(SMPTrampolineData));
+    ((SMPTrampolineData *)(park + SMP_TRAMPOLINE_DATA))->gdtBase = (uintptr_t)park + (smpTrampolineGDT - smpTrampoline);
+
+    // INIT, then two start-up IPIs, each step sent to every AP before waiting
+    uint32_t vector = ((uintptr_t)low >> 12) & 0xFF;
+    for(int i = 1; i < count; i++) {
+        if(!x2apic && cpus[i].apicID > 0xFE) continue;
+        sendIPI(cpus[i].apicID, LAPIC_ICR_INIT);
+    }
+
+    timerDelay(10000);
+
+    for(int attempt = 0; attempt < 2; attempt++) {
+        for(int i = 1; i < count; i++) {
+            if(!x2apic && cpus[i].apicID > 0xFE) continue;
+            if(attempt && ((volatile SMPMailbox *)&mailboxes[i])->state != SMP_STATE_STARTING) continue;
+            sendIPI(cpus[i].apicID, LAPIC_ICR_STARTUP | vector);
+        }
+
+        timerDelay(200);
+    }
+
+    // give the slow ones some time
+    int parked = 0;
+    for(int t = 0; t < SMP_PARK_TIMEOUT; t++) {
+        parked = 0;
+        for(int i = 1; i < count; i++) {
+            if(((volatile SMPMailbox *)&mailboxes[i])->state == SMP_STATE_PARKED) parked++;
+        }
+
+        if(parked == (count - 1)) break;
+        timerDelay(100);
+    }
+
+    for(int i = 1; i < count; i++) {
+        if(((volatile SMPMailbox *)&mailboxes[i])->state == SMP_STATE_PARKED) cpus[i].flags |= SMP_CPU_PARKED;
+        else printf("smp: CPU with APIC ID %d did not start\n", cpus[i].apicID);
+    }
+
+    printf("smp: %d of %d application processors parked %s\n", parked, count - 1, data->monitor ? "with mwait" : "with pause");
+
+    *table = (uintptr_t)cpus;
+    *localAPIC = x2apic ? (apicBase & APIC_BASE_ADDRESS_MASK) : (uintptr_t)lapic;
+    return count;
+}
@@ -1,22 +1,30 @@
-
 ; lux - a lightweight unix-like operating system
 ; Omar Elghoul, 2024
 ; 
 ; Boot loader for x86_64
 ; stub.asm: Stub for main core component
 
-[bits 32]
+[bits 64]
 
 section .stub
 global _start
 _start:
     extern main
+    extern bss
+    extern end
 
+    ; the boot sector loads whole blocks, so the bss may contain junk
     cld
-    push esi
-    mov eax, main
-    mov ebp, esp
-    call eax
+    mov rdi, bss
+    mov rcx, end
+    sub rcx, rdi
+    xor eax, eax
+    rep stosb
+
+    mov rdi, rsi        ; boot info
+    mov rax, main
+    xor ebp, ebp
+    call rax
 
     cli
     hlt
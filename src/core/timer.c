@@ -0,0 +1,225 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* Timing, TSC frequency, and the boot timeline */
+/* the TSC frequency is taken from CPUID where the CPU or hypervisor reports it,
+ * and otherwise measured against the ACPI PM timer or the PIT */
+
+#include <lxboot.h>
+#include <stdio.h>
+#include <string.h>
+#include <cpu.h>
+
+#define PIT_FREQUENCY           1193182
+#define PM_TIMER_FREQUENCY      3579545
+#define CALIBRATION_WINDOW      10000       // in microseconds
+
+static void pitStart(uint32_t us) {
+    // PIT channel 2 in one-shot mode, gated through port 0x61 like the PC
+    // speaker, so this doesn't depend on any interrupts; up to 54 ms
+    uint32_t count = ((uint64_t)us * PIT_FREQUENCY) / 1000000;
+    if(!count) count = 1;
+    if(count > 0xFFFF) count = 0xFFFF;
+
+    uint8_t gate = inb(0x61);
+    outb(0x61, gate & ~0x03);
+    outb(0x43, 0xB0);           // channel 2, low/high byte, mode 0
+    outb(0x42, count & 0xFF);
+    outb(0x42, (count >> 8) & 0xFF);
+    outb(0x61, (gate & ~0x02) | 0x01);
+}
+
+static void pitWait() {
+    while(!(inb(0x61) & 0x20));
+    outb(0x61, inb(0x61) & ~0x01);
+}
+
+/*
+ * timerDelay(): busy-waits on the PIT
+ * params: us - microseconds, up to 54 ms
+ * returns: nothing
+ */
+
+void timerDelay(uint32_t us) {
+    pitStart(us);
+    pitWait();
+}
+
+static uint64_t cpuidFrequency(uint8_t *source) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    uint32_t max = eax;
+
+    // crystal clock and TSC/crystal ratio, exact where the crystal is listed
+    if(max >= CPUID_TSC_CRYSTAL) {
+        cpuid(CPUID_TSC_CRYSTAL, 0, &eax, &ebx, &ecx, &edx);
+        if(eax && ebx && ecx) {
+            *source = TSC_SOURCE_CPUID_CRYSTAL;
+            return ((uint64_t)ecx * ebx) / eax;
+        }
+    }
+
+    // VMware's timing leaf, which KVM and others also implement
+    cpuid(CPUID_FEATURES, 0, &eax, &ebx, &ecx, &edx);
+    if(ecx & CPUID_FEATURES_ECX_HYPERVISOR) {
+        cpuid(CPUID_HYPERVISOR, 0, &eax, &ebx, &ecx, &edx);
+        if(eax >= CPUID_HYPERVISOR_TIMING) {
+            cpuid(CPUID_HYPERVISOR_TIMING, 0, &eax, &ebx, &ecx, &edx);
+            if(eax) {
+                *source = TSC_SOURCE_HYPERVISOR;
+                return (uint64_t)eax * 1000;
+            }
+        }
+    }
+
+    // the nominal base frequency is what the TSC runs at on these CPUs
+    if(max >= CPUID_FREQUENCY) {
+        cpuid(CPUID_FREQUENCY, 0, &eax, &ebx, &ecx, &edx);
+        if(eax & 0xFFFF) {
+            *source = TSC_SOURCE_CPUID_FREQUENCY;
+            return (uint64_t)(eax & 0xFFFF) * 1000000;
+        }
+    }
+
+    return 0;
+}
+
+static uint64_t pmTimerFrequency(uint16_t port, int bits) {
+    uint32_t mask = (bits == 32) ? 0xFFFFFFFF : 0xFFFFFF;
+    uint32_t ticks = ((uint64_t)CALIBRATION_WINDOW * PM_TIMER_FREQUENCY) / 1000000;
+
+    // start right on a tick edge, and give up if the timer doesn't move
+    uint32_t start = inl(port) & mask;
+    uint32_t now;
+    int spins = 0;
+    while(((now = inl(port) & mask)) == start) {
+        if(++spins > 100000) return 0;
+    }
+
+    start = now;
+    uint64_t tscStart = rdtsc();
+    while(((inl(port) - start) & mask) < ticks);
+    uint64_t tscEnd = rdtsc();
+    uint32_t elapsed = (inl(port) - start) & mask;
+
+    return ((tscEnd - tscStart) * PM_TIMER_FREQUENCY) / elapsed;
+}
+
+static uint64_t pitFrequency() {
+    pitStart(CALIBRATION_WINDOW);
+    uint64_t tscStart = rdtsc();
+    pitWait();
+    uint64_t tscEnd = rdtsc();
+
+    uint32_t count = ((uint64_t)CALIBRATION_WINDOW * PIT_FREQUENCY) / 1000000;
+    return ((tscEnd - tscStart) * PIT_FREQUENCY) / count;
+}
+
+/*
+ * tscFrequency(): determines the frequency of the TSC
+ * params: pmTimerPort - I/O port of the ACPI PM timer, zero if there is none
+ * params: pmTimerBits - 24 or 32
+ * params: source - pointer to where to store the TSC_SOURCE_* used
+ * params: invariant - pointer to where to store whether the TSC is invariant
+ * returns: frequency in Hz
+ */
+
+uint64_t tscFrequency(uint16_t pmTimerPort, int pmTimerBits, uint8_t *source, bool *invariant) {
+    uint32_t eax, ebx, ecx, edx;
+    cpuid(CPUID_EXTENDED_MAX, 0, &eax, &ebx, &ecx, &edx);
+    *invariant = false;
+    if(eax >= CPUID_POWER_MANAGEMENT) {
+        cpuid(CPUID_POWER_MANAGEMENT, 0, &eax, &ebx, &ecx, &edx);
+        *invariant = edx & CPUID_POWER_EDX_INVARIANT_TSC;
+    }
+
+    uint64_t frequency = cpuidFrequency(source);
+    if(!frequency && pmTimerPort) {
+        *source = TSC_SOURCE_PM_TIMER;
+        frequency = pmTimerFrequency(pmTimerPort, pmTimerBits);
+    }
+
+    if(!frequency) {
+        *source = TSC_SOURCE_PIT;
+        frequency = pitFrequency();
+    }
+
+    printf("timer: %s TSC at %d kHz\n", *invariant ? "invariant" : "variable", (uint32_t)(frequency / 1000));
+    return frequency;
+}
+
+/* the timeline is kept in raw TSC ticks, because most of it is recorded before
+ * the frequency is known */
+
+static BootStage timeline[TIMELINE_MAX_STAGES];
+static int timelineCount = 0;
+
+/*
+ * timelineRecord(): adds a stage to the boot timeline
+ * params: name - name of the stage, truncated to 15 characters
+ * params: tsc - TSC when the stage started, zero if unknown
+ * returns: nothing
+ */
+
+void timelineRecord(const char *name, uint64_t tsc) {
+    if(!tsc || timelineCount >= TIMELINE_MAX_STAGES) return;
+
+    BootStage *stage = &timeline[timelineCount++];
+    memset(stage, 0, sizeof(BootStage));
+    for(int i = 0; name[i] && i < sizeof(stage->name) - 1; i++) stage->name[i] = name[i];
+    stage->tsc = tsc;
+    stage->diskBytes = diskBytesRead;
+}
+
+/*
+ * timelineMark(): starts a stage of the boot timeline now
+ * params: name - name of the stage
+ * returns: nothing
+ */
+
+void timelineMark(const char *name) {
+    timelineRecord(name, rdtsc());
+}
+
+/*
+ * timelinePrint(): prints how long each stage took and how much it read
+ * params: frequency - TSC frequency in Hz
+ * returns: nothing
+ */
+
+void timelinePrint(uint64_t frequency) {
+    if(timelineCount < 2 || !frequency) return;
+
+    printf("timeline:     ms    KiB  stage\n");
+    for(int i = 0; i < timelineCount - 1; i++) {
+        uint64_t us = ((timeline[i+1].tsc - timeline[i].tsc) * 1000000) / frequency;
+        uint64_t bytes = timeline[i+1].diskBytes - timeline[i].diskBytes;
+        printf("timeline: %4d.%03d %6d  %s\n", (uint32_t)(us / 1000), (uint32_t)(us % 1000), (uint32_t)(bytes >> 10), timeline[i].name);
+    }
+
+    uint64_t us = ((timeline[timelineCount-1].tsc - timeline[0].tsc) * 1000000) / frequency;
+    printf("timeline: %4d.%03d %6d  total\n", (uint32_t)(us / 1000), (uint32_t)(us % 1000), (uint32_t)(timeline[timelineCount-1].diskBytes >> 10));
+}
+
+/*
+ * timelineHandoff(): copies the timeline for the kernel
+ * this must be called after the kernel is loaded, and stages recorded after
+ * this are not part of the copy
+ * params: address - pointer to where to store the address of the copy
+ * returns: number of stages in the copy
+ */
+
+uint16_t timelineHandoff(uint64_t *address) {
+    *address = 0;
+    if(!timelineCount) return 0;
+
+    *address = allocAligned(timelineCount * sizeof(BootStage), PAGE_SIZE, BOOT_MEMORY_BOOT_INFO);
+    if(!*address) return 0;
+
+    memcpy((void *)(uintptr_t)*address, timeline, timelineCount * sizeof(BootStage));
+    return timelineCount;
+}
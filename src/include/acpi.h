@@ -27,4 +27,180 @@ typedef struct {
     uint8_t reserved[3];
 } __attribute__((packed)) ACPIRSDP;
 
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint8_t revision;
+    uint8_t checksum;
+    char oem[6];
+    char oemTable[8];
+    uint32_t oemRevision;
+    uint32_t creator;
+    uint32_t creatorRevision;
+} __attribute__((packed)) ACPIStandardHeader;
+
+/* Generic Address Structure */
+#define ACPI_SPACE_MEMORY           0
+#define ACPI_SPACE_IO               1
+
+typedef struct {
+    uint8_t space;
+    uint8_t bitWidth;
+    uint8_t bitOffset;
+    uint8_t accessSize;
+    uint64_t address;
+} __attribute__((packed)) ACPIAddress;
+
+/* Fixed ACPI Description Table, only as far as the loader needs it */
+#define FADT_TIMER_32               0x100       // TMR_VAL_EXT
+
+typedef struct {
+    ACPIStandardHeader header;
+    uint32_t firmwareControl;
+    uint32_t dsdt;
+    uint8_t reserved0[4];
+    uint32_t smiCommand;
+    uint8_t acpiEnable;
+    uint8_t acpiDisable;
+    uint8_t reserved1[2];
+    uint32_t pm1aEvent;
+    uint32_t pm1bEvent;
+    uint32_t pm1aControl;
+    uint32_t pm1bControl;
+    uint32_t pm2Control;
+    uint32_t pmTimer;
+    uint32_t gpe0;
+    uint32_t gpe1;
+    uint8_t lengths[3];
+    uint8_t pmTimerLength;
+    uint8_t reserved2[20];
+    uint32_t flags;
+    ACPIAddress resetRegister;
+    uint8_t resetValue;
+    uint8_t reserved3[3];
+    uint64_t xFirmwareControl;
+    uint64_t xDSDT;
+    ACPIAddress xPM1aEvent;
+    ACPIAddress xPM1bEvent;
+    ACPIAddress xPM1aControl;
+    ACPIAddress xPM1bControl;
+    ACPIAddress xPM2Control;
+    ACPIAddress xPMTimer;
+} __attribute__((packed)) ACPIFADT;
+
+/* Multiple APIC Description Table */
+#define MADT_LOCAL_APIC             0
+#define MADT_IO_APIC                1
+#define MADT_LOCAL_APIC_OVERRIDE    5
+#define MADT_LOCAL_X2APIC           9
+
+#define MADT_CPU_ENABLED            0x01
+#define MADT_CPU_ONLINE_CAPABLE     0x02
+
+typedef struct {
+    ACPIStandardHeader header;
+    uint32_t localAPIC;
+    uint32_t flags;
+} __attribute__((packed)) ACPIMADT;
+
+typedef struct {
+    uint8_t type;
+    uint8_t length;
+} __attribute__((packed)) MADTEntryHeader;
+
+typedef struct {
+    MADTEntryHeader header;
+    uint8_t processor;
+    uint8_t apicID;
+    uint32_t flags;
+} __attribute__((packed)) MADTLocalAPIC;
+
+typedef struct {
+    MADTEntryHeader header;
+    uint16_t reserved;
+    uint64_t localAPIC;
+} __attribute__((packed)) MADTLocalAPICOverride;
+
+typedef struct {
+    MADTEntryHeader header;
+    uint16_t reserved;
+    uint32_t x2apicID;
+    uint32_t flags;
+    uint32_t processor;
+} __attribute__((packed)) MADTLocalX2APIC;
+
+/* System Resource Affinity Table */
+#define SRAT_CPU_AFFINITY           0
+#define SRAT_MEMORY_AFFINITY        1
+#define SRAT_X2APIC_AFFINITY        2
+
+#define SRAT_ENABLED                0x01
+
+typedef struct {
+    ACPIStandardHeader header;
+    uint32_t reserved0;
+    uint64_t reserved1;
+} __attribute__((packed)) ACPISRAT;
+
+typedef struct {
+    MADTEntryHeader header;         // same layout as the MADT entries
+    uint8_t domainLow;
+    uint8_t apicID;
+    uint32_t flags;
+    uint8_t sapicEID;
+    uint8_t domainHigh[3];
+    uint32_t clockDomain;
+} __attribute__((packed)) SRATCPUAffinity;
+
+typedef struct {
+    MADTEntryHeader header;
+    uint32_t domain;
+    uint16_t reserved0;
+    uint64_t base;
+    uint64_t size;
+    uint32_t reserved1;
+    uint32_t flags;
+    uint64_t reserved2;
+} __attribute__((packed)) SRATMemoryAffinity;
+
+typedef struct {
+    MADTEntryHeader header;
+    uint16_t reserved0;
+    uint32_t domain;
+    uint32_t x2apicID;
+    uint32_t flags;
+    uint32_t clockDomain;
+    uint32_t reserved1;
+} __attribute__((packed)) SRATX2APICAffinity;
+
+/* System Locality Information Table */
+typedef struct {
+    ACPIStandardHeader header;
+    uint64_t count;
+    uint8_t distances[];            // count * count
+} __attribute__((packed)) ACPISLIT;
+
+/* what the loader learned from the tables */
+typedef struct {
+    uint64_t tables;            // pointer to ACPITableEntry array
+    int tableCount;
+    int cpuCount;               // enabled local APICs in the MADT
+    int ioapicCount;
+    uint16_t pmTimerPort;       // zero if there is no port-mapped PM timer
+    uint8_t pmTimerBits;
+} ACPISummary;
+
+/* NUMA topology, zero everywhere on machines without an SRAT */
+typedef struct {
+    uint64_t memory;            // pointer to NUMAMemoryRange array
+    int memoryCount;
+    uint64_t cpus;              // pointer to NUMACPU array
+    int cpuCount;
+    uint64_t distances;         // pointer to domainCount * domainCount matrix
+    uint32_t domainCount;
+} NUMASummary;
+
 ACPIRSDP *findACPIRoot();
+int acpiInit(ACPIRSDP *, ACPISummary *);
+void *findACPITable(const char *);
+uint32_t numaInit(NUMASummary *);
@@ -0,0 +1,155 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* CPUID leaves and feature bits used by the boot loader */
+#define CPUID_VENDOR                    0x00000000
+#define CPUID_FEATURES                  0x00000001
+#define CPUID_TLB                       0x00000002
+#define CPUID_CACHE                     0x00000004
+#define CPUID_STRUCTURED_FEATURES       0x00000007
+#define CPUID_TOPOLOGY                  0x0000000B
+#define CPUID_XSAVE                     0x0000000D
+#define CPUID_TOPOLOGY_V2               0x0000001F
+#define CPUID_EXTENDED_MAX              0x80000000
+#define CPUID_EXTENDED_FEATURES         0x80000001
+#define CPUID_L1_CACHE_TLB              0x80000005
+#define CPUID_L2_CACHE_TLB              0x80000006
+#define CPUID_POWER_MANAGEMENT          0x80000007
+#define CPUID_ADDRESS_SIZE              0x80000008
+#define CPUID_EXTENDED_CACHE            0x8000001D
+
+#define CPUID_FEATURES_ECX_MONITOR      (1 << 3)
+#define CPUID_FEATURES_ECX_XSAVE        (1 << 26)
+#define CPUID_FEATURES_ECX_HYPERVISOR   (1U << 31)
+#define CPUID_FEATURES_EDX_MTRR         (1 << 12)
+#define CPUID_FEATURES_EDX_PAT          (1 << 16)
+#define CPUID_FEATURES_EDX_SSE2         (1 << 26)
+#define CPUID_STRUCTURED_EBX_ERMS       (1 << 9)
+#define CPUID_EXTENDED_ECX_TOPOLOGY     (1 << 22)
+#define CPUID_EXTENDED_EDX_PDPE1GB      (1 << 26)
+#define CPUID_POWER_EDX_INVARIANT_TSC   (1 << 8)
+
+/* leaves that describe the TSC */
+#define CPUID_TSC_CRYSTAL               0x00000015
+#define CPUID_FREQUENCY                 0x00000016
+#define CPUID_HYPERVISOR                0x40000000
+#define CPUID_HYPERVISOR_TIMING         0x40000010
+
+/* model-specific registers */
+#define MSR_APIC_BASE                   0x01B
+#define MSR_MTRR_CAP                    0x0FE
+#define MSR_MTRR_PHYS_BASE              0x200   // + 2*n
+#define MSR_MTRR_PHYS_MASK              0x201   // + 2*n
+#define MSR_PAT                         0x277
+#define MSR_MTRR_DEF_TYPE               0x2FF
+#define MSR_X2APIC_ICR                  0x830
+
+#define APIC_BASE_X2APIC                (1 << 10)
+#define APIC_BASE_ADDRESS_MASK          0x000FFFFFFFFFF000
+
+#define MTRR_CAP_COUNT_MASK             0xFF
+#define MTRR_CAP_WC                     (1 << 10)
+#define MTRR_VALID                      (1 << 11)
+#define MTRR_DEF_TYPE_ENABLE            (1 << 11)
+
+/* x86 memory types, as used by the PAT and MTRRs */
+#define CACHE_UC                        0x00
+#define CACHE_WC                        0x01
+#define CACHE_WT                        0x04
+#define CACHE_WP                        0x05
+#define CACHE_WB                        0x06
+#define CACHE_UC_MINUS                  0x07
+
+#define CR0_EMULATION                   (1 << 2)
+#define CR0_TASK_SWITCHED               (1 << 3)
+#define CR0_CACHE_DISABLE               (1 << 30)
+#define CR4_OSFXSR                      (1 << 9)
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    asm volatile ("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(subleaf));
+}
+
+static inline uint64_t rdtsc() {
+    uint32_t lo, hi;
+    asm volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+#ifdef LXBOOT_HOST
+/* the boot simulator provides these, see tools/sim */
+uint64_t rdmsr(uint32_t);
+void wrmsr(uint32_t, uint64_t);
+uint64_t readCR0();
+void writeCR0(uint64_t);
+uint64_t readCR4();
+uint64_t readCR3();
+void writeCR3(uint64_t);
+void outb(uint16_t, uint8_t);
+uint8_t inb(uint16_t);
+uint32_t inl(uint16_t);
+void wbinvd();
+#else
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    asm volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t v) {
+    asm volatile ("wrmsr" :: "a"((uint32_t)v), "d"((uint32_t)(v >> 32)), "c"(msr));
+}
+
+static inline uint64_t readCR0() {
+    uint64_t v;
+    asm volatile ("mov %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void writeCR0(uint64_t v) {
+    asm volatile ("mov %0, %%cr0" :: "r"(v) : "memory");
+}
+
+static inline uint64_t readCR4() {
+    uint64_t v;
+    asm volatile ("mov %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline uint64_t readCR3() {
+    uint64_t v;
+    asm volatile ("mov %%cr3, %0" : "=r"(v));
+    return v;
+}
+
+static inline void writeCR3(uint64_t v) {
+    asm volatile ("mov %0, %%cr3" :: "r"(v) : "memory");
+}
+
+static inline void outb(uint16_t port, uint8_t v) {
+    asm volatile ("outb %0, %1" :: "a"(v), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t v;
+    asm volatile ("inb %1, %0" : "=a"(v) : "Nd"(port));
+    return v;
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t v;
+    asm volatile ("inl %1, %0" : "=a"(v) : "Nd"(port));
+    return v;
+}
+
+static inline void wbinvd() {
+    asm volatile ("wbinvd" ::: "memory");
+}
+#endif
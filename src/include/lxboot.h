@@ -9,10 +9,11 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 #include <lxfs.h>
 
-#define PAGING_BASE         0x100000    // 1 MB mark
 #define PAGE_SIZE           4096
+#define HUGE_PAGE_SIZE      0x200000    // 2 MiB
 
 /* Boot Protocol */
 
@@ -25,8 +26,10 @@ typedef struct {
     uint32_t diskAPI;
     uint32_t keyboardAPI;
     uint32_t miscAPI;
-    uint32_t lmode;         /* pointer to void lmode(uint32_t paging, uint32_t entry) */
+    uint32_t lmode;         /* pointer to void lmode(uint64_t paging, uint64_t entry, KernelBootInfo *k) */
     uint32_t regs;
+    uint32_t batchAPI;      /* pointer to void bios_batch(BIOSCall *queue, uint32_t count) */
+    uint64_t timestamps[3]; /* TSC when stage 1, stage 2, and the core started, zero if unknown */
 } __attribute__((packed)) LXBootInfo;
 
 /* this structure is used to pass info to and from the BIOS */
@@ -38,8 +41,25 @@ typedef struct {
     uint32_t esi;
     uint32_t edi;
     uint32_t eflags;
+    uint32_t ebp;           // output only, for functions that return es:bp
+    uint16_t es;            // zero on input except in batches
 } __attribute__((packed)) CPURegisters;
 
+/* one call in a batch, see biosBatch() */
+#define BIOS_BATCH_MAX      16
+
+/* buffers the BIOS reaches through 16-bit offsets go first in .bss, and the
+ * linker script checks that they end below 64 KiB */
+#define REAL_MODE_BUFFER    __attribute__((section(".bss.real")))
+
+typedef struct {
+    CPURegisters regs;      // results are written back here
+    uint8_t vector;         // interrupt number
+    uint8_t function;       // AH before the call, kept for the profiler
+    uint8_t reserved[4];
+    uint64_t cycles;        // output only, TSC ticks spent in the BIOS handler
+} __attribute__((packed)) BIOSCall;
+
 /* for BIOS INT 13h */
 typedef struct {
     uint8_t size;
@@ -67,10 +87,25 @@ typedef struct {
 #define MEMORY_ATTRIBUTES_VALID         0x01
 #define MEMORY_ATTRIBUTES_NV            0x02
 
+/* Physical memory allocated by the boot loader */
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+    uint32_t type;
+    uint32_t reserved;
+} __attribute__((packed)) BootMemoryRange;
+
+#define BOOT_MEMORY_LOADER              1   // scratch, free once the kernel is done with the boot info
+#define BOOT_MEMORY_KERNEL              2
+#define BOOT_MEMORY_PAYLOAD             3   // ramdisk and modules
+#define BOOT_MEMORY_PAGING              4   // page tables in use at kernel entry
+#define BOOT_MEMORY_BOOT_INFO           5   // tables pointed to by the boot info
+#define BOOT_MEMORY_SMP                 6   // parked CPUs run from here until released
+
 /* this structure is passed to the kernel */
 typedef struct {
     uint32_t magic;         // 0x5346584C
-    uint32_t version;       // 1
+    uint32_t version;       // 2
 
     uint8_t flags;
 
@@ -103,18 +138,293 @@ typedef struct {
     uint8_t bluePosition;
     uint8_t blueMask;
 
-    uint64_t ramdisk;           // pointer
+    uint64_t ramdisk;           // pointer, 2 MiB-aligned unless memory is tight
     uint64_t ramdiskSize;
 
     uint8_t moduleCount;
-    uint64_t modules[16];       // array of pointers
+    uint64_t modules[16];       // array of pointers, aligned like the ramdisk
     uint64_t moduleSizes[16];
 
     uint64_t lowestFreeMemory;  // pointer to the end of highest ramdisk/module, aka lowest free memory
 
     char arguments[256];        // command-line arguments passed to the kernel
+
+    /* version 2: module names no longer precede the module data */
+    uint64_t moduleNames[16];   // array of pointers to null-terminated paths
+
+    uint64_t bootMemory;        // pointer to BootMemoryRange array
+    uint16_t bootMemoryCount;
+
+    uint64_t preloadFiles;      // pointer to PreloadFile array
+    uint16_t preloadCount;
+
+    /* in lazy mode only the first ramdiskLoaded bytes are in memory, and the
+     * kernel reads the rest from the extents on ramdiskDisk */
+    uint8_t ramdiskFlags;
+    uint8_t ramdiskDisk;        // BIOS disk number
+    uint64_t ramdiskLoaded;
+    uint64_t ramdiskExtents;    // pointer to DiskExtent array, in file order
+    uint32_t ramdiskExtentCount;
+
+    uint8_t ramdiskFormat;
+    uint64_t ramdiskIndex;      // pointer to RamdiskIndexEntry array, sorted by name
+    uint32_t ramdiskIndexCount;
+
+    uint8_t framebufferCaching;
+    uint64_t pat;               // IA32_PAT at kernel entry, zero if left untouched
+
+    /* application processors are parked in long mode on the same page tables
+     * as the BSP, each one waiting on its own mailbox */
+    uint64_t localAPIC;         // physical address of the local APIC
+    uint64_t cpus;              // pointer to SMPCPU array, BSP first
+    uint32_t cpuCount;
+
+    /* every table listed here has passed its checksum */
+    uint64_t acpiTables;        // pointer to ACPITableEntry array
+    uint16_t acpiTableCount;
+    uint16_t acpiCPUCount;      // enabled local APICs in the MADT
+    uint16_t acpiIOAPICCount;
+    uint16_t acpiPMTimerPort;   // zero if there is no port-mapped PM timer
+    uint8_t acpiPMTimerBits;    // 24 or 32
+
+    /* NUMA topology from the SRAT and SLIT, domains are ACPI proximity
+     * domains and every count is zero without an SRAT */
+    uint64_t numaMemory;        // pointer to NUMAMemoryRange array
+    uint32_t numaMemoryCount;
+    uint64_t numaCPUs;          // pointer to NUMACPU array
+    uint32_t numaCPUCount;
+    uint64_t numaDistances;     // pointer to uint8_t[numaDomainCount][numaDomainCount]
+    uint32_t numaDomainCount;
+
+    uint64_t tscFrequency;      // in Hz
+    uint8_t tscSource;          // TSC_SOURCE_*
+    uint8_t tscInvariant;       // non-zero if the TSC keeps its rate in all P/C-states
+
+    uint64_t cpuInfo;           // pointer to CPUInfo, as seen on the BSP
+
+    /* every mode the VESA BIOS listed, so the kernel can switch without
+     * probing again */
+    uint64_t videoModes;        // pointer to VideoMode array
+    uint16_t videoModeCount;
+    uint16_t videoModeCurrent;  // index of the mode described above
+    uint64_t edid;              // pointer to the raw 128-byte EDID block, zero if there is none
+
+    /* console the kernel can start with; without a framebuffer every
+     * framebuffer and video mode field above is zero */
+    uint8_t consoleType;        // CONSOLE_*
+    uint64_t consoleAddress;    // VGA text memory in text mode, the framebuffer in graphics mode
+    uint16_t consoleColumns;    // text mode only
+    uint16_t consoleRows;
+    uint16_t consoleSerialPort; // I/O base of COM1 from the BIOS data area, zero if there is none
+
+    /* everything the loader printed, even in quiet mode */
+    uint64_t bootLog;           // pointer to the text, not null-terminated
+    uint32_t bootLogSize;
+    uint32_t bootLogDropped;    // older bytes that didn't fit in the log
+
+    /* when each stage of the loader started, in TSC ticks; a stage lasts until
+     * the next one starts, and the last entry is taken just before the jump
+     * to the kernel */
+    uint64_t timeline;          // pointer to BootStage array
+    uint16_t timelineCount;
+
+    /* BIOS services the loader used, only in builds with BIOS_PROFILE */
+    uint64_t biosProfile;       // pointer to BIOSProfileEntry array, zero if not profiled
+    uint16_t biosProfileCount;
+
+    /* every disk read in order, only in builds with DISK_TRACE */
+    uint64_t diskTrace;         // pointer to DiskTraceRecord array, zero if not traced
+    uint32_t diskTraceCount;
+    uint32_t diskTraceDropped;  // later reads that didn't fit in the trace
 } __attribute__((packed)) KernelBootInfo;
 
+#define CONSOLE_FRAMEBUFFER         0
+#define CONSOLE_TEXT                1
+#define CONSOLE_SERIAL              2
+
+/* one entry of the boot timeline */
+typedef struct {
+    char name[16];
+    uint64_t tsc;
+    uint64_t diskBytes;         // read from disk by the core before this stage started
+} __attribute__((packed)) BootStage;
+
+/* one BIOS function in the profile; the first entry has vector zero and
+ * counts the round trips to real mode, with the cycles spent switching modes
+ * rather than in the BIOS */
+#define BIOS_PROFILE_MAX            16
+#define BIOS_PROFILE_BUCKETS        32
+
+typedef struct {
+    uint8_t vector;
+    uint8_t function;           // AH
+    uint32_t count;
+    uint64_t cycles;            // total TSC ticks
+    uint16_t histogram[BIOS_PROFILE_BUCKETS];   // calls by log2 of their ticks, saturated
+} __attribute__((packed)) BIOSProfileEntry;
+
+/* one call to readSectors(), see tools/disktrace.py */
+#define DISK_TRACE_OTHER            0
+#define DISK_TRACE_PARTITION        1   // partition table
+#define DISK_TRACE_ID               2   // LXFS identification block
+#define DISK_TRACE_TABLE            3   // LXFS block table
+#define DISK_TRACE_DIRECTORY        4
+#define DISK_TRACE_FILE             5   // file contents
+#define DISK_TRACE_RAMDISK          6   // prefix of a lazily loaded ramdisk
+
+typedef struct {
+    uint64_t lba;
+    uint32_t count;             // in sectors
+    uint8_t disk;
+    uint8_t source;             // DISK_TRACE_*
+    uint16_t reserved;
+    uint64_t start;             // TSC
+    uint64_t end;
+} __attribute__((packed)) DiskTraceRecord;
+
+/* video mode table, with the linear framebuffer layout of each mode */
+typedef struct {
+    uint16_t mode;              // VBE mode number
+    uint16_t attributes;        // VBE mode attributes
+    uint16_t width;
+    uint16_t height;
+    uint32_t pitch;
+    uint8_t bpp;
+    uint8_t memoryModel;
+    uint8_t redPosition;
+    uint8_t redMask;
+    uint8_t greenPosition;
+    uint8_t greenMask;
+    uint8_t bluePosition;
+    uint8_t blueMask;
+    uint64_t framebuffer;
+} __attribute__((packed)) VideoMode;
+
+/* CPUID snapshot */
+#define CPU_MAX_CACHES          8
+#define CPU_MAX_TOPOLOGY        6
+
+typedef struct {
+    uint8_t level;
+    uint8_t type;           // CPUID leaf 4 encoding: 1 = data, 2 = instruction, 3 = unified
+    uint16_t lineSize;
+    uint32_t ways;
+    uint32_t sets;
+    uint32_t size;          // in bytes
+    uint32_t sharing;       // maximum number of logical processors sharing it
+} __attribute__((packed)) CPUCache;
+
+typedef struct {
+    uint8_t type;           // CPUID leaf 0xB/0x1F encoding: 1 = SMT, 2 = core, 3 = module, 4 = tile, 5 = die
+    uint8_t shift;          // bits of the x2APIC ID below the next level
+    uint16_t count;         // logical processors at this level
+} __attribute__((packed)) CPUTopology;
+
+typedef struct {
+    char vendor[12];
+    uint32_t maxLeaf;
+    uint32_t maxExtendedLeaf;
+    uint32_t signature;                 // leaf 1 EAX: family, model, and stepping
+    uint32_t features[2];               // leaf 1 ECX and EDX
+    uint32_t structuredFeatures[3];     // leaf 7 EBX, ECX, and EDX
+    uint32_t extendedFeatures[2];       // leaf 0x80000001 ECX and EDX
+
+    uint64_t xsaveFeatures;             // components XCR0 may enable
+    uint32_t xsaveSize;                 // XSAVE area size with all of them enabled
+
+    uint8_t physicalAddressBits;
+    uint8_t linearAddressBits;
+
+    uint32_t tlbDescriptors[4];         // leaf 2 (Intel)
+    uint32_t tlbExtended[8];            // leaves 0x80000005 and 0x80000006 (AMD)
+
+    uint8_t cacheCount;
+    CPUCache caches[CPU_MAX_CACHES];    // leaf 4 or 0x8000001D
+
+    uint8_t topologyCount;
+    CPUTopology topology[CPU_MAX_TOPOLOGY];     // leaf 0x1F or 0xB, lowest level first
+} __attribute__((packed)) CPUInfo;
+
+#define TSC_SOURCE_CPUID_CRYSTAL    1   // CPUID 0x15
+#define TSC_SOURCE_HYPERVISOR       2   // CPUID 0x40000010
+#define TSC_SOURCE_CPUID_FREQUENCY  3   // CPUID 0x16, nominal
+#define TSC_SOURCE_PM_TIMER         4   // measured
+#define TSC_SOURCE_PIT              5   // measured
+
+#define FRAMEBUFFER_CACHE_DEFAULT   0   // whatever the firmware's MTRRs say
+#define FRAMEBUFFER_CACHE_WC_PAT    1   // PAT entry 1 is WC and the framebuffer is mapped with PWT
+#define FRAMEBUFFER_CACHE_WC_MTRR   2   // a variable MTRR makes the framebuffer WC
+
+#define RAMDISK_FLAGS_LAZY      0x01
+
+#define RAMDISK_FORMAT_UNKNOWN  0
+#define RAMDISK_FORMAT_TAR      1
+#define RAMDISK_FORMAT_CPIO     2
+
+/* one file in a tar or cpio ramdisk */
+typedef struct {
+    uint64_t name;          // pointer to null-terminated path relative to the archive root,
+                            // followed by the null-terminated target of a tar link
+    uint64_t offset;        // offset of the file data from the start of the ramdisk
+    uint64_t size;
+    uint32_t mode;          // POSIX st_mode, including the file type
+    uint32_t reserved;
+} __attribute__((packed)) RamdiskIndexEntry;
+
+/* files read ahead of time by the preload directive */
+typedef struct {
+    uint64_t path;          // pointer to null-terminated absolute path
+    uint64_t address;       // page-aligned
+    uint64_t size;
+} __attribute__((packed)) PreloadFile;
+
+/* one ACPI table, including the DSDT */
+typedef struct {
+    char signature[4];
+    uint32_t length;
+    uint64_t address;
+} __attribute__((packed)) ACPITableEntry;
+
+/* NUMA memory range and CPU affinity */
+typedef struct {
+    uint64_t base;
+    uint64_t size;
+    uint32_t domain;
+    uint32_t flags;         // SRAT memory affinity flags, e.g. hot-pluggable
+} __attribute__((packed)) NUMAMemoryRange;
+
+typedef struct {
+    uint32_t apicID;
+    uint32_t domain;
+} __attribute__((packed)) NUMACPU;
+
+#define NUMA_DISTANCE_LOCAL     10      // the SLIT's unit, also used without one
+
+/* one CPU listed in the MADT */
+typedef struct {
+    uint32_t apicID;
+    uint32_t flags;
+    uint64_t mailbox;       // pointer to SMPMailbox, zero for the BSP
+} __attribute__((packed)) SMPCPU;
+
+#define SMP_CPU_BSP         0x01
+#define SMP_CPU_PARKED      0x02    // waiting on its mailbox, otherwise it never came up
+
+/* a parked CPU jumps to entry as soon as it becomes non-zero, with stack in
+ * RSP and argument in RDI, so it must be stored last */
+typedef struct {
+    uint32_t apicID;
+    uint32_t state;
+    uint64_t entry;
+    uint64_t stack;
+    uint64_t argument;
+    uint8_t reserved[32];
+} __attribute__((packed)) SMPMailbox;
+
+#define SMP_STATE_STARTING  0
+#define SMP_STATE_PARKED    1
+#define SMP_STATE_RELEASED  2
+
 #define BOOT_FLAGS_UEFI     0x01
 #define BOOT_FLAGS_GPT      0x02
 
@@ -123,18 +433,62 @@ extern CPURegisters *biosRegs;
 
 void videoAPI(CPURegisters *);
 void diskAPI(CPURegisters *);
+extern BIOSCall biosQueue[];
+void biosCall(uint8_t, CPURegisters *);
+void biosBatch(BIOSCall *, int);
+uint16_t biosProfileHandoff(uint64_t *);
+void biosProfilePrint(uint64_t);
+
+/* console output */
+#define CONSOLE_OUTPUT_VGA          0x01
+#define CONSOLE_OUTPUT_SERIAL       0x02
+#define CONSOLE_OUTPUT_BIOS         0x04    // teletype, only as a fallback
+#define CONSOLE_OUTPUT_FRAMEBUFFER  0x08    // replaces the others on screen after a mode switch
+
+uint8_t consoleInit(uint8_t);
+void consoleFramebuffer(VideoMode *);
+void consolePutchar(char);
+void consoleFlush();
+
+/* boot log */
+#define LOG_QUIET                   0   // log only, nothing on the console
+#define LOG_NORMAL                  1
+
+void logInit();
+void logVerbosity(int);
+uint32_t logHandoff(uint64_t *, uint32_t *);
+void halt() __attribute__((noreturn));
 
 /* disk i/o */
 extern int partitionIndex;      // boot partition
+extern uint64_t diskBytesRead;
 int readSectors(void *, uint32_t, int, uint8_t);
+uint8_t diskTraceSource(uint8_t);
+uint32_t diskTraceHandoff(uint64_t *, uint32_t *);
 int findBootPartition();
 uint32_t getPartitionStart(uint8_t, int);
 
+/* CPU identification */
+CPUInfo *cpuSnapshot();
+
+/* timing */
+void timerDelay(uint32_t);
+uint64_t tscFrequency(uint16_t, int, uint8_t *, bool *);
+
+/* boot timeline */
+#define TIMELINE_MAX_STAGES     32
+
+void timelineMark(const char *);
+void timelineRecord(const char *, uint64_t);
+uint16_t timelineHandoff(uint64_t *);
+void timelinePrint(uint64_t);
+
 /* configuration, modules, and ramdisk */
 #define CONFIG_MAX_NAME         32
 #define CONFIG_MAX_KERNEL       32
 #define CONFIG_MAX_ARGUMENTS    256
 #define CONFIG_MAX_MODULES      1024
+#define CONFIG_MAX_PRELOAD      1024
 
 typedef struct {
     size_t size;
@@ -147,18 +501,52 @@ typedef struct {
     char ramdisk[CONFIG_MAX_KERNEL];
     char arguments[CONFIG_MAX_ARGUMENTS];
     char modules[CONFIG_MAX_MODULES];
+    char preload[CONFIG_MAX_PRELOAD];
 
     int moduleCount;
+    int preloadCount;
+
+    bool ramdiskLazy;       // 'ramdisk <path> lazy [prefix KiB]'
+    size_t ramdiskPrefix;   // bytes to load up front in lazy mode
+
+    uint16_t videoWidth;    // 'video WxHxBPP', zero to follow the monitor
+    uint16_t videoHeight;
+    uint8_t videoBpp;
+    uint8_t videoOutput;    // 'video none' or 'video text', see VIDEO_OUTPUT_*
+    uint8_t console;        // 'console vga serial bios', zero to keep the default
+    bool quiet;             // 'quiet', nothing is printed unless boot fails
+    bool timeline;          // 'timeline', print how long each stage took
 } BootConfig;
 
+#define VIDEO_OUTPUT_GRAPHICS   0
+#define VIDEO_OUTPUT_TEXT       1   // leave the display in the BIOS text mode
+#define VIDEO_OUTPUT_NONE       2   // serial only
+
 int loadConfig(const char *);
 BootConfig *selectBootOption(int);
 char *copyModule(char *, char *, int);
+int preload(BootConfig *, uint64_t *);
+int indexRamdisk(const void *, uint64_t, uint64_t *, uint8_t *);
 
 /* memory detection */
 int detectMemory(uint64_t *);
+bool memoryRangeUsable(uint64_t, uint64_t);
 extern MemoryMap memoryMap[];
+extern int memoryMapCount;
+
+/* physical memory allocation */
+void allocInit();
+void allocSetLimit(uint64_t);
+bool allocReserve(uint64_t, uint64_t, uint32_t);
+uint64_t allocAligned(uint64_t, uint64_t, uint32_t);
+void allocFree(uint64_t, uint64_t);
+void *allocPages(size_t, uint32_t);
+void *allocLowPages(size_t, size_t);
+uint64_t allocLowestFree();
+BootMemoryRange *allocTable(int *);
 
 /* long mode setup */
-void pagingSetup();
-void lmode(uint32_t, uint32_t, KernelBootInfo *);
+void pagingInit(uint64_t);
+uint64_t pagingSetup(uint64_t);
+uint8_t pagingWriteCombine(uint64_t, uint64_t, bool, uint64_t *);
+void lmode(uint64_t, uint64_t, KernelBootInfo *);
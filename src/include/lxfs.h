@@ -105,10 +105,21 @@ typedef struct {
 
 #define LXFS_USER_ROOT              0x0000
 
+/* a run of contiguous sectors on disk */
+typedef struct {
+    uint64_t lba;           // absolute, in 512-byte sectors
+    uint64_t count;
+} __attribute__((packed)) DiskExtent;
+
 /* implementation-specific constants */
-#define LXFS_BLOCK_BUFFER           0x50000
-#define LXFS_TEXT_BUFFER            0x58000
-#define LXFS_DIRECTORY_BUFFER       0x60000
+#define LXFS_MAX_BLOCK_SIZE         (16 * 4096)     // 16 sectors of up to 4 KiB
+
+/* scratch buffers, allocated by lxfsInit() */
+extern void *lxfsBlockBuffer;
+extern void *lxfsTextBuffer;
+extern void *lxfsDirectoryBuffer;
+
+void lxfsInit();
 
 size_t readBlock(uint8_t, int, uint64_t, size_t, void *);
 uint64_t getNextBlock(uint8_t, int, uint32_t);
@@ -116,7 +127,12 @@ uint64_t readNextBlock(uint8_t, int, uint64_t, void *);
 uint64_t getRootDirectory(uint8_t, int);
 unsigned int getBlockSize(uint8_t, int);
 unsigned int getSectorSize(uint8_t, int);
+uint32_t lxfsPartitionStart(uint8_t, int);
 
 bool lxfsFindPath(uint8_t, int, const char *, LXFSDirectoryEntry *);
 bool lxfsRead(uint8_t, int, const char *, void *);
+bool lxfsReadEntry(uint8_t, int, LXFSDirectoryEntry *, void *);
 size_t lxfsSize(uint8_t, int, const char *);
+size_t lxfsBufferSize(size_t);
+int lxfsList(uint8_t, int, const char *, char *, size_t);
+int lxfsExtents(uint8_t, int, const char *, DiskExtent *, int);
@@ -0,0 +1,48 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <acpi.h>
+
+/* local APIC registers, as offsets from its base in xAPIC mode */
+#define LAPIC_ICR_LOW               0x300
+#define LAPIC_ICR_HIGH              0x310
+
+#define LAPIC_ICR_INIT              0x00004500  // assert, INIT delivery
+#define LAPIC_ICR_STARTUP           0x00004600  // assert, start-up delivery
+#define LAPIC_ICR_PENDING           0x00001000
+
+/* smp.asm is copied to a page below 1 MiB for the APs to start in, and again
+ * next to the mailboxes for them to park in, and this block follows the
+ * initial jump in both copies */
+#define SMP_TRAMPOLINE_DATA         8
+
+typedef struct {
+    uint16_t gdtLimit;
+    uint64_t gdtBase;           // the trampoline only uses the low 32 bits
+    uint16_t reserved0;
+    uint32_t longEntry;         // far pointer to the 64-bit code of the low copy
+    uint16_t longSelector;
+    uint16_t reserved1;
+    uint32_t cr3;               // page tables below 4 GiB for the switch
+    uint64_t finalCR3;          // page tables handed to the kernel
+    uint64_t park;              // address of the parking loop in the other copy
+    uint64_t mailboxes;
+    uint32_t count;
+    uint32_t monitor;           // non-zero if MONITOR/MWAIT can be used
+    uint64_t pat;               // value for IA32_PAT, zero to leave it alone
+} __attribute__((packed)) SMPTrampolineData;
+
+extern uint8_t smpTrampoline[];
+extern uint8_t smpTrampolineGDT[];
+extern uint8_t smpTrampolineLong[];
+extern uint8_t smpTrampolinePark[];
+extern uint8_t smpTrampolineEnd[];
+
+int smpSetup(uint64_t, uint64_t, uint64_t *, uint64_t *);
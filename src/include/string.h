@@ -8,10 +8,22 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
 
 void *memcpy(void *, const void *, size_t);
+void *memmove(void *, const void *, size_t);
 size_t strlen(const char *);
 char *strcpy(char *, const char *);
 void *memset(void *, int, size_t);
 int strcmp(const char *, const char *);
-int memcmp(const void *, const void *, size_t);
\ No newline at end of file
+int memcmp(const void *, const void *, size_t);
+
+/* picks the memory primitives for the CPU, see string.c */
+#define MEM_VARIANT_QUAD        0   // rep movsq/stosq
+#define MEM_VARIANT_ERMS        1   // rep movsb/stosb, on CPUs with ERMSB
+#define MEM_VARIANT_SSE2        2   // 64 bytes per iteration through xmm0-3
+#define MEM_VARIANTS            3
+
+void memInit();
+void memVariant(int);
+void memBenchmark(uint64_t);
@@ -8,6 +8,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <lxboot.h>
 
 /* this structure is used by the controller to identify itself */
 typedef struct {
@@ -58,7 +59,21 @@ typedef struct {
     uint32_t offScreenBuffer;
     uint16_t offScreenBufferSize;
 
-    uint8_t reserved1[206];
+    /* VBE 3.0: these describe the mode as it is with the linear framebuffer */
+    uint16_t linearPitch;
+    uint8_t bankImagePages;
+    uint8_t linearImagePages;
+    uint8_t linearRedMask;
+    uint8_t linearRedPosition;
+    uint8_t linearGreenMask;
+    uint8_t linearGreenPosition;
+    uint8_t linearBlueMask;
+    uint8_t linearBluePosition;
+    uint8_t linearReservedMask;
+    uint8_t linearReservedPosition;
+    uint32_t maxPixelClock;
+
+    uint8_t reserved1[190];
 } __attribute__((packed)) VBEMode;
 
 /* these structures identify the display itself, not the display controller */
@@ -118,5 +133,21 @@ typedef struct {
 #define VBE_ENABLE_CRTC             0x0800
 #define VBE_ENABLE_LINEAR_FB        0x4000
 
-VBEMode *vbeSetup();
-VBEMode *vbeSetMode(uint16_t, uint16_t, uint8_t);
+/* mode attributes and memory model */
+#define VBE_MODE_SUPPORTED          0x0001
+#define VBE_MODE_GRAPHICS           0x0010
+#define VBE_MODE_LINEAR_FB          0x0080
+#define VBE_MEMORY_DIRECT           6
+
+#define VBE_MAX_MODES               256     // guards against unterminated mode lists
+#define VBE_EDID_SIZE               128
+
+/* mode table and EDID block for the kernel, see VideoMode in lxboot.h */
+typedef struct {
+    uint64_t modes;             // pointer to VideoMode array, in controller order
+    uint16_t modeCount;
+    uint16_t current;           // index of the mode that was set
+    uint64_t edid;              // pointer to the raw EDID block, zero if there is none
+} VBESummary;
+
+VideoMode *vbeSetup(uint16_t, uint16_t, uint8_t, VBESummary *);
@@ -14,6 +14,8 @@ lxfs_boot_id:
     .architecture:          dd 2        ; x86_64
     .timestamp:             dq 0        ; the formatting utility will write this
     .description:           db "lux", 0
+                            times 44 - ($-$$) db 0
+    .sectors:               dw (stage2_end - $$ + 511) / 512    ; checked by the boot sector
                             times 48 - ($-$$) db 0
     .reserved:              times 16 db 0
 
@@ -36,6 +38,12 @@ main:
     mov ss, ax
     mov sp, 0x1000
 
+    ; and the timestamps the boot sector left in the identification block
+    mov si, lxfs_boot_id.reserved
+    mov di, timestamps
+    mov cx, 8
+    rep movsw
+
     sti
 
     ; show signs of life
@@ -107,8 +115,12 @@ main:
 
 [bits 32]
 
+    rdtsc
+    mov [timestamps.core], eax
+    mov [timestamps.core+4], edx
+
     mov esi, boot_info
-    jmp pmode_program
+    jmp long_entry
 
 [bits 16]
 
@@ -181,6 +193,13 @@ partition:
                     dd lmode
 
                     dd registers
+                    dd bios_batch
+
+timestamps:
+    .stage1:        dq 0                ; TSC values, see lxboot.h
+    .stage2:        dq 0
+    .core:          dq 0
 
 times 0x1000 - ($-$$) db 0                   ; pad out to 0x2000
-pmode_program:      incbin "lxboot.core"
+core_program:       incbin "lxboot.core"
+stage2_end:
@@ -5,6 +5,10 @@
 ; Boot loader for x86_64
 ; mode.asm: CPU Mode Switch
 
+EARLY_PAGING                equ 0x60000     ; 6 pages of paging structures
+REAL_STACK_SEGMENT          equ 0x6000      ; real mode stack below 0x70000,
+REAL_STACK_POINTER          equ 0xFFF0      ; clear of the long mode stack
+
 [bits 16]
 
 ; pmode: switches the CPU to 32-bit protected mode
@@ -76,7 +80,12 @@ rmode:
     mov es, ax
     mov fs, ax
     mov gs, ax
+
+    ; the long mode stack is out of reach with ss = 0, so BIOS calls get their
+    ; own stack
+    mov ax, REAL_STACK_SEGMENT
     mov ss, ax
+    mov sp, REAL_STACK_POINTER
 
     sti
 
@@ -87,47 +96,44 @@ rmode:
 
 [bits 32]
 
-; lmode: switches the CPU to 64-bit long mode
-; void lmode(uint32_t paging, uint32_t entry, KernelBootInfo *k)
-
-align 4
-lmode:
-    pop eax                     ; discard return address as we will never return
-    pop eax                     ; paging
-    mov cr3, eax
-    pop eax                     ; entry
-    mov [.entry], eax
-    pop eax                     ; k
-    mov [.k], eax
-
-    ; we'll need to switch back to 16-bit mode for a moment to notify the BIOS
-    call rmode
-
-[bits 16]
+; long_entry: switches the CPU from protected mode to 64-bit long mode and
+; starts the core, which runs entirely in long mode
+; params: esi = pointer to boot info
+; returns: never
+
+long_entry:
+    ; identity map the lowest 4 GiB with 2 MiB pages; the core replaces these
+    ; tables with a map of all memory once it knows the memory map
+    mov edi, EARLY_PAGING
+    mov ecx, (6 * 4096) / 4
+    xor eax, eax
+    cld
+    rep stosd
 
-    mov eax, 0xEC00
-    mov ebx, 2
-    int 0x15
+    mov dword [EARLY_PAGING], EARLY_PAGING + 0x1003     ; PML4 -> PDP
 
-    ; mask all interrupts and allow queued interrupts to be handled
-    mov al, 0xFF
-    out 0x21, al
-    out 0xA1, al
+    mov edi, EARLY_PAGING + 0x1000
+    mov eax, EARLY_PAGING + 0x2003
+    mov ecx, 4
 
-    mov ecx, 0xFFF
+.pdp:
+    mov [edi], eax              ; PDP -> 4 PDs
+    add eax, 0x1000
+    add edi, 8
+    loop .pdp
 
-.wait:
-    sti
-    nop
-    nop
-    nop
-    nop
-    loop .wait
+    mov edi, EARLY_PAGING + 0x2000
+    mov eax, 0x83               ; present, writable, 2 MiB
+    mov ecx, 2048
 
-    ; now we can switch back to 32-bit mode and continue the setup
-    call pmode
+.pd:
+    mov [edi], eax
+    add eax, 0x200000
+    add edi, 8
+    loop .pd
 
-[bits 32]
+    mov eax, EARLY_PAGING
+    mov cr3, eax
 
     ; configure the CPU
     mov eax, 0x620              ; SSE, PAE
@@ -135,7 +141,7 @@ lmode:
 
     mov eax, cr0
     and eax, 0xBFFFFFFF         ; enable global caching
-    mov eax, cr0
+    mov cr0, eax
 
     mov ecx, 0xC0000080
     rdmsr
@@ -152,19 +158,109 @@ lmode:
 
 .next:
     ; by now we're in true 64-bit mode
-    mov rax, 0x30
-    mov ss, rax
-    mov ds, rax
-    mov es, rax
-    mov fs, rax
-    mov gs, rax
-    mov rbx, 0xFFFFFFFF
-    and rsp, rbx            ; zero extension
-
-    mov eax, [.entry]
-    and rax, rbx
-    mov edi, [.k]
-    and rdi, rbx
+    mov eax, 0x30
+    mov ss, ax
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+    mov rsp, 0x80000
+
+    mov eax, esi                ; zero extension
+    mov rsi, rax
+    jmp core_program
+
+; bios_thunk: calls a 16-bit real mode routine from long mode
+; params: eax = address of the routine, which must return with ret
+; returns: nothing, all registers the SysV ABI expects to be preserved are
+
+bios_thunk:
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [.target], ax
+    mov [.stack], rsp
+
+    jmp far [.compat]           ; compatibility mode
+
+[bits 32]
+
+.compat32:
+    mov eax, 0x10
+    mov ss, ax
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    ; turning off paging drops the CPU out of long mode, but CR3, PAE, and
+    ; EFER.LME stay in place for the way back
+    mov eax, cr0
+    and eax, 0x7FFFFFFF
+    mov cr0, eax
+
+    call rmode
+
+[bits 16]
+
+    call word [.target]
+    call pmode
+
+[bits 32]
+
+    mov eax, cr0
+    or eax, 0x80000000
+    mov cr0, eax
+
+    jmp 0x28:.long
+
+[bits 64]
+
+.long:
+    mov eax, 0x30
+    mov ss, ax
+    mov ds, ax
+    mov es, ax
+    mov fs, ax
+    mov gs, ax
+
+    mov rsp, [.stack]
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    cld
+    ret
+
+align 8
+.stack:                 dq 0
+.compat:                dd .compat32
+                        dw 0x08
+.target:                dw 0
+
+; lmode: hands off control to the kernel
+; void lmode(uint64_t paging, uint64_t entry, KernelBootInfo *k)
+
+align 4
+lmode:
+    mov [.paging], rdi
+    mov [.entry], rsi
+    mov [.k], rdx
+
+    ; we'll need to switch back to 16-bit mode for a moment to notify the BIOS
+    mov eax, .rmode
+    call bios_thunk
+
+    mov rax, [.paging]
+    mov cr3, rax
+
+    mov rdi, [.k]
+    mov rax, [.entry]
 
     cld
     call rax                ; kernel entry point taking KernelBootInfo * as a parameter
@@ -175,9 +271,35 @@ lmode:
     hlt
     jmp .hang
 
-align 4
-.entry:                 dd 0
-.k:                     dd 0
+[bits 16]
+
+.rmode:
+    mov eax, 0xEC00
+    mov ebx, 2
+    int 0x15
+
+    ; mask all interrupts and allow queued interrupts to be handled
+    mov al, 0xFF
+    out 0x21, al
+    out 0xA1, al
+
+    mov ecx, 0xFFF
+
+.wait:
+    sti
+    nop
+    nop
+    nop
+    nop
+    loop .wait
+
+    cli
+    ret
+
+align 8
+.paging:                dq 0
+.entry:                 dq 0
+.k:                     dq 0
 
 ; Global Descriptor Table
 align 16
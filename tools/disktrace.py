@@ -0,0 +1,236 @@
+#!/usr/bin/env python3
+
+# lux - a lightweight unix-like operating system
+# Omar Elghoul, 2024
+#
+# Boot loader for x86_64
+# disktrace.py: Report on a disk trace recorded by a DISK_TRACE build
+
+"""
+Turns the disk trace of a loader built with 'make DISK_TRACE=1' into a
+per-read and per-file report.
+
+The trace is the raw array of DiskTraceRecord that the boot info points to
+(diskTrace, diskTraceCount records of 32 bytes each), dumped to a file, for
+example with QEMU's 'pmemsave'. Given the disk image that was booted, every
+read of file or directory contents is resolved to the path it belongs to.
+
+usage: disktrace.py trace.bin [--image disk.img] [--frequency HZ]
+"""
+
+import argparse
+import struct
+import sys
+
+RECORD = struct.Struct("<QIBBHQQ")
+
+SOURCES = ["other", "partition", "id", "table", "directory", "file", "ramdisk"]
+
+MBR_PARTITION_OFFSET = 446
+MBR_ID_LXFS = 0xF3
+LXFS_MAGIC = 0x5346584C
+LXFS_BLOCK_EOF = 0xFFFFFFFFFFFFFFFF
+LXFS_TABLE_START = 33
+LXFS_DIR_VALID = 0x0001
+LXFS_DIR_DELETED = 0x1000
+LXFS_DIR_TYPE_FILE = 0
+LXFS_DIR_TYPE_DIR = 1
+LXFS_DIRECTORY_HEADER = 48
+LXFS_ENTRY_HEADER = 64
+
+
+def readTrace(path):
+    data = open(path, "rb").read()
+    records = []
+    for offset in range(0, len(data) - RECORD.size + 1, RECORD.size):
+        lba, count, disk, source, _, start, end = RECORD.unpack_from(data, offset)
+        records.append({"lba": lba, "count": count, "disk": disk, "source": source, "start": start, "end": end})
+
+    return records
+
+
+class Partition:
+    """one LXFS partition of the image, walked the same way the loader does"""
+
+    def __init__(self, image, start):
+        self.image = image
+        self.start = start
+
+        id = self.sectors(start, 1)
+        parameters = id[24]
+        self.blockSize = ((parameters >> 3) & 0x0F) + 1     # in sectors
+        self.sectorSize = 512 << ((parameters >> 1) & 0x03)
+        self.root = struct.unpack_from("<Q", id, 16)[0]
+        self.perTable = (self.blockSize * self.sectorSize) // 8
+        self.owners = {}
+
+    def sectors(self, lba, count):
+        self.image.seek(lba * 512)
+        return self.image.read(count * 512)
+
+    def block(self, block):
+        return self.sectors(self.start + (block * self.blockSize), self.blockSize)
+
+    def next(self, block):
+        table = self.block((block // self.perTable) + LXFS_TABLE_START)
+        return struct.unpack_from("<Q", table, (block % self.perTable) * 8)[0]
+
+    def chain(self, first):
+        blocks = []
+        block = first
+        while block != LXFS_BLOCK_EOF and block not in blocks and len(blocks) < 0x100000:
+            blocks.append(block)
+            block = self.next(block)
+
+        return blocks
+
+    def walk(self, path, first):
+        blocks = self.chain(first)
+        for block in blocks:
+            self.owners[block] = path
+
+        directory = b"".join(self.block(block) for block in blocks)
+        offset = LXFS_DIRECTORY_HEADER
+        while offset + LXFS_ENTRY_HEADER <= len(directory):
+            flags = struct.unpack_from("<H", directory, offset)[0]
+            entrySize = struct.unpack_from("<H", directory, offset + 48)[0]
+            if not (flags & LXFS_DIR_VALID) or not entrySize:
+                break
+
+            if not (flags & LXFS_DIR_DELETED):
+                name = directory[offset + LXFS_ENTRY_HEADER:offset + entrySize].split(b"\0")[0].decode(errors="replace")
+                block = struct.unpack_from("<Q", directory, offset + 40)[0]
+                type = (flags >> 1) & 0x03
+                child = path.rstrip("/") + "/" + name
+
+                if type == LXFS_DIR_TYPE_DIR:
+                    self.walk(child, block)
+                elif type == LXFS_DIR_TYPE_FILE:
+                    for b in self.chain(block):
+                        self.owners[b] = child
+
+            offset += entrySize
+
+    def owner(self, lba):
+        if lba < self.start:
+            return None
+
+        block = (lba - self.start) // self.blockSize
+        if block in self.owners:
+            return self.owners[block]
+        if block == 0:
+            return "(identification)"
+        if block < LXFS_TABLE_START:
+            return "(boot program)"
+        return None
+
+
+def readImage(path):
+    image = open(path, "rb")
+    mbr = image.read(512)
+    partitions = []
+    for i in range(4):
+        entry = MBR_PARTITION_OFFSET + (i * 16)
+        id = mbr[entry + 4]
+        start = struct.unpack_from("<I", mbr, entry + 8)[0]
+        if id != MBR_ID_LXFS or not start:
+            continue
+
+        image.seek(start * 512)
+        if struct.unpack_from("<I", image.read(8), 4)[0] != LXFS_MAGIC:
+            continue
+
+        partition = Partition(image, start)
+        partition.walk("/", partition.root)
+        partitions.append(partition)
+
+    return partitions
+
+
+def owners(record, partitions):
+    # the files a read touched, in disk order
+    if record["source"] in (1, 2, 3):
+        return ["(" + SOURCES[record["source"]] + ")"]
+    if not partitions:
+        return []
+
+    found = []
+    for partition in partitions:
+        lba = record["lba"]
+        while lba < record["lba"] + record["count"]:
+            owner = partition.owner(lba)
+            if owner and owner not in found:
+                found.append(owner)
+            lba += 1
+
+    return found if found else ["(unknown)"]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="report on a loader disk trace")
+    parser.add_argument("trace", help="raw DiskTraceRecord array")
+    parser.add_argument("--image", help="disk image that was booted, to resolve reads to files")
+    parser.add_argument("--frequency", type=int, default=0, help="TSC frequency in Hz from the boot info, to report milliseconds")
+    args = parser.parse_args()
+
+    records = readTrace(args.trace)
+    if not records:
+        print("no records in %s" % args.trace)
+        return 1
+
+    partitions = readImage(args.image) if args.image else []
+
+    def duration(ticks):
+        if args.frequency:
+            return "%10.3f ms" % ((ticks * 1000.0) / args.frequency)
+        return "%10d tk" % ticks
+
+    # every read in order, with the distance from the end of the previous one
+    print("   #        lba  sectors       seek          time  source     files")
+    files = {}
+    seeks = 0
+    sectors = 0
+    previous = None
+    seen = {}
+    repeated = 0
+
+    for i, record in enumerate(records):
+        seek = 0 if previous is None else record["lba"] - (previous["lba"] + previous["count"])
+        if previous is not None and seek:
+            seeks += 1
+
+        ticks = record["end"] - record["start"]
+        names = owners(record, partitions)
+        source = SOURCES[record["source"]] if record["source"] < len(SOURCES) else str(record["source"])
+        print("%4d %10d %8d %10d %s  %-10s %s" % (i, record["lba"], record["count"], seek, duration(ticks), source, ", ".join(names)))
+
+        key = (record["disk"], record["lba"], record["count"])
+        if key in seen:
+            repeated += 1
+        seen[key] = True
+
+        name = ", ".join(names) if names else source
+        entry = files.setdefault(name, {"reads": 0, "sectors": 0, "ticks": 0, "seeks": 0})
+        entry["reads"] += 1
+        entry["sectors"] += record["count"]
+        entry["ticks"] += ticks
+        if previous is not None and seek:
+            entry["seeks"] += 1
+
+        sectors += record["count"]
+        previous = record
+
+    # and the same per file, most expensive first
+    print()
+    print(" reads  sectors  seeks          time  file")
+    for name, entry in sorted(files.items(), key=lambda item: -item[1]["ticks"]):
+        print("%6d %8d %6d %s  %s" % (entry["reads"], entry["sectors"], entry["seeks"], duration(entry["ticks"]), name))
+
+    total = records[-1]["end"] - records[0]["start"]
+    print()
+    print("%d reads, %d sectors, %d seeks, %d repeated reads, %s from the first read to the last" % (len(records), sectors, seeks, repeated, duration(total).strip()))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,191 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* Host environment for the loader's C core */
+/* stands in for the parts of the loader that need the BIOS or own the
+ * machine: sector reads come from a disk image, memory comes from an arena,
+ * and the console goes to stdout */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "host.h"
+
+#define ARENA_SIZE              (4ULL << 30)    // reserved, not committed
+#define MAX_RESERVED            16
+
+LXBootInfo bootInfo;
+int partitionIndex;
+HostCounters hostCounters;
+bool hostVerbose = false;
+
+static int image = -1;
+static uint8_t *arena;
+static uint64_t arenaTop;
+static uint64_t arenaMark;
+
+static struct {
+    uint64_t base;
+    uint64_t size;
+} reserved[MAX_RESERVED];
+static int reservedCount = 0;
+
+/*
+ * hostOpen(): opens the disk image that sector reads come from
+ * params: path - path of the image
+ * returns: zero on success, -1 on failure
+ */
+
+int hostOpen(const char *path) {
+    image = open(path, O_RDONLY);
+    if(image < 0) return -1;
+
+    arena = mmap(NULL, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if(arena == MAP_FAILED) return -1;
+
+    arenaTop = 0;
+    arenaMark = 0;
+    bootInfo.bootDevice = 0x80;
+    return 0;
+}
+
+/*
+ * hostFindPartition(): picks the first LXFS partition of the image
+ * returns: partition index, -1 if there is none
+ */
+
+int hostFindPartition() {
+    uint8_t mbr[512];
+    if(pread(image, mbr, 512, 0) != 512) return -1;
+
+    for(int i = 0; i < 4; i++) {
+        MBRPartition *partition = (MBRPartition *)(mbr + MBR_PARTITION_OFFSET) + i;
+        if(partition->id == MBR_ID_LXFS && partition->start) {
+            memcpy(&bootInfo.partition, partition, sizeof(MBRPartition));
+            partitionIndex = i;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/*
+ * hostArenaMark(): remembers how much of the arena is in use
+ * params: none
+ * returns: nothing
+ */
+
+void hostArenaMark() {
+    arenaMark = arenaTop;
+}
+
+/*
+ * hostArenaReset(): frees everything allocated since hostArenaMark(), so
+ * benchmarks that allocate on every iteration don't run out of memory
+ * params: none
+ * returns: nothing
+ */
+
+void hostArenaReset() {
+    arenaTop = arenaMark;
+}
+
+/*
+ * hostTime(): monotonic time in nanoseconds
+ */
+
+uint64_t hostTime() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000000) + ts.tv_nsec;
+}
+
+/* the rest replaces loader functions, under the names the core links to */
+
+int readSectors(void *dst, uint32_t lba, int count, uint8_t disk) {
+    ssize_t size = (ssize_t)count * 512;
+    ssize_t done = pread(image, dst, size, (off_t)lba * 512);
+    if(done < 0) {
+        fprintf(stderr, "host: failed to read %d sectors at LBA %u\n", count, lba);
+        exit(2);
+    }
+
+    // past the end of the image reads as zeroes, like an unwritten disk
+    if(done < size) memset((uint8_t *)dst + done, 0, size - done);
+
+    hostCounters.sectors += count;
+    hostCounters.reads++;
+    return count;
+}
+
+uint32_t getPartitionStart(uint8_t disk, int partition) {
+    uint8_t mbr[512];
+    readSectors(mbr, 0, 1, disk);
+    MBRPartition *partitions = (MBRPartition *)(mbr + MBR_PARTITION_OFFSET);
+    return partitions[partition % 4].start;
+}
+
+uint8_t diskTraceSource(uint8_t source) {
+    return DISK_TRACE_OTHER;
+}
+
+uint64_t allocAligned(uint64_t size, uint64_t alignment, uint32_t type) {
+    uint64_t start = (arenaTop + alignment - 1) & ~(alignment - 1);
+    size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+    if(start + size > ARENA_SIZE) return 0;
+
+    arenaTop = start + size;
+    hostCounters.pages += size / PAGE_SIZE;
+    return (uintptr_t)arena + start;
+}
+
+void *allocPages(size_t count, uint32_t type) {
+    uint64_t addr = allocAligned(count * PAGE_SIZE, PAGE_SIZE, type);
+    if(!addr) {
+        fprintf(stderr, "host: arena is out of memory\n");
+        exit(2);
+    }
+
+    return (void *)(uintptr_t)addr;
+}
+
+bool allocReserve(uint64_t base, uint64_t size, uint32_t type) {
+    // the kernel is loaded at its physical address, so map exactly that
+    for(int i = 0; i < reservedCount; i++) {
+        if(base >= reserved[i].base && (base + size) <= (reserved[i].base + reserved[i].size)) return true;
+    }
+
+    if(reservedCount >= MAX_RESERVED) return false;
+
+    void *addr = mmap((void *)(uintptr_t)base, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if(addr == MAP_FAILED) return false;
+
+    reserved[reservedCount].base = base;
+    reserved[reservedCount].size = size;
+    reservedCount++;
+    return true;
+}
+
+void consolePutchar(char c) {
+    if(hostVerbose) putchar(c);
+}
+
+void consoleFlush() {
+    if(hostVerbose) fflush(stdout);
+}
+
+void halt() {
+    fflush(stdout);
+    fprintf(stderr, "host: the loader halted\n");
+    exit(2);
+}
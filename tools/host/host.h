@@ -0,0 +1,70 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* Host build of the loader's C core */
+/* the core is built for Linux with every symbol prefixed with lx_, so its
+ * libc doesn't collide with the host's; these macros give the loader's own
+ * headers the prefixed names */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* what the host provides to the core, see host.c */
+#define bootInfo                lx_bootInfo
+#define partitionIndex          lx_partitionIndex
+#define readSectors             lx_readSectors
+#define getPartitionStart       lx_getPartitionStart
+#define diskTraceSource         lx_diskTraceSource
+#define allocPages              lx_allocPages
+#define allocAligned            lx_allocAligned
+#define allocReserve            lx_allocReserve
+#define consolePutchar          lx_consolePutchar
+#define consoleFlush            lx_consoleFlush
+#define halt                    lx_halt
+
+/* what the core provides to the host */
+#define lxfsInit                lx_lxfsInit
+#define lxfsFindPath            lx_lxfsFindPath
+#define lxfsRead                lx_lxfsRead
+#define lxfsSize                lx_lxfsSize
+#define lxfsExtents             lx_lxfsExtents
+#define lxfsList                lx_lxfsList
+#define lxfsBufferSize          lx_lxfsBufferSize
+#define loadELF                 lx_loadELF
+#define loadConfig              lx_loadConfig
+#define selectBootOption        lx_selectBootOption
+#define indexRamdisk            lx_indexRamdisk
+#define memVariant              lx_memVariant
+
+#include "../../src/include/lxboot.h"
+#include "../../src/include/elf.h"
+#include "../../src/include/string.h"
+
+/* the core's libc, which can't go through the macros above */
+void *lx_memcpy(void *, const void *, size_t);
+void *lx_memset(void *, int, size_t);
+int lx_memcmp(const void *, const void *, size_t);
+void *lx_memmove(void *, const void *, size_t);
+
+/* disk image and counters */
+typedef struct {
+    uint64_t sectors;           // read through readSectors()
+    uint64_t reads;             // calls to readSectors()
+    uint64_t pages;             // allocated through allocPages() and allocAligned()
+} HostCounters;
+
+extern HostCounters hostCounters;
+extern bool hostVerbose;
+
+int hostOpen(const char *);
+int hostFindPartition();
+void hostArenaMark();
+void hostArenaReset();
+uint64_t hostTime();
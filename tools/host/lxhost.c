@@ -0,0 +1,328 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* Tests and microbenchmarks for the loader's C core on the host */
+/* each benchmark checks its result first and is then timed over a number of
+ * iterations; the sector and call counts per iteration are exact, because
+ * every read goes through readSectors() in host.c */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host.h"
+
+#define DEFAULT_ITERATIONS      1000
+#define MAX_EXTENTS             4096
+#define MEMORY_BYTES            (256ULL << 20)  // moved per memory benchmark
+#define MEMORY_CHECKED          (4 * 256)       // lengths checked one by one
+
+typedef struct {
+    const char *path;           // file under test
+    void *buffer;               // for reads and ELF loading
+    DiskExtent *extents;
+    const char *config;
+} Context;
+
+typedef bool (*Benchmark)(Context *);
+
+static int failures = 0;
+
+static bool benchConfig(Context *context) {
+    if(loadConfig(context->config) < 1) return false;
+    BootConfig *option = selectBootOption(0);
+    return option && option->kernel[0];
+}
+
+static bool benchLookup(Context *context) {
+    LXFSDirectoryEntry entry;
+    return lxfsFindPath(bootInfo.bootDevice, partitionIndex, context->path, &entry);
+}
+
+static bool benchChain(Context *context) {
+    return lxfsExtents(bootInfo.bootDevice, partitionIndex, context->path, context->extents, MAX_EXTENTS) > 0;
+}
+
+static bool benchRead(Context *context) {
+    return lxfsRead(bootInfo.bootDevice, partitionIndex, context->path, context->buffer);
+}
+
+static bool benchELF(Context *context) {
+    uint64_t highest;
+    return loadELF(context->buffer, &highest) != 0;
+}
+
+static void run(const char *name, Benchmark benchmark, Context *context, int iterations) {
+    // one checked run, then the timed ones
+    hostArenaReset();
+    if(!benchmark(context)) {
+        printf("%-8s FAILED on %s\n", name, context->path ? context->path : context->config);
+        failures++;
+        return;
+    }
+
+    memset(&hostCounters, 0, sizeof(HostCounters));
+    uint64_t start = hostTime();
+    for(int i = 0; i < iterations; i++) {
+        hostArenaReset();
+        benchmark(context);
+    }
+
+    uint64_t elapsed = hostTime() - start;
+    printf("%-8s %8d %12.3f %10.2f %10.2f %10.2f\n", name, iterations,
+        (double)elapsed / iterations / 1000.0,
+        (double)hostCounters.sectors / iterations,
+        (double)hostCounters.reads / iterations,
+        (double)hostCounters.pages / iterations);
+}
+
+// the archives in /ramdisks are indexed and the index is compared with the
+// entries listed for them, see tools/mkfixture.py
+static bool checkRamdisk(const char *path, int count, char **lines) {
+    size_t size = lxfsSize(bootInfo.bootDevice, partitionIndex, path);
+    void *archive = aligned_alloc(PAGE_SIZE, lxfsBufferSize(size));
+    if(!size || !lxfsRead(bootInfo.bootDevice, partitionIndex, path, archive)) {
+        free(archive);
+        return false;
+    }
+
+    uint64_t table;
+    uint8_t format;
+    hostArenaReset();
+    int indexed = indexRamdisk(archive, size, &table, &format);
+    bool passed = indexed == count;
+    if(!passed) printf("%-8s %s has %d entries, expected %d\n", "", path, indexed, count);
+
+    RamdiskIndexEntry *entries = (RamdiskIndexEntry *)(uintptr_t)table;
+    for(int i = 0; passed && i < count; i++) {
+        const char *name = (const char *)(uintptr_t)entries[i].name;
+        const char *target = name + strlen(name) + 1;
+        bool link = (entries[i].mode & 0170000) == 0120000;
+
+        char expected[1024];
+        snprintf(expected, sizeof(expected), "%lu %s%s%s", entries[i].size, name, link ? " " : "", link ? target : "");
+        if(strcmp(expected, lines[i])) {
+            printf("%-8s %s: indexed \"%s\", expected \"%s\"\n", "", path, expected, lines[i]);
+            passed = false;
+        }
+    }
+
+    free(archive);
+    return passed;
+}
+
+static void runRamdisks() {
+    size_t size = lxfsSize(bootInfo.bootDevice, partitionIndex, "/ramdisks");
+    if(!size) return;
+
+    char *list = aligned_alloc(PAGE_SIZE, lxfsBufferSize(size) + 1);
+    lxfsRead(bootInfo.bootDevice, partitionIndex, "/ramdisks", list);
+    list[size] = 0;
+
+    char *lines[256];
+    int lineCount = 0;
+    for(char *line = strtok(list, "\n"); line && lineCount < 256; line = strtok(NULL, "\n")) {
+        lines[lineCount++] = line;
+    }
+
+    printf("\n");
+    for(int i = 0; i < lineCount; i++) {
+        char path[256];
+        int count;
+        if(sscanf(lines[i], "%255s %d", path, &count) != 2 || count < 0 || i + 1 + count > lineCount) break;
+
+        if(checkRamdisk(path, count, lines + i + 1)) {
+            printf("%-8s %s, %d entries\n", "ramdisk", path, count);
+        } else {
+            printf("%-8s FAILED on %s\n", "ramdisk", path);
+            failures++;
+        }
+
+        i += count;
+    }
+
+    free(list);
+}
+
+// every variant is forced in turn, then checked at every alignment of both
+// pointers within a quad with guard bytes around the destination
+static const char *memoryVariants[MEM_VARIANTS] = { "movsq", "movsb", "sse2" };
+
+static bool checkMemoryLength(const uint8_t *a, uint8_t *b, size_t n) {
+    for(int s = 0; s < 8; s++) {
+        for(int d = 0; d < 8; d++) {
+            memset(b, 0xEE, n + 32);
+            lx_memcpy(b + 8 + d, a + s, n);
+            if(memcmp(b + 8 + d, a + s, n)) return false;
+
+            uint8_t v = n | 1;
+            lx_memset(b + 8 + d, v, n);
+            for(size_t i = 0; i < n; i++) {
+                if(b[8 + d + i] != v) return false;
+            }
+
+            for(size_t i = 0; i < 8 + d; i++) {
+                if(b[i] != 0xEE) return false;
+            }
+
+            for(size_t i = 8 + d + n; i < n + 32; i++) {
+                if(b[i] != 0xEE) return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+static bool checkMemory(const uint8_t *a, uint8_t *b) {
+    static const size_t lengths[] = { 4096, 4099, 65536 + 13 };
+
+    // past a few SSE2 blocks, so every head and tail length is covered
+    for(size_t n = 0; n < MEMORY_CHECKED; n++) {
+        if(!checkMemoryLength(a, b, n)) {
+            printf("%-8zu memcpy or memset FAILED\n", n);
+            return false;
+        }
+    }
+
+    for(int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        if(!checkMemoryLength(a, b, lengths[i])) {
+            printf("%-8zu memcpy or memset FAILED\n", lengths[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static void runMemory() {
+    static const size_t sizes[] = { 64, 512, 4096, 65536, 1048576 };
+    uint8_t *a = aligned_alloc(PAGE_SIZE, 1048576 + PAGE_SIZE);
+    uint8_t *b = aligned_alloc(PAGE_SIZE, 1048576 + PAGE_SIZE);
+    for(size_t i = 0; i < 1048576 + PAGE_SIZE; i++) a[i] = (i * 7) + (i >> 8);
+
+    printf("\n%-8s %8s %12s %12s %12s\n", "size", "variant", "memcpy MB/s", "memset MB/s", "memcmp MB/s");
+    for(int v = 0; v < MEM_VARIANTS; v++) {
+        memVariant(v);
+        if(!checkMemory(a, b)) {
+            printf("%-8s %8s FAILED\n", "", memoryVariants[v]);
+            failures++;
+            continue;
+        }
+
+        for(int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            uint64_t rounds = MEMORY_BYTES / sizes[i];
+            double mb = (double)MEMORY_BYTES / 1048576.0;
+
+            uint64_t start = hostTime();
+            for(uint64_t r = 0; r < rounds; r++) lx_memcpy(b, a, sizes[i]);
+            double copy = (double)(hostTime() - start) / 1e9;
+
+            start = hostTime();
+            for(uint64_t r = 0; r < rounds; r++) lx_memset(b, r, sizes[i]);
+            double set = (double)(hostTime() - start) / 1e9;
+
+            lx_memcpy(b, a, sizes[i]);
+            int same = 0;
+            start = hostTime();
+            for(uint64_t r = 0; r < rounds; r++) same += !lx_memcmp(b, a, sizes[i]);
+            double compare = (double)(hostTime() - start) / 1e9;
+
+            if(same != rounds) {
+                printf("%-8zu memcmp FAILED\n", sizes[i]);
+                failures++;
+            }
+
+            printf("%-8zu %8s %12.0f %12.0f %12.0f\n", sizes[i], memoryVariants[v], mb / copy, mb / set, mb / compare);
+        }
+    }
+
+    memVariant(MEM_VARIANT_QUAD);
+    free(a);
+    free(b);
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-n iterations] [-c config] [-v] image [file...]\n", name);
+    fprintf(stderr, "without files, the kernel and ramdisk of the first boot option are used\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int iterations = DEFAULT_ITERATIONS;
+    const char *config = "/lxboot.conf";
+    int i = 1;
+
+    for(; i < argc && argv[i][0] == '-'; i++) {
+        if(!strcmp(argv[i], "-n") && i + 1 < argc) iterations = atoi(argv[++i]);
+        else if(!strcmp(argv[i], "-c") && i + 1 < argc) config = argv[++i];
+        else if(!strcmp(argv[i], "-v")) hostVerbose = true;
+        else usage(argv[0]);
+    }
+
+    if(i >= argc || iterations < 1) usage(argv[0]);
+
+    if(hostOpen(argv[i])) {
+        fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[i]);
+        return 1;
+    }
+
+    if(hostFindPartition() < 0) {
+        fprintf(stderr, "%s: no LXFS partition in %s\n", argv[0], argv[i]);
+        return 1;
+    }
+
+    lxfsInit();
+    hostArenaMark();
+
+    Context context;
+    memset(&context, 0, sizeof(Context));
+    context.config = config;
+    context.extents = malloc(MAX_EXTENTS * sizeof(DiskExtent));
+
+    printf("%-8s %8s %12s %10s %10s %10s\n", "", "runs", "us/run", "sectors", "reads", "pages");
+    run("config", benchConfig, &context, iterations);
+
+    // the files to test with, from the command line or from the config
+    char kernel[CONFIG_MAX_KERNEL] = "";
+    char ramdisk[CONFIG_MAX_KERNEL] = "";
+    const char *files[64];
+    int fileCount = 0;
+
+    for(i++; i < argc && fileCount < 64; i++) files[fileCount++] = argv[i];
+
+    if(!fileCount && !failures) {
+        hostArenaReset();
+        loadConfig(config);
+        BootConfig *option = selectBootOption(0);
+        strcpy(kernel, option->kernel);
+        strcpy(ramdisk, option->ramdisk);
+        files[fileCount++] = kernel;
+        if(ramdisk[0]) files[fileCount++] = ramdisk;
+    }
+
+    for(int f = 0; f < fileCount; f++) {
+        context.path = files[f];
+        size_t size = lxfsSize(bootInfo.bootDevice, partitionIndex, context.path);
+        context.buffer = aligned_alloc(PAGE_SIZE, lxfsBufferSize(size));
+
+        printf("\n%s, %zu bytes\n", context.path, size);
+        run("lookup", benchLookup, &context, iterations);
+        run("chain", benchChain, &context, iterations);
+        run("read", benchRead, &context, iterations);
+
+        // only executables get loaded
+        if(size >= 4 && !memcmp(context.buffer, "\x7F" "ELF", 4)) run("elf", benchELF, &context, iterations);
+
+        free(context.buffer);
+    }
+
+    runRamdisks();
+    runMemory();
+
+    if(failures) printf("\n%d failed\n", failures);
+    return failures ? 1 : 0;
+}
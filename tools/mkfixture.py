@@ -0,0 +1,273 @@
+#!/usr/bin/env python3
+
+# lux - a lightweight unix-like operating system
+# Omar Elghoul, 2024
+#
+# Boot loader for x86_64
+# mkfixture.py: Build a small bootable disk image for the host tools
+
+"""
+Writes a disk image with one LXFS partition holding a boot configuration, a
+minimal kernel that only spins, a ramdisk and two modules, laid out the way
+the loader reads them. It needs nothing but Python, so that 'make check' can
+run the host build and the boot simulator on it without a real LXFS volume.
+
+Next to the ramdisk, which is a ustar archive, there are a GNU tar archive and
+a truncated cpio archive, and /ramdisks lists what the loader should index in
+each of them: a line with the path and the number of entries, then one line
+per entry in sorted order with its size, its name and the target of links.
+
+usage: mkfixture.py fixture.img [--block-size SECTORS] [--loader lxboot.bin]
+"""
+
+import argparse
+import io
+import struct
+import sys
+import tarfile
+
+MBR_PARTITION_OFFSET = 446
+MBR_FLAG_BOOTABLE = 0x80
+MBR_ID_LXFS = 0xF3
+LXFS_MAGIC = 0x5346584C
+LXFS_VERSION = 0x01
+LXFS_ID_BOOTABLE = 0x01
+LXFS_ID_BLOCK_SIZE_SHIFT = 3
+LXFS_BLOCK_ID = 0xFFFFFFFFFFFFFFFC
+LXFS_BLOCK_BOOT = 0xFFFFFFFFFFFFFFFD
+LXFS_BLOCK_TABLE = 0xFFFFFFFFFFFFFFFE
+LXFS_BLOCK_EOF = 0xFFFFFFFFFFFFFFFF
+LXFS_BOOT_BLOCKS = 32
+LXFS_TABLE_START = 33
+LXFS_DIR_VALID = 0x0001
+LXFS_DIR_TYPE_FILE = 0
+LXFS_ENTRY_HEADER = 64
+
+PARTITION_START = 64            # sectors
+VOLUME_BLOCKS = 1024
+KERNEL_BASE = 0x200000
+
+CONFIG = """[entry]
+name lux
+disk boot
+kernel /kernel
+ramdisk /ramdisk
+module /module.a
+module /module.b
+preload /
+boot
+"""
+
+
+def kernel():
+    """an ELF executable with one segment, whose entry point is 'jmp $'"""
+    code = b"\xEB\xFE"
+    data = bytes([7]) * 20000   # long enough to cross several blocks
+    size = 0x1000 + len(code) + len(data)
+
+    header = struct.pack("<4sBBBB8sHHIQQQIHHHHHH", b"\x7FELF", 2, 1, 1, 0, bytes(8),
+        2, 0x3E, 1, KERNEL_BASE + 0x1000, 64, 0, 0, 64, 56, 1, 64, 0, 0)
+    segment = struct.pack("<IIQQQQQQ", 1, 7, 0, KERNEL_BASE, KERNEL_BASE, size, size + 0x4000, 0x1000)
+
+    image = header + segment
+    return image + bytes(0x1000 - len(image)) + code + data
+
+
+def tarArchive(format, members):
+    """members are (name, data) for files and (name, None, target) for links"""
+    buffer = io.BytesIO()
+    archive = tarfile.open(fileobj=buffer, mode="w", format=format)
+    for member in members:
+        info = tarfile.TarInfo(member[0])
+        info.mtime = 0
+        if member[1] is None:
+            info.type = tarfile.SYMTYPE
+            info.linkname = member[2]
+            archive.addfile(info)
+        else:
+            info.size = len(member[1])
+            archive.addfile(info, io.BytesIO(member[1]))
+
+    archive.close()
+    return buffer.getvalue()
+
+
+def cpioArchive(members):
+    """a newc archive with a trailer"""
+    data = b""
+    for inode, (name, content, mode) in enumerate(members + [("TRAILER!!!", b"", 0)]):
+        encoded = name.encode() + b"\0"
+        fields = [inode + 1, mode, 0, 0, 1, 0, len(content), 0, 0, 0, 0, len(encoded), 0]
+        data += b"070701" + b"".join(b"%08X" % field for field in fields) + encoded
+        data += bytes(-len(data) & 3) + content
+        data += bytes(-len(data) & 3)
+
+    return data
+
+
+def ramdisks():
+    """the archives to index with what the loader should make of them"""
+    longDirectory = "usr/share/lux/" + ("d" * 70) + "/" + ("e" * 40)
+    ustar = [
+        ("etc/motd", b"welcome to lux\n"),
+        (longDirectory + "/readme.txt", b"r" * 1000),
+        (longDirectory + "/empty", b""),
+        ("usr/lib/" + ("l" * 95) + "/libc.so", None, "libc.so.1"),
+    ]
+
+    longName = "opt/" + ("n" * 120) + "/file"
+    longTarget = "/opt/" + ("t" * 130) + "/target"
+    gnu = [
+        ("bin/init", b"i" * 700),
+        (longName, b"g" * 3000),
+        ("bin/sh", None, longTarget),
+        ("opt/" + ("s" * 110) + "/link", None, longTarget),
+    ]
+
+    # cut in the middle of the last file, which must not be indexed
+    cpioMembers = [
+        ("init", b"c" * 100, 0o100755),
+        ("bin/tool", b"t" * 3000, 0o100755),
+        ("etc/big", b"b" * 5000, 0o100644),
+    ]
+    cpio = cpioArchive(cpioMembers)
+    cpio = cpio[:cpio.index(b"b" * 5000) + 2500]
+
+    def expected(members):
+        return sorted((member[0], len(member[1]) if member[1] is not None else 0,
+            member[2] if member[1] is None else None) for member in members)
+
+    return [
+        ("ramdisk", tarArchive(tarfile.USTAR_FORMAT, ustar), expected(ustar)),
+        ("ramdisk.gnu", tarArchive(tarfile.GNU_FORMAT, gnu), expected(gnu)),
+        ("ramdisk.cpio", cpio, [(name, len(content), None) for name, content, mode in sorted(cpioMembers[:2])]),
+    ]
+
+
+class Volume:
+    """an LXFS volume built in memory, with the root directory in one block"""
+
+    def __init__(self, blockSize, blocks):
+        self.blockSize = blockSize
+        self.blockBytes = blockSize * 512
+        self.blocks = [bytes(self.blockBytes)] * blocks
+        self.table = [0] * blocks
+
+        perTable = self.blockBytes // 8
+        self.tableBlocks = (blocks + perTable - 1) // perTable
+
+        self.table[0] = LXFS_BLOCK_ID
+        for i in range(1, LXFS_TABLE_START):
+            self.table[i] = LXFS_BLOCK_BOOT
+        for i in range(LXFS_TABLE_START, LXFS_TABLE_START + self.tableBlocks):
+            self.table[i] = LXFS_BLOCK_TABLE
+
+        self.next = LXFS_TABLE_START + self.tableBlocks
+
+    def allocate(self, count):
+        # contiguous, like a freshly formatted volume
+        if self.next + count > len(self.blocks):
+            sys.exit("mkfixture: volume is full")
+
+        first = self.next
+        self.next += count
+        for i in range(first, first + count - 1):
+            self.table[i] = i + 1
+        self.table[first + count - 1] = LXFS_BLOCK_EOF
+        return first
+
+    def file(self, data):
+        # the loader skips the first block of a file, data starts in the next
+        count = (len(data) + self.blockBytes - 1) // self.blockBytes
+        first = self.allocate(1 + count)
+        for i in range(count):
+            chunk = data[i * self.blockBytes:(i + 1) * self.blockBytes]
+            self.blocks[first + 1 + i] = chunk + bytes(self.blockBytes - len(chunk))
+        return first
+
+    def directory(self, entries):
+        header = struct.pack("<QQQQQQ", 0, 0, 0, len(entries), 0, 0)
+        data = header
+        for name, type, size, block in entries:
+            encoded = name.encode() + b"\0"
+            entrySize = (LXFS_ENTRY_HEADER + len(encoded) + 15) & ~15
+            flags = LXFS_DIR_VALID | (type << 1)
+            data += struct.pack("<HHHHQQQQQH14s", flags, 0, 0, 0x1ED, size, 0, 0, 0, block, entrySize, bytes(14))
+            data += encoded + bytes(entrySize - LXFS_ENTRY_HEADER - len(encoded))
+
+        if len(data) > self.blockBytes:
+            sys.exit("mkfixture: directory doesn't fit in one block")
+
+        block = self.allocate(1)
+        self.blocks[block] = data + bytes(self.blockBytes - len(data))
+        return block
+
+    def image(self, root, loader):
+        parameters = LXFS_ID_BOOTABLE | ((self.blockSize - 1) << LXFS_ID_BLOCK_SIZE_SHIFT)
+        id = struct.pack("<4sIQQBB16s6s", b"\xEB\x3C\x00\x00", LXFS_MAGIC, len(self.blocks), root,
+            parameters, LXFS_VERSION, b"fixture", bytes(6))
+        self.blocks[0] = id + bytes(self.blockBytes - len(id))
+
+        if loader:
+            if len(loader) > LXFS_BOOT_BLOCKS * self.blockBytes:
+                sys.exit("mkfixture: loader doesn't fit in %d blocks of %d sectors" % (LXFS_BOOT_BLOCKS, self.blockSize))
+            for i in range(0, len(loader), self.blockBytes):
+                chunk = loader[i:i + self.blockBytes]
+                self.blocks[1 + (i // self.blockBytes)] = chunk + bytes(self.blockBytes - len(chunk))
+
+        table = b"".join(struct.pack("<Q", entry) for entry in self.table)
+        table += bytes((self.tableBlocks * self.blockBytes) - len(table))
+        for i in range(self.tableBlocks):
+            self.blocks[LXFS_TABLE_START + i] = table[i * self.blockBytes:(i + 1) * self.blockBytes]
+
+        return b"".join(self.blocks)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="build a disk image for the host tools")
+    parser.add_argument("image", help="file to write")
+    parser.add_argument("--block-size", type=int, default=4, help="sectors per block, 4 by default")
+    parser.add_argument("--loader", help="lxboot.bin to place in the boot blocks")
+    args = parser.parse_args()
+
+    if args.block_size < 1 or args.block_size > 16:
+        sys.exit("mkfixture: blocks are 1 to 16 sectors")
+
+    loader = open(args.loader, "rb").read() if args.loader else None
+    volume = Volume(args.block_size, VOLUME_BLOCKS)
+
+    files = [
+        ("lxboot.conf", CONFIG.encode()),
+        ("kernel", kernel()),
+        ("module.a", b"module a\n" * 100),
+        ("module.b", b"module b\n" * 700),
+    ]
+
+    manifest = ""
+    for name, data, entries in ramdisks():
+        files.append((name, data))
+        manifest += "/%s %d\n" % (name, len(entries))
+        for entry, size, target in entries:
+            manifest += "%d %s%s\n" % (size, entry, " " + target if target else "")
+
+    files.append(("ramdisks", manifest.encode()))
+
+    entries = [(name, LXFS_DIR_TYPE_FILE, len(data), volume.file(data)) for name, data in files]
+    root = volume.directory(entries)
+
+    sectors = PARTITION_START + (VOLUME_BLOCKS * args.block_size)
+    mbr = bytearray(512)
+    struct.pack_into("<B3sB3sII", mbr, MBR_PARTITION_OFFSET, MBR_FLAG_BOOTABLE, b"\xFF\xFF\xFF",
+        MBR_ID_LXFS, b"\xFF\xFF\xFF", PARTITION_START, VOLUME_BLOCKS * args.block_size)
+    mbr[510:512] = b"\x55\xAA"
+
+    with open(args.image, "wb") as image:
+        image.write(bytes(mbr) + bytes((PARTITION_START - 1) * 512))
+        image.write(volume.image(root, loader))
+
+    print("%s: %d sectors, blocks of %d sectors" % (args.image, sectors, args.block_size))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
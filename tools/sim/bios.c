@@ -0,0 +1,472 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* Emulated BIOS services */
+/* every call the core makes arrives here through the batch routine of the
+ * boot info, exactly as it would be queued for real mode, so the counts are
+ * the ones the real loader would produce on a machine with the same disk,
+ * memory, and display */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+
+#define SIM_ROM_OEM             0x0000      // offsets into SIM_ROM
+#define SIM_ROM_MODES           0x0100
+#define SIM_ROM_FONT            0x1000
+
+#define STATUS_UNSUPPORTED      0x86
+#define VBE_SUCCESS             0x004F
+#define VBE_FAILURE             0x014F
+
+BIOSCall simRegisters;                  // the one-entry queue of the *API routines
+SimCounters counters;
+
+static MemoryMap e820[4];
+static int e820Count = 0;
+static uint8_t edid[VBE_EDID_SIZE];
+
+/*
+ * simAddress(): translates a real mode far pointer
+ * the loader's static buffers are in the simulator's image rather than below
+ * 64 KiB, so the offset is taken as 32 bits where a BIOS would only see 16
+ * params: segment - segment
+ * params: offset - offset
+ * returns: pointer to the memory
+ */
+
+void *simAddress(uint16_t segment, uint32_t offset) {
+    return (void *)(uintptr_t)(((uint32_t)segment << 4) + offset);
+}
+
+static SimService *service(uint8_t vector, uint8_t function) {
+    // kept in order so the report is always the same
+    int i;
+    for(i = 0; i < counters.serviceCount; i++) {
+        SimService *s = &counters.services[i];
+        if(s->vector == vector && s->function == function) return s;
+        if(s->vector > vector || (s->vector == vector && s->function > function)) break;
+    }
+
+    if(counters.serviceCount >= SIM_MAX_SERVICES) {
+        fprintf(stderr, "lxsim: too many different BIOS functions\n");
+        exit(3);
+    }
+
+    memmove(&counters.services[i + 1], &counters.services[i], (counters.serviceCount - i) * sizeof(SimService));
+    memset(&counters.services[i], 0, sizeof(SimService));
+    counters.services[i].vector = vector;
+    counters.services[i].function = function;
+    counters.serviceCount++;
+    return &counters.services[i];
+}
+
+static bool setStatus(CPURegisters *regs, uint8_t status) {
+    // AH and the carry flag, as most BIOS functions return them
+    regs->eax = (regs->eax & 0xFFFF00FF) | ((uint32_t)status << 8);
+    if(status) regs->eflags |= 1;
+    else regs->eflags &= ~1;
+    return true;
+}
+
+static void setAX(CPURegisters *regs, uint16_t ax) {
+    regs->eax = (regs->eax & 0xFFFF0000) | ax;
+}
+
+static SimMode *findMode(uint16_t number) {
+    for(int i = 0; i < machine.modeCount; i++) {
+        if(machine.modes[i].number == number) return &machine.modes[i];
+    }
+
+    return NULL;
+}
+
+static void colorMasks(uint8_t bpp, uint8_t *masks) {
+    // red, green, and blue as size and position, then the reserved bits
+    static const uint8_t direct[4][8] = {
+        { 5, 10, 5, 5, 5, 0, 1, 15 },       // 15 bpp
+        { 5, 11, 6, 5, 5, 0, 0, 0 },        // 16 bpp
+        { 8, 16, 8, 8, 8, 0, 0, 0 },        // 24 bpp
+        { 8, 16, 8, 8, 8, 0, 8, 24 },       // 32 bpp
+    };
+
+    memset(masks, 0, 8);
+    if(bpp == 15) memcpy(masks, direct[0], 8);
+    else if(bpp == 16) memcpy(masks, direct[1], 8);
+    else if(bpp == 24) memcpy(masks, direct[2], 8);
+    else if(bpp == 32) memcpy(masks, direct[3], 8);
+}
+
+static void modeInfo(SimMode *mode, VBEMode *info) {
+    uint8_t masks[8];
+    colorMasks(mode->bpp, masks);
+
+    memset(info, 0, sizeof(VBEMode));
+    info->attributes = VBE_MODE_SUPPORTED | 0x0002 | 0x0008 | VBE_MODE_GRAPHICS | VBE_MODE_LINEAR_FB;
+    info->window[0] = 0x07;
+    info->granularity = 64;
+    info->windowSize = 64;
+    info->segment[0] = 0xA000;
+    info->pitch = mode->width * ((mode->bpp + 7) / 8);
+    info->width = mode->width;
+    info->height = mode->height;
+    info->xChar = 8;
+    info->yChar = 16;
+    info->planes = 1;
+    info->bpp = mode->bpp;
+    info->bankCount = 1;
+    info->memoryModel = (mode->bpp == 8) ? 4 : VBE_MEMORY_DIRECT;
+    info->imagePages = (SIM_FRAMEBUFFER_SIZE / ((uint32_t)info->pitch * mode->height)) - 1;
+
+    info->redMask = masks[0];
+    info->redPosition = masks[1];
+    info->greenMask = masks[2];
+    info->greenPosition = masks[3];
+    info->blueMask = masks[4];
+    info->bluePosition = masks[5];
+    info->reservedMask = masks[6];
+    info->reservedPosition = masks[7];
+    info->framebuffer = SIM_FRAMEBUFFER;
+
+    info->linearPitch = info->pitch;
+    info->linearImagePages = info->imagePages;
+    info->linearRedMask = masks[0];
+    info->linearRedPosition = masks[1];
+    info->linearGreenMask = masks[2];
+    info->linearGreenPosition = masks[3];
+    info->linearBlueMask = masks[4];
+    info->linearBluePosition = masks[5];
+    info->linearReservedMask = masks[6];
+    info->linearReservedPosition = masks[7];
+    info->maxPixelClock = 148500000;
+}
+
+static bool vbe(CPURegisters *regs) {
+    uint8_t al = regs->eax & 0xFF;
+    SimMode *mode;
+
+    switch(al) {
+    case 0x00: {
+        VBEController *controller = simAddress(regs->es, regs->edi);
+        memcpy(controller->signature, "VESA", 4);
+        controller->version = 0x300;
+        controller->oemOffset = SIM_ROM_OEM;
+        controller->oemSegment = SIM_ROM >> 4;
+        controller->capabilities = 0;
+        controller->modeOffset = SIM_ROM_MODES;
+        controller->modeSegment = SIM_ROM >> 4;
+        controller->memory = SIM_FRAMEBUFFER_SIZE >> 16;
+        setAX(regs, VBE_SUCCESS);
+        return true;
+    }
+
+    case 0x01:
+        mode = findMode(regs->ecx & 0x01FF);
+        if(!mode) {
+            setAX(regs, VBE_FAILURE);
+            return true;
+        }
+
+        modeInfo(mode, simAddress(regs->es, regs->edi));
+        setAX(regs, VBE_SUCCESS);
+        return true;
+
+    case 0x02:
+        // only the linear framebuffer exists here
+        mode = findMode(regs->ebx & 0x01FF);
+        if(!mode || !(regs->ebx & VBE_ENABLE_LINEAR_FB)) {
+            setAX(regs, VBE_FAILURE);
+            return true;
+        }
+
+        setAX(regs, VBE_SUCCESS);
+        return true;
+
+    case 0x15:
+        if((regs->ebx & 0xFF) == 0x00) {
+            regs->ebx = (regs->ebx & 0xFFFF0000) | 0x0102;  // DDC2, one second per block
+            setAX(regs, machine.edid ? VBE_SUCCESS : VBE_FAILURE);
+            return true;
+        }
+
+        if((regs->ebx & 0xFF) != 0x01 || !machine.edid) {
+            setAX(regs, VBE_FAILURE);
+            return true;
+        }
+
+        memcpy(simAddress(regs->es, regs->edi), edid, VBE_EDID_SIZE);
+        setAX(regs, VBE_SUCCESS);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+static bool video(CPURegisters *regs) {
+    uint8_t ah = (regs->eax >> 8) & 0xFF;
+    uint8_t al = regs->eax & 0xFF;
+
+    switch(ah) {
+    case 0x0E:
+        if(machine.verbose) putchar(al);
+        return true;
+
+    case 0x11:
+        // the 8x16 font, returned in es:bp
+        if(al != 0x30 || ((regs->ebx >> 8) & 0xFF) != 0x06) return false;
+        regs->es = SIM_ROM >> 4;
+        regs->ebp = SIM_ROM_FONT;
+        regs->ecx = 16;
+        regs->edx = (regs->edx & 0xFFFFFF00) | 24;
+        return true;
+
+    case 0x4F:
+        return vbe(regs);
+
+    default:
+        return false;
+    }
+}
+
+static bool disk(CPURegisters *regs, SimService *s) {
+    uint8_t ah = (regs->eax >> 8) & 0xFF;
+    if((regs->edx & 0xFF) != machine.disk) return setStatus(regs, 0x01);
+
+    switch(ah) {
+    case 0x00:
+        return setStatus(regs, 0x00);
+
+    case 0x41:
+        if((regs->ebx & 0xFFFF) != 0x55AA) return setStatus(regs, 0x01);
+        regs->ebx = (regs->ebx & 0xFFFF0000) | 0xAA55;
+        regs->ecx = 0x0001;     // packet structure
+        return setStatus(regs, 0x30);
+
+    case 0x42: {
+        // ds is zero in the loader, so the packet is at si
+        DiskAddressPacket *dap = simAddress(0, regs->esi);
+        if(dap->size < 16 || !dap->count || dap->count > 127) return setStatus(regs, 0x01);
+        if((dap->lba + dap->count) > machine.imageSectors) return setStatus(regs, 0x04);
+
+        size_t size = (size_t)dap->count * 512;
+        if(pread(machine.image, simAddress(dap->segment, dap->offset), size, (off_t)dap->lba * 512) != (ssize_t)size) {
+            return setStatus(regs, 0x04);
+        }
+
+        s->sectors += dap->count;
+        return setStatus(regs, 0x00);
+    }
+
+    default:
+        return false;
+    }
+}
+
+static bool misc(CPURegisters *regs) {
+    switch(regs->eax & 0xFFFF) {
+    case 0xE820: {
+        uint32_t index = regs->ebx;
+        if(regs->edx != 0x534D4150 || index >= e820Count || regs->ecx < 20) return setStatus(regs, STATUS_UNSUPPORTED);
+
+        MemoryMap *entry = simAddress(regs->es, regs->edi);
+        memcpy(entry, &e820[index], (regs->ecx < 24) ? 20 : 24);
+
+        regs->eax = 0x534D4150;
+        regs->ebx = (index + 1 < e820Count) ? index + 1 : 0;
+        regs->ecx = (regs->ecx < 24) ? 20 : 24;
+        regs->eflags &= ~1;
+        return true;
+    }
+
+    case 0xEC00:
+        // the operating mode the OS will run in, see lmode in mode.asm
+        return setStatus(regs, 0x00);
+
+    default:
+        return false;
+    }
+}
+
+static void dispatch(BIOSCall *call) {
+    CPURegisters *regs = &call->regs;
+    uint8_t function = (regs->eax >> 8) & 0xFF;
+    SimService *s = service(call->vector, function);
+    s->calls++;
+
+    regs->eflags &= ~1;
+    bool handled;
+    switch(call->vector) {
+    case 0x10:
+        handled = video(regs);
+        break;
+    case 0x13:
+        handled = disk(regs, s);
+        break;
+    case 0x15:
+        handled = misc(regs);
+        break;
+    default:
+        handled = false;
+    }
+
+    if(!handled) {
+        counters.unhandled++;
+        setStatus(regs, STATUS_UNSUPPORTED);
+    }
+
+    bool vbeFailed = (call->vector == 0x10) && (function == 0x4F) && ((regs->eax & 0xFFFF) != VBE_SUCCESS);
+    if((regs->eflags & 1) || vbeFailed) s->failed++;
+
+    call->cycles = 0;
+}
+
+/*
+ * simBatch(): the batch routine of the boot info, one visit to real mode
+ * params: queue - calls to make
+ * params: count - number of calls
+ * returns: nothing, the results are in each call's registers
+ */
+
+void simBatch(BIOSCall *queue, uint32_t count) {
+    counters.trips++;
+    if(count == 1) counters.single++;
+    if(count > counters.largest) counters.largest = count;
+
+    for(uint32_t i = 0; i < count; i++) dispatch(&queue[i]);
+}
+
+/* the single call routines, which take their registers from simRegisters */
+
+void simVideoAPI() {
+    simRegisters.vector = 0x10;
+    simBatch(&simRegisters, 1);
+}
+
+void simDiskAPI() {
+    simRegisters.vector = 0x13;
+    simBatch(&simRegisters, 1);
+}
+
+void simMiscAPI() {
+    simRegisters.vector = 0x15;
+    simBatch(&simRegisters, 1);
+}
+
+/*
+ * simLongMode(): the handoff routine of the boot info
+ * like the real one, it tells the BIOS the OS runs in long mode first
+ * params: pml4 - page tables for the kernel
+ * params: entry - kernel entry point
+ * params: k - boot info for the kernel
+ * returns: never
+ */
+
+void simLongMode(uint64_t pml4, uint64_t entry, KernelBootInfo *k) {
+    BIOSCall call;
+    memset(&call, 0, sizeof(BIOSCall));
+    call.vector = 0x15;
+    call.regs.eax = 0xEC00;
+    call.regs.ebx = 2;
+    simBatch(&call, 1);
+
+    simHandoff(pml4, entry, k);
+}
+
+static void buildEDID() {
+    memset(edid, 0, VBE_EDID_SIZE);
+    VBEMonitor *monitor = (VBEMonitor *)edid;
+
+    static const uint8_t header[8] = { 0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x00 };
+    memcpy(monitor->padding, header, 8);
+    monitor->manufacturer = 0x3A30;         // "LXS", big endian
+    monitor->id = 0x0001;
+    monitor->manufactureYear = 34;          // 2024
+    monitor->version = 1;
+    monitor->revision = 4;
+    monitor->inputType = 0xA5;              // digital, 8 bits per color, DisplayPort
+    monitor->horizontalSizeCm = 60;
+    monitor->verticalSizeCm = 34;
+    monitor->gammaFactor = 120;
+    memset(monitor->stdTiming, 0x01, sizeof(monitor->stdTiming));
+
+    // the preferred timing is the first detailed one; only the active area
+    // matters to the loader, the rest is plausible CVT blanking
+    VBEEDIDTiming *timing = &monitor->timing[0];
+    uint16_t hBlank = 160, vBlank = 45;
+    uint32_t clock = ((uint32_t)(machine.edidWidth + hBlank) * (machine.edidHeight + vBlank) * 60) / 10000;
+    timing->hFrequency = clock & 0xFF;      // pixel clock in 10 kHz units
+    timing->vFrequency = clock >> 8;
+    timing->hActiveLow = machine.edidWidth & 0xFF;
+    timing->hBlankLow = hBlank & 0xFF;
+    timing->hActiveBlankHigh = ((machine.edidWidth >> 8) << 4) | (hBlank >> 8);
+    timing->vActiveLow = machine.edidHeight & 0xFF;
+    timing->vBlankLow = vBlank & 0xFF;
+    timing->vActiveBlankHigh = ((machine.edidHeight >> 8) << 4) | (vBlank >> 8);
+    timing->hSync = 48;
+    timing->hSyncPulse = 32;
+    timing->vSync = 0x35;
+    timing->displayType = 0x1E;
+
+    uint8_t sum = 0;
+    for(int i = 0; i < VBE_EDID_SIZE - 1; i++) sum += edid[i];
+    monitor->checksum = -sum;
+}
+
+/*
+ * simBIOSInit(): sets up the memory map, the video BIOS data, and the EDID
+ * this must be called after RAM is mapped and the machine is configured
+ * params: none
+ * returns: nothing
+ */
+
+void simBIOSInit() {
+    memset(&counters, 0, sizeof(SimCounters));
+
+    // conventional memory up to the EBDA, the BIOS area, and the rest of RAM
+    e820Count = 0;
+    e820[e820Count++] = (MemoryMap){ 0, SIM_BASE_MEMORY, MEMORY_TYPE_USABLE, MEMORY_ATTRIBUTES_VALID };
+    e820[e820Count++] = (MemoryMap){ SIM_BASE_MEMORY, 0xA0000 - SIM_BASE_MEMORY, 2, MEMORY_ATTRIBUTES_VALID };
+    e820[e820Count++] = (MemoryMap){ 0xE0000, 0x20000, 2, MEMORY_ATTRIBUTES_VALID };
+    e820[e820Count++] = (MemoryMap){ SIM_HIGH_MEMORY, machine.ram - SIM_HIGH_MEMORY, MEMORY_TYPE_USABLE, MEMORY_ATTRIBUTES_VALID };
+
+    // the font stays blank, nobody looks at the screen
+    uint8_t *rom = (uint8_t *)(uintptr_t)SIM_ROM;
+    strcpy((char *)rom + SIM_ROM_OEM, "lxboot simulator");
+
+    uint16_t *modes = (uint16_t *)(rom + SIM_ROM_MODES);
+    for(int i = 0; i < machine.modeCount; i++) modes[i] = machine.modes[i].number;
+    modes[machine.modeCount] = 0xFFFF;
+
+    if(machine.edid) buildEDID();
+}
+
+/*
+ * simPrintCounters(): prints every BIOS service the loader used
+ * params: none
+ * returns: nothing
+ */
+
+void simPrintCounters() {
+    printf("%u trips to real mode (%u mode switches), %u with a single call, up to %u calls in one\n",
+        counters.trips, counters.trips * 2, counters.single, counters.largest);
+
+    printf(" int   ah    calls   failed    sectors\n");
+    for(int i = 0; i < counters.serviceCount; i++) {
+        SimService *s = &counters.services[i];
+        printf("0x%02X 0x%02X %8u %8u", s->vector, s->function, s->calls, s->failed);
+        if(s->vector == 0x13) printf(" %10llu", (unsigned long long)s->sectors);
+        printf("\n");
+    }
+
+    if(counters.unhandled) printf("%u calls to functions that aren't emulated\n", counters.unhandled);
+    printf("%u port reads, %u port writes, %u MSR reads, %u MSR writes\n",
+        counters.portReads, counters.portWrites, counters.msrReads, counters.msrWrites);
+}
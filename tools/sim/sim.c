@@ -0,0 +1,384 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* Boot simulator: the machine */
+/* maps emulated RAM and the framebuffer, fills in the BIOS data area and the
+ * boot info the way the earlier stages would, runs the core's main(), and
+ * reports on the KernelBootInfo it hands off */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sim.h"
+
+#define DEFAULT_MODES           "640x480x32,800x600x16,800x600x32,1024x768x16,1024x768x32,1280x720x32,1280x1024x32,1920x1080x32"
+#define FIRST_MODE              0x140       // numbered like the Bochs VBE extensions
+#define COM1                    0x3F8
+#define MAX_MSRS                32
+
+SimMachine machine;
+
+static struct {
+    uint32_t msr;
+    uint64_t value;
+} msrs[MAX_MSRS];
+static int msrCount = 0;
+
+static uint64_t cr0 = 0x80000011;       // paging, protection, and an FPU
+static uint64_t cr3 = 0x60000;          // early page tables, see main.asm
+static uint64_t cr4 = 0x00000620;       // PAE and SSE
+static uint8_t serialLineControl = 0;
+static uint8_t serialScratch = 0;
+static uint32_t pmTimer = 0;
+
+/* the APs are never started here, so the trampoline is only a placeholder of
+ * the right shape for smp.c */
+__asm__(
+    ".section .rodata\n"
+    ".globl lx_smpTrampoline, lx_smpTrampolineGDT, lx_smpTrampolineLong, lx_smpTrampolinePark, lx_smpTrampolineEnd\n"
+    "lx_smpTrampoline: .fill 64, 1, 0xF4\n"
+    "lx_smpTrampolineGDT: .fill 24, 1, 0\n"
+    "lx_smpTrampolineLong: .fill 16, 1, 0xF4\n"
+    "lx_smpTrampolinePark: .fill 16, 1, 0xF4\n"
+    "lx_smpTrampolineEnd:\n"
+    ".text\n"
+);
+
+/* privileged instructions, see cpu.h */
+
+uint64_t rdmsr(uint32_t msr) {
+    counters.msrReads++;
+    for(int i = 0; i < msrCount; i++) {
+        if(msrs[i].msr == msr) return msrs[i].value;
+    }
+
+    // a BSP with its APIC enabled, and no MTRRs to spare
+    if(msr == MSR_APIC_BASE) return 0xFEE00900;
+    if(msr == MSR_PAT) return 0x0007040600070406;
+    return 0;
+}
+
+void wrmsr(uint32_t msr, uint64_t value) {
+    counters.msrWrites++;
+    for(int i = 0; i < msrCount; i++) {
+        if(msrs[i].msr == msr) {
+            msrs[i].value = value;
+            return;
+        }
+    }
+
+    if(msrCount < MAX_MSRS) {
+        msrs[msrCount].msr = msr;
+        msrs[msrCount].value = value;
+        msrCount++;
+    }
+}
+
+uint64_t readCR0() {
+    return cr0;
+}
+
+void writeCR0(uint64_t value) {
+    cr0 = value;
+}
+
+uint64_t readCR4() {
+    return cr4;
+}
+
+uint64_t readCR3() {
+    return cr3;
+}
+
+void writeCR3(uint64_t value) {
+    cr3 = value;
+}
+
+void wbinvd() {
+}
+
+void outb(uint16_t port, uint8_t value) {
+    counters.portWrites++;
+    if(!machine.serial || port < COM1 || port > COM1 + 7) return;
+
+    if(port == COM1 + 3) serialLineControl = value;
+    else if(port == COM1 + 7) serialScratch = value;
+    else if(port == COM1 && !(serialLineControl & 0x80)) putchar(value);
+}
+
+uint8_t inb(uint16_t port) {
+    counters.portReads++;
+
+    // the PIT channel 2 output is always high, so every delay is over at once
+    if(port == 0x61) return 0x20;
+
+    if(machine.serial && port == COM1 + 5) return 0x60;     // transmitter empty
+    if(machine.serial && port == COM1 + 7) return serialScratch;
+    return 0xFF;
+}
+
+uint32_t inl(uint16_t port) {
+    counters.portReads++;
+    pmTimer += 1024;
+    return pmTimer;
+}
+
+static void printScreen() {
+    // whatever is left in VGA text memory, usually the reason for the halt
+    volatile uint16_t *vga = (volatile uint16_t *)(uintptr_t)0xB8000;
+    for(int y = 0; y < 25; y++) {
+        char line[81];
+        int length = 0;
+        for(int x = 0; x < 80; x++) {
+            char c = vga[(y * 80) + x] & 0xFF;
+            line[x] = (c >= 0x20 && c < 0x7F) ? c : ' ';
+            if(line[x] != ' ') length = x + 1;
+        }
+
+        line[length] = 0;
+        if(length) printf("| %s\n", line);
+    }
+}
+
+void halt() {
+    fflush(stdout);
+    printf("\nthe loader halted, screen:\n");
+    printScreen();
+    printf("\n");
+    simPrintCounters();
+    exit(1);
+}
+
+/*
+ * simHandoff(): prints the boot info the kernel would get and the BIOS counts
+ * params: pml4 - page tables for the kernel
+ * params: entry - kernel entry point
+ * params: k - boot info for the kernel
+ * returns: never, the simulator exits
+ */
+
+void simHandoff(uint64_t pml4, uint64_t entry, KernelBootInfo *k) {
+    // the boot log has the measured TSC frequency in it, so it is left out of
+    // the report unless asked for, to keep runs comparable
+    fflush(stdout);
+    if(machine.verbose && k->bootLog) {
+        printf("boot log, %u bytes:\n", k->bootLogSize);
+        fwrite((const void *)(uintptr_t)k->bootLog, 1, k->bootLogSize, stdout);
+        printf("\n");
+    }
+
+    if(k->magic != 0x5346584C) {
+        printf("bad boot info magic 0x%08X\n", k->magic);
+        exit(1);
+    }
+
+    printf("kernel entry 0x%llX, page tables at 0x%llX, boot info version %u\n",
+        (unsigned long long)entry, (unsigned long long)pml4, k->version);
+    printf("boot disk 0x%02X partition %u at LBA %u\n", k->biosBootDisk, k->biosBootPartitionIndex, k->biosBootPartition.start);
+    printf("kernel ends at 0x%llX, %llu bytes\n", (unsigned long long)k->kernelHighestAddress, (unsigned long long)k->kernelTotalSize);
+    printf("arguments \"%s\"\n", k->arguments);
+
+    printf("\nmemory map, %u entries up to 0x%llX:\n", k->memoryMapSize, (unsigned long long)k->highestPhysicalAddress);
+    MemoryMap *map = (MemoryMap *)(uintptr_t)k->memoryMap;
+    for(int i = 0; i < k->memoryMapSize; i++) {
+        printf("  0x%016llX 0x%016llX %u\n", (unsigned long long)map[i].base, (unsigned long long)map[i].len, map[i].type);
+    }
+
+    printf("\nloader allocations, %u ranges, lowest free memory 0x%llX:\n", k->bootMemoryCount, (unsigned long long)k->lowestFreeMemory);
+    BootMemoryRange *ranges = (BootMemoryRange *)(uintptr_t)k->bootMemory;
+    for(int i = 0; i < k->bootMemoryCount; i++) {
+        printf("  0x%016llX 0x%016llX %u\n", (unsigned long long)ranges[i].base, (unsigned long long)ranges[i].size, ranges[i].type);
+    }
+
+    printf("\n");
+    if(k->ramdisk || k->ramdiskSize) {
+        printf("ramdisk at 0x%llX, %llu of %llu bytes loaded, flags 0x%02X, %u extents, %u indexed files\n",
+            (unsigned long long)k->ramdisk, (unsigned long long)k->ramdiskLoaded, (unsigned long long)k->ramdiskSize,
+            k->ramdiskFlags, k->ramdiskExtentCount, k->ramdiskIndexCount);
+    }
+
+    for(int i = 0; i < k->moduleCount && i < 16; i++) {
+        printf("module %s at 0x%llX, %llu bytes\n", (const char *)(uintptr_t)k->moduleNames[i],
+            (unsigned long long)k->modules[i], (unsigned long long)k->moduleSizes[i]);
+    }
+
+    printf("%u preloaded files\n", k->preloadCount);
+
+    if(k->videoModeCount) {
+        printf("video %ux%ux%u at 0x%llX, pitch %u, mode %u of %u, %s EDID, caching %u\n",
+            k->width, k->height, k->bpp, (unsigned long long)k->framebuffer, k->pitch,
+            k->videoModeCurrent, k->videoModeCount, k->edid ? "with" : "without", k->framebufferCaching);
+    }
+
+    static const char *consoles[] = { "framebuffer", "text", "serial" };
+    printf("console %s", (k->consoleType <= CONSOLE_SERIAL) ? consoles[k->consoleType] : "unknown");
+    if(k->consoleType == CONSOLE_TEXT) printf(" %ux%u", k->consoleColumns, k->consoleRows);
+    printf(", serial port 0x%03X\n", k->consoleSerialPort);
+
+    printf("%u CPUs, %u ACPI tables, %u NUMA domains\n", k->cpuCount, k->acpiTableCount, k->numaDomainCount);
+
+    printf("\n");
+    simPrintCounters();
+    exit(0);
+}
+
+static bool parseModes(const char *list) {
+    machine.modeCount = 0;
+    while(*list) {
+        unsigned width, height, bpp;
+        int length;
+        if(sscanf(list, "%ux%ux%u%n", &width, &height, &bpp, &length) != 3) return false;
+        if(bpp != 8 && bpp != 15 && bpp != 16 && bpp != 24 && bpp != 32) return false;
+        if(!width || !height || ((uint64_t)width * ((bpp + 7) / 8) * height) > SIM_FRAMEBUFFER_SIZE) return false;
+        if(machine.modeCount >= SIM_MAX_MODES) return false;
+
+        SimMode *mode = &machine.modes[machine.modeCount];
+        mode->number = FIRST_MODE + machine.modeCount;
+        mode->width = width;
+        mode->height = height;
+        mode->bpp = bpp;
+        machine.modeCount++;
+
+        list += length;
+        if(*list == ',') list++;
+        else if(*list) return false;
+    }
+
+    return machine.modeCount > 0;
+}
+
+static bool findPartition(LXBootInfo *info) {
+    // the boot sector passes on the first LXFS partition, so do the same
+    uint8_t mbr[512];
+    if(pread(machine.image, mbr, 512, 0) != 512) return false;
+
+    for(int i = 0; i < 4; i++) {
+        MBRPartition *partition = (MBRPartition *)(mbr + MBR_PARTITION_OFFSET) + i;
+        if(partition->id == MBR_ID_LXFS && partition->start) {
+            memcpy(&info->partition, partition, sizeof(MBRPartition));
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool mapMemory() {
+    // emulated physical memory is identity mapped, from page zero up
+    void *ram = mmap(NULL, machine.ram, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    if(ram != NULL) return false;
+
+    void *framebuffer = mmap((void *)SIM_FRAMEBUFFER, SIM_FRAMEBUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED_NOREPLACE, -1, 0);
+    return framebuffer == (void *)SIM_FRAMEBUFFER;
+}
+
+static void fillBDA() {
+    uint8_t *bda = (uint8_t *)(uintptr_t)0x400;
+    *(uint16_t *)(bda + 0x00) = machine.serial ? COM1 : 0;
+    *(uint16_t *)(bda + 0x0E) = SIM_BASE_MEMORY >> 4;      // EBDA segment
+    *(uint16_t *)(bda + 0x13) = SIM_BASE_MEMORY >> 10;     // KiB of conventional memory
+    *(uint8_t *)(bda + 0x49) = 0x03;                        // 80x25 color text
+    *(uint16_t *)(bda + 0x4A) = 80;
+    *(uint16_t *)(bda + 0x63) = 0x3D4;                      // CRTC
+    *(uint8_t *)(bda + 0x84) = 24;                          // rows - 1
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [-m MiB] [-M WxHxBPP,...] [-e WxH|none] [-d drive] [-s] [-v] image\n", name);
+    fprintf(stderr, "  -m  RAM size, %d MiB by default\n", SIM_RAM_DEFAULT);
+    fprintf(stderr, "  -M  VBE mode list, by default %s\n", DEFAULT_MODES);
+    fprintf(stderr, "  -e  preferred resolution in the monitor's EDID, 1920x1080 by default\n");
+    fprintf(stderr, "  -d  BIOS drive number of the image, 0x80 by default\n");
+    fprintf(stderr, "  -s  COM1 is present and written to stdout\n");
+    fprintf(stderr, "  -v  print BIOS teletype output and the boot log\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    memset(&machine, 0, sizeof(SimMachine));
+    machine.ram = (uint64_t)SIM_RAM_DEFAULT << 20;
+    machine.disk = 0x80;
+    machine.edid = true;
+    machine.edidWidth = 1920;
+    machine.edidHeight = 1080;
+    parseModes(DEFAULT_MODES);
+
+    int i = 1;
+    for(; i < argc && argv[i][0] == '-'; i++) {
+        if(!strcmp(argv[i], "-m") && i + 1 < argc) {
+            unsigned long mib = strtoul(argv[++i], NULL, 0);
+            if(mib < 16 || mib > SIM_RAM_MAX) usage(argv[0]);
+            machine.ram = (uint64_t)mib << 20;
+        } else if(!strcmp(argv[i], "-M") && i + 1 < argc) {
+            if(!parseModes(argv[++i])) usage(argv[0]);
+        } else if(!strcmp(argv[i], "-e") && i + 1 < argc) {
+            unsigned width, height;
+            i++;
+            if(!strcmp(argv[i], "none")) machine.edid = false;
+            else if(sscanf(argv[i], "%ux%u", &width, &height) == 2 && width && height && width < 4096 && height < 4096) {
+                machine.edidWidth = width;
+                machine.edidHeight = height;
+            } else {
+                usage(argv[0]);
+            }
+        } else if(!strcmp(argv[i], "-d") && i + 1 < argc) {
+            machine.disk = strtoul(argv[++i], NULL, 0);
+        } else if(!strcmp(argv[i], "-s")) {
+            machine.serial = true;
+        } else if(!strcmp(argv[i], "-v")) {
+            machine.verbose = true;
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+    if(i != argc - 1) usage(argv[0]);
+
+    struct stat st;
+    machine.image = open(argv[i], O_RDONLY);
+    if(machine.image < 0 || fstat(machine.image, &st)) {
+        fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[i]);
+        return 2;
+    }
+
+    machine.imageSectors = st.st_size / 512;
+
+    LXBootInfo info;
+    memset(&info, 0, sizeof(LXBootInfo));
+    info.bootDevice = machine.disk;
+    if(!findPartition(&info)) {
+        fprintf(stderr, "%s: no LXFS partition in %s\n", argv[0], argv[i]);
+        return 2;
+    }
+
+    if(!mapMemory()) {
+        fprintf(stderr, "%s: cannot map physical memory at address zero, this needs root or vm.mmap_min_addr=0\n", argv[0]);
+        return 2;
+    }
+
+    fillBDA();
+    simBIOSInit();
+
+    // what main.asm hands to the core; timestamps stay zero because the
+    // earlier stages didn't run
+    info.videoAPI = (uint32_t)(uintptr_t)simVideoAPI;
+    info.diskAPI = (uint32_t)(uintptr_t)simDiskAPI;
+    info.miscAPI = (uint32_t)(uintptr_t)simMiscAPI;
+    info.lmode = (uint32_t)(uintptr_t)simLongMode;
+    info.regs = (uint32_t)(uintptr_t)&simRegisters;
+    info.batchAPI = (uint32_t)(uintptr_t)simBatch;
+
+    lx_main(&info);
+
+    fprintf(stderr, "%s: the loader returned from main()\n", argv[0]);
+    return 3;
+}
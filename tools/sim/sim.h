@@ -0,0 +1,110 @@
+/*
+ * lux - a lightweight unix-like operating system
+ * Omar Elghoul, 2024
+ * 
+ * Boot loader for the x86_64 architecture
+ */
+
+/* Boot simulator */
+/* the whole core is built for Linux with every symbol prefixed with lx_ and
+ * runs from main() to the jump to the kernel; emulated RAM is mapped at
+ * physical address zero, the BIOS services behind the boot info are emulated
+ * here, and privileged instructions go through the hooks in cpu.h */
+
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* the loader functions the simulator stands in for, see sim.c */
+#define halt                    lx_halt
+#define rdmsr                   lx_rdmsr
+#define wrmsr                   lx_wrmsr
+#define readCR0                 lx_readCR0
+#define writeCR0                lx_writeCR0
+#define readCR4                 lx_readCR4
+#define readCR3                 lx_readCR3
+#define writeCR3                lx_writeCR3
+#define outb                    lx_outb
+#define inb                     lx_inb
+#define inl                     lx_inl
+#define wbinvd                  lx_wbinvd
+
+#include "../../src/include/lxboot.h"
+#include "../../src/include/vbe.h"
+#include "../../src/include/cpu.h"
+
+int lx_main(LXBootInfo *);
+
+/* physical memory layout; the simulator itself is linked above all of this
+ * and below 4 GiB, because the boot info only holds 32-bit pointers */
+#define SIM_RAM_DEFAULT         256         // MiB
+#define SIM_RAM_MAX             1024
+#define SIM_BASE_MEMORY         0x9FC00     // EBDA from here to 640 KiB
+#define SIM_ROM                 0xC0000     // video BIOS, the VBE mode list and the font
+#define SIM_HIGH_MEMORY         0x100000
+#define SIM_FRAMEBUFFER         0x40000000
+#define SIM_FRAMEBUFFER_SIZE    (16 << 20)
+
+#define SIM_MAX_MODES           32
+#define SIM_MAX_SERVICES        32
+
+/* one VBE mode the emulated video BIOS lists */
+typedef struct {
+    uint16_t number;
+    uint16_t width;
+    uint16_t height;
+    uint8_t bpp;
+} SimMode;
+
+/* one BIOS function, by interrupt and AH */
+typedef struct {
+    uint8_t vector;
+    uint8_t function;
+    uint32_t calls;
+    uint32_t failed;            // returned with CF set or a VBE error
+    uint64_t sectors;           // INT 13h transfers only
+} SimService;
+
+typedef struct {
+    uint32_t trips;             // visits to real mode, each two mode switches
+    uint32_t single;            // visits with only one call
+    uint32_t largest;           // most calls in one visit
+    uint32_t unhandled;         // calls to functions the simulator doesn't know
+    uint32_t portReads;
+    uint32_t portWrites;
+    uint32_t msrReads;
+    uint32_t msrWrites;
+    int serviceCount;
+    SimService services[SIM_MAX_SERVICES];
+} SimCounters;
+
+/* machine configuration, from the command line */
+typedef struct {
+    int image;                  // file descriptor
+    uint64_t imageSectors;
+    uint64_t ram;               // bytes
+    uint8_t disk;               // BIOS drive number of the image
+    bool serial;                // COM1 present, written to stdout
+    bool verbose;
+    bool edid;
+    uint16_t edidWidth;         // preferred timing of the monitor
+    uint16_t edidHeight;
+    int modeCount;
+    SimMode modes[SIM_MAX_MODES];
+} SimMachine;
+
+extern SimMachine machine;
+extern SimCounters counters;
+extern BIOSCall simRegisters;
+
+void *simAddress(uint16_t, uint32_t);
+void simBIOSInit();
+void simBatch(BIOSCall *, uint32_t);
+void simVideoAPI();
+void simDiskAPI();
+void simMiscAPI();
+void simLongMode(uint64_t, uint64_t, KernelBootInfo *);
+void simPrintCounters();
+void simHandoff(uint64_t, uint64_t, KernelBootInfo *) __attribute__((noreturn));